@@ -0,0 +1,141 @@
+/*
+ * Arena (bump) allocator. Memory is taken from big chunks and is never
+ * freed separately -- only the whole arena at once, which costs one free()
+ * per chunk. Used for trees with a lot of small nodes and strings.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "stats.h"
+
+#define ALIGN 8
+
+#define MIN_CHUNK_SZ (64 * 1024)
+#define MAX_CHUNK_SZ (4 * 1024 * 1024)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	/* Keep data aligned */
+	double data[];
+};
+
+void arena_init(struct arena *arena)
+{
+	arena->chunks = NULL;
+	arena->p = arena->end = NULL;
+	arena->chunk_sz = MIN_CHUNK_SZ;
+	arena->size = 0;
+}
+
+static struct arena_chunk *new_chunk(size_t sz)
+{
+	struct arena_chunk *chunk;
+
+	chunk = malloc(sizeof(*chunk) + sz);
+	if (chunk)
+		STATS_ALLOC(sizeof(*chunk) + sz);
+
+	return chunk;
+}
+
+void *arena_alloc(struct arena *arena, size_t sz)
+{
+	struct arena_chunk *chunk;
+	void *p;
+
+	sz = (sz + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+
+	if (arena->end - arena->p >= sz) {
+		p = arena->p;
+		arena->p += sz;
+		return p;
+	}
+
+	/*
+	 * Big block gets a chunk of its own, so that the rest of
+	 * the current chunk is not wasted.
+	 */
+	if (sz > arena->chunk_sz / 4) {
+		chunk = new_chunk(sz);
+		if (!chunk)
+			return NULL;
+		arena->size += sz;
+
+		if (arena->chunks) {
+			chunk->next = arena->chunks->next;
+			arena->chunks->next = chunk;
+		} else {
+			chunk->next = NULL;
+			arena->chunks = chunk;
+		}
+
+		return chunk->data;
+	}
+
+	chunk = new_chunk(arena->chunk_sz);
+	if (!chunk)
+		return NULL;
+	arena->size += arena->chunk_sz;
+
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	arena->p = (char *)chunk->data + sz;
+	arena->end = (char *)chunk->data + arena->chunk_sz;
+
+	if (arena->chunk_sz < MAX_CHUNK_SZ)
+		arena->chunk_sz *= 2;
+
+	return chunk->data;
+}
+
+void *arena_zalloc(struct arena *arena, size_t sz)
+{
+	void *p;
+
+	p = arena_alloc(arena, sz);
+	if (p)
+		memset(p, 0, sz);
+
+	return p;
+}
+
+/* Copy @n chars of @s and null-terminate */
+char *arena_strndup(struct arena *arena, const char *s, size_t n)
+{
+	char *p;
+
+	p = arena_alloc(arena, n + 1);
+	if (!p)
+		return NULL;
+
+	memcpy(p, s, n);
+	p[n] = '\0';
+
+	return p;
+}
+
+char *arena_mark(struct arena *arena)
+{
+	return arena->p;
+}
+
+void arena_rewind(struct arena *arena, char *mark)
+{
+	if (arena->chunks && mark >= (char *)arena->chunks->data
+	    && mark <= arena->p)
+		arena->p = mark;
+}
+
+void arena_free(struct arena *arena)
+{
+	struct arena_chunk *p, *q;
+
+	for (p = arena->chunks; p; p = q) {
+		q = p->next;
+		free(p);
+	}
+
+	arena_init(arena);
+}
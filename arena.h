@@ -0,0 +1,35 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+struct arena_chunk;
+
+/* Bump allocator: everything is freed at once */
+struct arena {
+	struct arena_chunk *chunks;
+	char *p;
+	char *end;
+	size_t chunk_sz; /* Size of the next chunk */
+	size_t size; /* Taken from malloc() */
+};
+
+void arena_init(struct arena *arena);
+
+void *arena_alloc(struct arena *arena, size_t sz);
+
+void *arena_zalloc(struct arena *arena, size_t sz);
+
+char *arena_strndup(struct arena *arena, const char *s, size_t n);
+
+/*
+ * Give back everything allocated since arena_mark(). Only done if no new
+ * chunk was taken since then, otherwise the memory is just kept.
+ */
+char *arena_mark(struct arena *arena);
+
+void arena_rewind(struct arena *arena, char *mark);
+
+void arena_free(struct arena *arena);
+
+#endif
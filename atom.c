@@ -0,0 +1,128 @@
+/*
+ * Symbol table. Each distinct name is stored once and is identified by
+ * an integer atom. Well-known names are interned first, so their atoms
+ * are compile-time constants (see atom.h).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "atom.h"
+#include "hash.h"
+
+#define ATOM(id, name) name,
+static const char *well_known[] = {
+	"",
+	WELL_KNOWN_ATOMS
+};
+#undef ATOM
+
+static int grow(struct atoms *atoms)
+{
+	const char **names;
+	int *htab, i, sz = atoms->sz * 2;
+	unsigned h, hmask = sz * 2 - 1;
+
+	names = realloc(atoms->names, sz * sizeof(*names));
+	if (!names)
+		return -1;
+	atoms->names = names;
+
+	htab = calloc(hmask + 1, sizeof(*htab));
+	if (!htab)
+		return -1;
+
+	for (i = 1; i < atoms->n; i++) {
+		h = hash_mem(names[i], strlen(names[i])) & hmask;
+		while (htab[h])
+			h = (h + 1) & hmask;
+		htab[h] = i;
+	}
+
+	free(atoms->htab);
+	atoms->htab = htab;
+	atoms->hmask = hmask;
+	atoms->sz = sz;
+
+	return 0;
+}
+
+int atoms_init(struct atoms *atoms)
+{
+	int i;
+
+	arena_init(&atoms->arena);
+	atoms->names = NULL;
+	atoms->htab = NULL;
+	atoms->n = 1; /* ATOM_UNKNOWN */
+	atoms->sz = 64;
+	while (atoms->sz < 2 * ATOM_NR_WELL_KNOWN)
+		atoms->sz *= 2;
+	atoms->sz /= 2; /* grow() doubles it */
+
+	if (grow(atoms))
+		goto err;
+
+	atoms->names[0] = well_known[0];
+	for (i = 1; i < ATOM_NR_WELL_KNOWN; i++) {
+		if (atoms_intern(atoms, well_known[i],
+				 strlen(well_known[i])) != i)
+			goto err;
+	}
+
+	return 0;
+
+err:
+	atoms_free(atoms);
+	return -1;
+}
+
+/* Return atom of the name. Add the name if it is new. -1 if no memory */
+int atoms_intern(struct atoms *atoms, const char *s, int len)
+{
+	unsigned h;
+	int a;
+	char *p;
+
+	h = hash_mem(s, len) & atoms->hmask;
+	while ((a = atoms->htab[h])) {
+		if (!strncmp(atoms->names[a], s, len) && !atoms->names[a][len])
+			return a;
+		h = (h + 1) & atoms->hmask;
+	}
+
+	if (atoms->n == atoms->sz) {
+		if (grow(atoms))
+			return -1;
+		/* Find a free slot in the new table */
+		return atoms_intern(atoms, s, len);
+	}
+
+	/* Well-known names are static, no need to copy */
+	if (atoms->n < ATOM_NR_WELL_KNOWN) {
+		atoms->names[atoms->n] = well_known[atoms->n];
+	} else {
+		p = arena_strndup(&atoms->arena, s, len);
+		if (!p)
+			return -1;
+		atoms->names[atoms->n] = p;
+	}
+
+	atoms->htab[h] = atoms->n;
+
+	return atoms->n++;
+}
+
+const char *atoms_name(struct atoms *atoms, int atom)
+{
+	return atoms->names[atom];
+}
+
+void atoms_free(struct atoms *atoms)
+{
+	arena_free(&atoms->arena);
+	free(atoms->names);
+	free(atoms->htab);
+	atoms->names = NULL;
+	atoms->htab = NULL;
+}
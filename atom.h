@@ -0,0 +1,69 @@
+#ifndef _ATOM_H
+#define _ATOM_H
+
+#include "arena.h"
+
+/*
+ * Well-known names. They have the same atom in every table, so that
+ * hot paths can dispatch on them with an integer compare.
+ */
+#define WELL_KNOWN_ATOMS \
+	ATOM(OFFICE_DOCUMENT_CONTENT,     "office:document-content")     \
+	ATOM(OFFICE_BODY,                 "office:body")                 \
+	ATOM(OFFICE_SPREADSHEET,          "office:spreadsheet")          \
+	ATOM(OFFICE_VALUE_TYPE,           "office:value-type")           \
+	ATOM(OFFICE_VALUE,                "office:value")                \
+	ATOM(OFFICE_DATE_VALUE,           "office:date-value")           \
+	ATOM(OFFICE_TIME_VALUE,           "office:time-value")           \
+	ATOM(OFFICE_BOOLEAN_VALUE,        "office:boolean-value")        \
+	ATOM(OFFICE_STRING_VALUE,         "office:string-value")         \
+	ATOM(OFFICE_CURRENCY,             "office:currency")             \
+	ATOM(TABLE_TABLE,                 "table:table")                 \
+	ATOM(TABLE_NAME,                  "table:name")                  \
+	ATOM(TABLE_STYLE_NAME,            "table:style-name")            \
+	ATOM(TABLE_TABLE_COLUMN,          "table:table-column")          \
+	ATOM(TABLE_TABLE_HEADER_ROWS,     "table:table-header-rows")     \
+	ATOM(TABLE_TABLE_ROW_GROUP,       "table:table-row-group")       \
+	ATOM(TABLE_TABLE_ROWS,            "table:table-rows")            \
+	ATOM(TABLE_TABLE_ROW,             "table:table-row")             \
+	ATOM(TABLE_NUMBER_ROWS_REPEATED,  "table:number-rows-repeated")  \
+	ATOM(TABLE_TABLE_CELL,            "table:table-cell")            \
+	ATOM(TABLE_COVERED_TABLE_CELL,    "table:covered-table-cell")    \
+	ATOM(TABLE_NUMBER_COLUMNS_REPEATED, "table:number-columns-repeated") \
+	ATOM(TABLE_NUMBER_COLUMNS_SPANNED, "table:number-columns-spanned") \
+	ATOM(TABLE_NUMBER_ROWS_SPANNED,   "table:number-rows-spanned")   \
+	ATOM(TABLE_FORMULA,               "table:formula")               \
+	ATOM(TEXT_P,                      "text:p")                      \
+	ATOM(TEXT_SPAN,                   "text:span")                   \
+	ATOM(TEXT_S,                      "text:s")                      \
+	ATOM(TEXT_A,                      "text:a")                      \
+	ATOM(TEXT_LINE_BREAK,             "text:line-break")             \
+	ATOM(TEXT_TAB,                    "text:tab")                    \
+	ATOM(CALCEXT_VALUE_TYPE,          "calcext:value-type")          \
+
+#define ATOM(id, name) ATOM_##id,
+enum {
+	ATOM_UNKNOWN = 0, /* Not an interned name (e.g. text) */
+	WELL_KNOWN_ATOMS
+	ATOM_NR_WELL_KNOWN
+};
+#undef ATOM
+
+/* Symbol table: name <-> atom */
+struct atoms {
+	struct arena arena; /* Names */
+	const char **names; /* By atom */
+	int n, sz;
+	int *htab; /* Open addressing, 0 is a free slot */
+	unsigned hmask;
+};
+
+int atoms_init(struct atoms *atoms);
+
+int atoms_intern(struct atoms *atoms, const char *s, int len);
+
+const char *atoms_name(struct atoms *atoms, int atom);
+
+void atoms_free(struct atoms *atoms);
+
+#endif
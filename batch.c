@@ -0,0 +1,248 @@
+/*
+ * Batch mode: a workbook per task.
+ *
+ * Every worker opens its workbook with its own ebuf and loads only the
+ * requested sheet and area, the rows are printed into a memory buffer
+ * of the job. The caller's thread takes the jobs in the order of files
+ * and writes them out, a finished slot is then given the next file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "batch.h"
+#include "ods.h"
+#include "pool.h"
+
+struct batch;
+
+struct book_job {
+	struct pool_task task; /* Must be the first */
+	struct batch *bt;
+	const char *path;
+	char *line; /* File name read from stdin */
+	size_t line_sz;
+	FILE *fp; /* Rows into @out */
+	char *out;
+	size_t len;
+	int err;
+	int done;
+	struct ebuf ebuf;
+	char ebuf_buf[1024];
+};
+
+struct batch {
+	const struct batch_opts *opts;
+	char **files; /* NULL: names come from stdin */
+	int nfiles;
+	int next;
+	pthread_mutex_t lock;
+	pthread_cond_t done; /* A job is finished */
+};
+
+/* Row of the CLI output tagged with the file name */
+static int print_row(void *priv, int row, const char **vals, int n)
+{
+	struct book_job *job = (struct book_job *)priv;
+	FILE *fp = job->fp;
+	int i;
+
+	fputs(job->path, fp);
+	for (i = 0; i < n; i++) {
+		fputc('\t', fp);
+		fputs(vals[i] ? vals[i] : "(null)", fp);
+	}
+	fputc('\n', fp);
+
+	return 0;
+}
+
+static int read_rows(struct book_job *job)
+{
+	const struct batch_opts *o = job->bt->opts;
+	const char *sheets[2] = { o->sheet, NULL };
+	struct ods_opts opts;
+	void *ctx, *sheet;
+	int err = -1;
+
+	/* Nothing but the area is needed */
+	memset(&opts, 0, sizeof(opts));
+	opts.sheets = sheets;
+	opts.area = 1;
+	opts.row1 = o->row1;
+	opts.col1 = o->col1;
+	opts.row2 = o->row2;
+	opts.col2 = o->col2;
+
+	ctx = ods_open_ex(job->path, &opts, &job->ebuf);
+	if (!ctx)
+		return -1;
+
+	sheet = ods_open_sheet(ctx, o->sheet, &job->ebuf);
+	if (sheet) {
+		err = ods_sheet_rows(sheet, o->row1, o->col1, o->row2,
+				     o->col2, print_row, job, &job->ebuf);
+		ods_close_sheet(sheet);
+	}
+
+	ods_close(ctx);
+
+	return err;
+}
+
+static void read_book(struct pool_task *task)
+{
+	struct book_job *job = (struct book_job *)task;
+	struct batch *bt = job->bt;
+
+	job->fp = open_memstream(&job->out, &job->len);
+	if (!job->fp) {
+		ebuf_add(&job->ebuf, "batch: no memory for output\n");
+		job->err = -1;
+	} else {
+		job->err = read_rows(job);
+		if (fclose(job->fp) && !job->err) {
+			ebuf_add(&job->ebuf, "batch: no memory for output\n");
+			job->err = -1;
+		}
+	}
+
+	pthread_mutex_lock(&bt->lock);
+	job->done = 1;
+	pthread_cond_broadcast(&bt->done);
+	pthread_mutex_unlock(&bt->lock);
+}
+
+/* Give the job the next file. 0 if there are no more */
+static int setup_job(struct batch *bt, struct book_job *job)
+{
+	ssize_t n;
+
+	if (bt->files) {
+		if (bt->next == bt->nfiles)
+			return 0;
+		job->path = bt->files[bt->next++];
+	} else {
+		/* Empty lines are skipped */
+		do {
+			n = getline(&job->line, &job->line_sz, stdin);
+			if (n < 0)
+				return 0;
+			if (n && job->line[n - 1] == '\n')
+				job->line[--n] = '\0';
+		} while (!n);
+		job->path = job->line;
+	}
+
+	free(job->out);
+	job->out = NULL;
+	job->len = 0;
+	job->err = 0;
+	job->done = 0;
+	ebuf_init(&job->ebuf, job->ebuf_buf, sizeof(job->ebuf_buf));
+
+	return 1;
+}
+
+/* Rows to stdout, errors to stderr. Returns 1 if the file has failed */
+static int emit_job(struct book_job *job)
+{
+	const char *s, *e;
+
+	if (!job->err) {
+		fwrite(job->out, 1, job->len, stdout);
+		return 0;
+	}
+
+	for (s = ebuf_s(&job->ebuf); *s; s = e) {
+		e = strchr(s, '\n');
+		e = e ? e + 1 : s + strlen(s);
+		fprintf(stderr, "%s: %.*s", job->path, (int)(e - s), s);
+	}
+
+	return 1;
+}
+
+int batch(const struct batch_opts *opts, char **files, int nfiles,
+	  struct ebuf *ebuf)
+{
+	struct batch bt;
+	struct book_job *slots, *job;
+	struct pool *pool;
+	int i, k, nslots, nthreads, pending = 0, nfailed = 0;
+
+	memset(&bt, 0, sizeof(bt));
+	bt.opts = opts;
+	bt.files = files;
+	bt.nfiles = nfiles;
+
+	/* Slots ahead of the one being written out keep the workers busy */
+	nthreads = opts->jobs > 1 ? opts->jobs : 1;
+	nslots = nthreads * 2;
+
+	slots = calloc(nslots, sizeof(*slots));
+	if (!slots) {
+		ebuf_add(ebuf, "batch: no memory for jobs\n");
+		return -1;
+	}
+
+	pool = pool_new(nthreads, ebuf);
+	if (!pool) {
+		free(slots);
+		return -1;
+	}
+
+	pthread_mutex_init(&bt.lock, NULL);
+	pthread_cond_init(&bt.done, NULL);
+
+	for (i = 0; i < nslots; i++) {
+		slots[i].task.fn = read_book;
+		slots[i].bt = &bt;
+		if (!setup_job(&bt, &slots[i]))
+			break;
+		pool_submit(pool, &slots[i].task);
+		pending++;
+	}
+
+	/* The oldest job is always in the next slot */
+	for (k = 0; pending; k = (k + 1) % nslots) {
+		job = &slots[k];
+
+		pthread_mutex_lock(&bt.lock);
+		while (!job->done)
+			pthread_cond_wait(&bt.done, &bt.lock);
+		pthread_mutex_unlock(&bt.lock);
+
+		nfailed += emit_job(job);
+		pending--;
+
+		if (setup_job(&bt, job)) {
+			pool_submit(pool, &job->task);
+			pending++;
+		}
+	}
+
+	pool_free(pool);
+	pthread_mutex_destroy(&bt.lock);
+	pthread_cond_destroy(&bt.done);
+
+	for (i = 0; i < nslots; i++) {
+		free(slots[i].out);
+		free(slots[i].line);
+	}
+	free(slots);
+
+	if (fflush(stdout)) {
+		ebuf_add(ebuf, "batch: failed to write output\n");
+		return -1;
+	}
+
+	if (!files && ferror(stdin)) {
+		ebuf_add(ebuf, "batch: failed to read file names\n");
+		return -1;
+	}
+
+	return nfailed;
+}
@@ -0,0 +1,30 @@
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include "ebuf.h"
+
+/*
+ * Batch mode: the same cell area of the same sheet is read from many
+ * ods-files, workbooks are read on a thread pool.
+ *
+ * Every row goes to stdout as the CLI prints it, prefixed with the file
+ * name: "<ods-file>\t<val>\t<val>...". Files come out in the given order
+ * whatever order they are read in. A file that fails is reported to
+ * stderr, every line of its errors as "<ods-file>: <error>", and the
+ * batch goes on.
+ */
+
+struct batch_opts {
+	const char *sheet;
+	int row1, col1, row2, col2;
+	int jobs; /* Workbooks read at once. 0, 1: one */
+};
+
+/*
+ * @files: NULL to read the file names from stdin, one per line.
+ * Returns the number of failed files or -1 if the batch itself failed.
+ */
+int batch(const struct batch_opts *opts, char **files, int nfiles,
+	  struct ebuf *ebuf);
+
+#endif
@@ -0,0 +1,401 @@
+/*
+ * Benchmark of the reading phases, one by one:
+ *
+ *   zip      EOCDR search and Central Dir indexing, entry lookup
+ *   inflate  content.xml into memory
+ *   parse    xml_parse() of the inflated content.xml
+ *   open     ods_open(): all of the above as the library does it
+ *   build    ods_open_sheet() of every sheet
+ *   access   ods_sheet_val() of every cell, ods_sheet_rows() of the area
+ *   teardown ods_close_sheet(), ods_close()
+ *
+ * Every phase is run several times, the best time is taken. Allocations
+ * of the library are counted by wrapping malloc() and friends at link
+ * time (-Wl,--wrap=...), allocations inside libc and zlib are not seen.
+ * Results are saved as JSON, one metric per line, and may be compared
+ * with a saved baseline.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "../ods.h"
+#include "../xml.h"
+#include "../zip.h"
+
+#define MAX_METRICS 64
+
+void *__real_malloc(size_t sz);
+void *__real_calloc(size_t n, size_t sz);
+void *__real_realloc(void *p, size_t sz);
+
+static unsigned long nallocs, alloc_bytes;
+
+void *__wrap_malloc(size_t sz)
+{
+	__atomic_fetch_add(&nallocs, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&alloc_bytes, sz, __ATOMIC_RELAXED);
+
+	return __real_malloc(sz);
+}
+
+void *__wrap_calloc(size_t n, size_t sz)
+{
+	__atomic_fetch_add(&nallocs, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&alloc_bytes, n * sz, __ATOMIC_RELAXED);
+
+	return __real_calloc(n, sz);
+}
+
+void *__wrap_realloc(void *p, size_t sz)
+{
+	__atomic_fetch_add(&nallocs, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&alloc_bytes, sz, __ATOMIC_RELAXED);
+
+	return __real_realloc(p, sz);
+}
+
+struct metric {
+	char name[64];
+	double val;
+};
+
+static struct metric metrics[MAX_METRICS];
+static int nmetrics;
+
+static void add_metric(const char *name, double val)
+{
+	if (nmetrics == MAX_METRICS)
+		return;
+
+	snprintf(metrics[nmetrics].name, sizeof(metrics[nmetrics].name), "%s",
+		 name);
+	metrics[nmetrics++].val = val;
+}
+
+/* Phase being timed */
+struct phase {
+	const char *name;
+	int repeat; /* Runs in one measurement, results are per run */
+	double best; /* Seconds */
+	unsigned long allocs, bytes; /* Of the last run */
+	struct timespec t0;
+	unsigned long allocs0, bytes0;
+};
+
+static void phase_start(struct phase *ph)
+{
+	ph->allocs0 = nallocs;
+	ph->bytes0 = alloc_bytes;
+	clock_gettime(CLOCK_MONOTONIC, &ph->t0);
+}
+
+static void phase_end(struct phase *ph)
+{
+	struct timespec t;
+	double s;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	s = t.tv_sec - ph->t0.tv_sec + (t.tv_nsec - ph->t0.tv_nsec) / 1e9;
+	s /= ph->repeat;
+	if (!ph->best || s < ph->best)
+		ph->best = s;
+	ph->allocs = (nallocs - ph->allocs0) / ph->repeat;
+	ph->bytes = (alloc_bytes - ph->bytes0) / ph->repeat;
+}
+
+static void report_phase(const struct phase *ph, double mb, double cells)
+{
+	char name[64];
+
+	snprintf(name, sizeof(name), "%s_s", ph->name);
+	add_metric(name, ph->best);
+	if (mb) {
+		snprintf(name, sizeof(name), "%s_mb_s", ph->name);
+		add_metric(name, mb / ph->best);
+	}
+	if (cells) {
+		snprintf(name, sizeof(name), "%s_cells_s", ph->name);
+		add_metric(name, cells / ph->best);
+	}
+	snprintf(name, sizeof(name), "%s_allocs", ph->name);
+	add_metric(name, ph->allocs);
+	snprintf(name, sizeof(name), "%s_alloc_bytes", ph->name);
+	add_metric(name, ph->bytes);
+}
+
+enum {
+	PH_ZIP,
+	PH_INFLATE,
+	PH_PARSE,
+	PH_OPEN,
+	PH_BUILD,
+	PH_VAL,
+	PH_ROWS,
+	PH_TEARDOWN,
+	PH_NR,
+};
+
+#define ZIP_REPEAT 100
+
+static struct phase phases[PH_NR] = {
+	[PH_ZIP]      = { "zip", ZIP_REPEAT },
+	[PH_INFLATE]  = { "inflate", 1 },
+	[PH_PARSE]    = { "parse", 1 },
+	[PH_OPEN]     = { "open", 1 },
+	[PH_BUILD]    = { "build", 1 },
+	[PH_VAL]      = { "access_val", 1 },
+	[PH_ROWS]     = { "access_rows", 1 },
+	[PH_TEARDOWN] = { "teardown", 1 },
+};
+
+static unsigned long touched; /* Keeps value reads from being optimized out */
+
+static int visit_row(void *priv, int row, const char **vals, int n)
+{
+	touched += vals[0] != NULL;
+
+	return 0;
+}
+
+#define MAX_SHEETS 256
+
+struct run {
+	const char *fname;
+	size_t content_sz;
+	double cells;
+};
+
+static int run_once(struct run *r, struct ebuf *ebuf)
+{
+	void *zip, *ctx, *sheets[MAX_SHEETS];
+	int dims[MAX_SHEETS][2];
+	struct xml_elem *root;
+	const char *name;
+	char *buf;
+	FILE *fp;
+	int i, k, nsheets, row, col;
+
+	phase_start(&phases[PH_ZIP]);
+	for (k = 0; k < ZIP_REPEAT; k++) {
+		zip = zip_open(r->fname, ebuf);
+		if (!zip)
+			return -1;
+		i = zip_find(zip, "content.xml");
+		if (k < ZIP_REPEAT - 1)
+			zip_close(zip);
+	}
+	phase_end(&phases[PH_ZIP]);
+
+	if (i < 0) {
+		ebuf_add(ebuf, "bench: no content.xml\n");
+		zip_close(zip);
+		return -1;
+	}
+
+	r->content_sz = zip_entry_size(zip, i);
+
+	phase_start(&phases[PH_INFLATE]);
+	buf = zip_entry_read(zip, i, NULL, ebuf);
+	phase_end(&phases[PH_INFLATE]);
+	zip_close(zip);
+	if (!buf)
+		return -1;
+
+	fp = fmemopen(buf, r->content_sz, "r");
+	if (!fp) {
+		free(buf);
+		ebuf_add(ebuf, "bench: fmemopen() failed\n");
+		return -1;
+	}
+
+	phase_start(&phases[PH_PARSE]);
+	root = xml_parse(fp, ebuf);
+	phase_end(&phases[PH_PARSE]);
+	fclose(fp);
+	free(buf);
+	if (!root)
+		return -1;
+	xml_free(root);
+
+	phase_start(&phases[PH_OPEN]);
+	ctx = ods_open(r->fname, ebuf);
+	phase_end(&phases[PH_OPEN]);
+	if (!ctx)
+		return -1;
+
+	phase_start(&phases[PH_BUILD]);
+	for (nsheets = 0; nsheets < MAX_SHEETS
+	     && (name = ods_sheet_name(ctx, nsheets)); nsheets++) {
+		sheets[nsheets] = ods_open_sheet(ctx, name, ebuf);
+		if (!sheets[nsheets]) {
+			while (nsheets--)
+				ods_close_sheet(sheets[nsheets]);
+			ods_close(ctx);
+			return -1;
+		}
+	}
+	phase_end(&phases[PH_BUILD]);
+
+	r->cells = 0;
+	for (i = 0; i < nsheets; i++) {
+		ods_sheet_dims(sheets[i], &dims[i][0], &dims[i][1]);
+		r->cells += (double)dims[i][0] * dims[i][1];
+	}
+
+	phase_start(&phases[PH_VAL]);
+	for (i = 0; i < nsheets; i++) {
+		for (row = 0; row < dims[i][0]; row++) {
+			for (col = 0; col < dims[i][1]; col++)
+				touched += !!ods_sheet_val(sheets[i], row, col,
+							   ebuf);
+		}
+	}
+	phase_end(&phases[PH_VAL]);
+
+	phase_start(&phases[PH_ROWS]);
+	for (i = 0; i < nsheets; i++) {
+		if (dims[i][0] && dims[i][1])
+			ods_sheet_rows(sheets[i], 0, 0, dims[i][0] - 1,
+				       dims[i][1] - 1, visit_row, NULL, ebuf);
+	}
+	phase_end(&phases[PH_ROWS]);
+
+	phase_start(&phases[PH_TEARDOWN]);
+	for (i = 0; i < nsheets; i++)
+		ods_close_sheet(sheets[i]);
+	ods_close(ctx);
+	phase_end(&phases[PH_TEARDOWN]);
+
+	return 0;
+}
+
+static int save_json(const char *fname)
+{
+	FILE *fp;
+	int i;
+
+	fp = fopen(fname, "w");
+	if (!fp)
+		return -1;
+
+	fprintf(fp, "{\n");
+	for (i = 0; i < nmetrics; i++)
+		fprintf(fp, "  \"%s\": %.9g%s\n", metrics[i].name,
+			metrics[i].val, i < nmetrics - 1 ? "," : "");
+	fprintf(fp, "}\n");
+
+	return fclose(fp);
+}
+
+/* Compare with a baseline saved by save_json() */
+static int compare(const char *fname)
+{
+	char line[256], name[64];
+	double val;
+	FILE *fp;
+	int i;
+
+	fp = fopen(fname, "r");
+	if (!fp)
+		return -1;
+
+	printf("\n%-28s %14s %14s %8s\n", "metric", "baseline", "now",
+	       "change");
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, " \"%63[^\"]\": %lf", name, &val) != 2)
+			continue;
+		for (i = 0; i < nmetrics; i++) {
+			if (!strcmp(metrics[i].name, name))
+				break;
+		}
+		if (i == nmetrics)
+			continue;
+		printf("%-28s %14.6g %14.6g", name, val, metrics[i].val);
+		if (val)
+			printf(" %+7.1f%%", (metrics[i].val - val) / val * 100);
+		printf("\n");
+	}
+
+	fclose(fp);
+
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Benchmark reading of an ods-file:\n"
+		"Usage: [-n runs] [-o result.json] [-b baseline.json] <ods-file>\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct ebuf ebuf;
+	char ebuf_buf[1024];
+	const char *out = NULL, *base = NULL;
+	struct run r;
+	struct rusage ru;
+	int i, c, nruns = 3;
+	double mb;
+
+	while ((c = getopt(argc, argv, "n:o:b:")) != -1) {
+		switch (c) {
+		case 'n': nruns = atoi(optarg); break;
+		case 'o': out = optarg; break;
+		case 'b': base = optarg; break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (optind != argc - 1 || nruns < 1) {
+		usage();
+		return 1;
+	}
+
+	ebuf_init(&ebuf, ebuf_buf, sizeof(ebuf_buf));
+
+	memset(&r, 0, sizeof(r));
+	r.fname = argv[optind];
+	for (i = 0; i < nruns; i++) {
+		if (run_once(&r, &ebuf)) {
+			fprintf(stderr, "%s", ebuf_s(&ebuf));
+			return 1;
+		}
+	}
+
+	mb = r.content_sz / 1e6;
+	add_metric("content_mb", mb);
+	add_metric("cells", r.cells);
+	report_phase(&phases[PH_ZIP], 0, 0);
+	report_phase(&phases[PH_INFLATE], mb, 0);
+	report_phase(&phases[PH_PARSE], mb, 0);
+	report_phase(&phases[PH_OPEN], mb, 0);
+	report_phase(&phases[PH_BUILD], 0, r.cells);
+	report_phase(&phases[PH_VAL], 0, r.cells);
+	report_phase(&phases[PH_ROWS], 0, r.cells);
+	report_phase(&phases[PH_TEARDOWN], 0, 0);
+
+	getrusage(RUSAGE_SELF, &ru);
+	add_metric("peak_rss_kb", ru.ru_maxrss);
+
+	for (i = 0; i < nmetrics; i++)
+		printf("%-28s %14.6g\n", metrics[i].name, metrics[i].val);
+
+	if (out && save_json(out)) {
+		fprintf(stderr, "bench: failed to save \"%s\"\n", out);
+		return 1;
+	}
+
+	if (base && compare(base)) {
+		fprintf(stderr, "bench: failed to read \"%s\"\n", base);
+		return 1;
+	}
+
+	return 0;
+}
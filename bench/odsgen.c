@@ -0,0 +1,332 @@
+/*
+ * Generator of synthetic ods-files for benchmarks.
+ *
+ * Every sheet is a block of rows x cols cells, strings and floats mixed
+ * at random. Rows may come in runs of repeated rows. The archive has
+ * what LibreOffice needs to open it: "mimetype" stored first, manifest
+ * and content.xml.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <zlib.h>
+
+struct buf {
+	char *p;
+	size_t len, sz;
+};
+
+struct gen_opts {
+	int rows, cols, sheets;
+	int strings; /* % of string cells */
+	int run; /* Rows in a run of repeated rows */
+	int text_len;
+	int level; /* Compression */
+	uint64_t seed;
+};
+
+static uint64_t rnd_state;
+
+/* xorshift64* */
+static uint64_t rnd(void)
+{
+	rnd_state ^= rnd_state >> 12;
+	rnd_state ^= rnd_state << 25;
+	rnd_state ^= rnd_state >> 27;
+
+	return rnd_state * 2685821657736338717ull;
+}
+
+static void buf_add(struct buf *b, const void *p, size_t n)
+{
+	if (b->len + n > b->sz) {
+		b->p = realloc(b->p, b->sz * 2 + n);
+		if (!b->p) {
+			fprintf(stderr, "odsgen: no memory\n");
+			exit(1);
+		}
+		b->sz = b->sz * 2 + n;
+	}
+
+	memcpy(b->p + b->len, p, n);
+	b->len += n;
+}
+
+static void buf_printf(struct buf *b, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+
+static void buf_printf(struct buf *b, const char *fmt, ...)
+{
+	char s[1024];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(s, sizeof(s), fmt, ap);
+	va_end(ap);
+
+	buf_add(b, s, n < sizeof(s) ? n : sizeof(s) - 1);
+}
+
+static void gen_text(struct buf *b, int len)
+{
+	static const char chars[] =
+		"abcdefghijklmnopqrstuvwxyz ABCDEFGHIJKLMNOPQRSTUVWXYZ 0123456789";
+	char c;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		c = chars[rnd() % (sizeof(chars) - 1)];
+		/* Some escapes on the way */
+		if (c == ' ' && !(rnd() % 8))
+			buf_add(b, "&amp;", 5);
+		else
+			buf_add(b, &c, 1);
+	}
+}
+
+static void gen_cell(struct buf *b, const struct gen_opts *o)
+{
+	double v;
+
+	if (rnd() % 100 < o->strings) {
+		buf_printf(b, "<table:table-cell office:value-type=\"string\" calcext:value-type=\"string\"><text:p>");
+		gen_text(b, o->text_len);
+		buf_printf(b, "</text:p></table:table-cell>");
+		return;
+	}
+
+	v = (double)(rnd() % 100000000) / 100;
+	buf_printf(b, "<table:table-cell office:value-type=\"float\" office:value=\"%.2f\" calcext:value-type=\"float\"><text:p>%.2f</text:p></table:table-cell>",
+		   v, v);
+}
+
+static void gen_content(struct buf *b, const struct gen_opts *o)
+{
+	int s, r, c, n;
+
+	buf_printf(b, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		   "<office:document-content"
+		   " xmlns:office=\"urn:oasis:names:tc:opendocument:xmlns:office:1.0\""
+		   " xmlns:table=\"urn:oasis:names:tc:opendocument:xmlns:table:1.0\""
+		   " xmlns:text=\"urn:oasis:names:tc:opendocument:xmlns:text:1.0\""
+		   " xmlns:calcext=\"urn:org:documentfoundation:names:experimental:calc:xmlns:calcext:1.0\""
+		   " office:version=\"1.2\"><office:body><office:spreadsheet>");
+
+	for (s = 0; s < o->sheets; s++) {
+		buf_printf(b, "<table:table table:name=\"Sheet%d\"><table:table-column table:number-columns-repeated=\"%d\"/>",
+			   s + 1, o->cols);
+
+		for (r = 0; r < o->rows; r += n) {
+			n = o->rows - r < o->run ? o->rows - r : o->run;
+			if (n > 1)
+				buf_printf(b, "<table:table-row table:number-rows-repeated=\"%d\">", n);
+			else
+				buf_printf(b, "<table:table-row>");
+			for (c = 0; c < o->cols; c++)
+				gen_cell(b, o);
+			buf_printf(b, "</table:table-row>\n");
+		}
+
+		buf_printf(b, "</table:table>");
+	}
+
+	buf_printf(b, "</office:spreadsheet></office:body></office:document-content>\n");
+}
+
+static const char manifest[] =
+	"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	"<manifest:manifest xmlns:manifest=\"urn:oasis:names:tc:opendocument:xmlns:manifest:1.0\" manifest:version=\"1.2\">\n"
+	" <manifest:file-entry manifest:full-path=\"/\" manifest:media-type=\"application/vnd.oasis.opendocument.spreadsheet\"/>\n"
+	" <manifest:file-entry manifest:full-path=\"content.xml\" manifest:media-type=\"text/xml\"/>\n"
+	"</manifest:manifest>\n";
+
+static const char mimetype[] = "application/vnd.oasis.opendocument.spreadsheet";
+
+/* Zip archive being written: local entries go to @out, CD to @cd */
+struct zip_wr {
+	struct buf out;
+	struct buf cd;
+	int nentries;
+};
+
+static void put16(struct buf *b, unsigned v)
+{
+	unsigned char p[2] = { v, v >> 8 };
+
+	buf_add(b, p, 2);
+}
+
+static void put32(struct buf *b, uint32_t v)
+{
+	unsigned char p[4] = { v, v >> 8, v >> 16, v >> 24 };
+
+	buf_add(b, p, 4);
+}
+
+static void zip_add(struct zip_wr *z, const char *name, const char *data,
+		    size_t len, int level)
+{
+	uint32_t crc, off = z->out.len;
+	struct buf comp = { NULL, 0, 0 };
+	z_stream zs;
+	int method = level >= 0 ? 8 : 0;
+
+	crc = crc32(0L, (const unsigned char *)data, len);
+
+	if (method) {
+		memset(&zs, 0, sizeof(zs));
+		if (deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8,
+				 Z_DEFAULT_STRATEGY) != Z_OK) {
+			fprintf(stderr, "odsgen: deflateInit2() failed\n");
+			exit(1);
+		}
+		comp.sz = deflateBound(&zs, len);
+		comp.p = malloc(comp.sz);
+		if (!comp.p) {
+			fprintf(stderr, "odsgen: no memory\n");
+			exit(1);
+		}
+		zs.next_in = (unsigned char *)data;
+		zs.avail_in = len;
+		zs.next_out = (unsigned char *)comp.p;
+		zs.avail_out = comp.sz;
+		if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+			fprintf(stderr, "odsgen: deflate() failed\n");
+			exit(1);
+		}
+		comp.len = zs.total_out;
+		deflateEnd(&zs);
+		data = comp.p;
+	} else {
+		comp.len = len;
+	}
+
+	put32(&z->out, 0x04034b50);
+	put16(&z->out, 20); /* Version needed */
+	put16(&z->out, 0); /* Flags */
+	put16(&z->out, method);
+	put16(&z->out, 0); /* Time */
+	put16(&z->out, 0x21); /* Date: 1980-01-01 */
+	put32(&z->out, crc);
+	put32(&z->out, comp.len);
+	put32(&z->out, len);
+	put16(&z->out, strlen(name));
+	put16(&z->out, 0); /* Extra */
+	buf_add(&z->out, name, strlen(name));
+	buf_add(&z->out, data, comp.len);
+
+	put32(&z->cd, 0x02014b50);
+	put16(&z->cd, 20); /* Version made by */
+	put16(&z->cd, 20);
+	put16(&z->cd, 0);
+	put16(&z->cd, method);
+	put16(&z->cd, 0);
+	put16(&z->cd, 0x21);
+	put32(&z->cd, crc);
+	put32(&z->cd, comp.len);
+	put32(&z->cd, len);
+	put16(&z->cd, strlen(name));
+	put16(&z->cd, 0); /* Extra */
+	put16(&z->cd, 0); /* Comment */
+	put16(&z->cd, 0); /* Disk */
+	put16(&z->cd, 0); /* Internal attrs */
+	put32(&z->cd, 0); /* External attrs */
+	put32(&z->cd, off);
+	buf_add(&z->cd, name, strlen(name));
+
+	z->nentries++;
+	free(comp.p);
+}
+
+static void zip_fin(struct zip_wr *z)
+{
+	uint32_t off = z->out.len;
+
+	buf_add(&z->out, z->cd.p, z->cd.len);
+	put32(&z->out, 0x06054b50);
+	put16(&z->out, 0); /* Disk */
+	put16(&z->out, 0); /* CD disk */
+	put16(&z->out, z->nentries);
+	put16(&z->out, z->nentries);
+	put32(&z->out, z->cd.len);
+	put32(&z->out, off);
+	put16(&z->out, 0); /* Comment */
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Generate an ods-file for benchmarks:\n"
+		"Usage: [-r rows] [-c cols] [-s sheets] [-S string-%%] [-R row-run] [-t text-len] [-l level] [-x seed] <ods-file>\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct gen_opts o = {
+		.rows = 10000, .cols = 10, .sheets = 1, .strings = 50,
+		.run = 1, .text_len = 12, .level = 6, .seed = 1,
+	};
+	struct buf content = { NULL, 0, 0 };
+	struct zip_wr z;
+	FILE *fp;
+	int c;
+
+	while ((c = getopt(argc, argv, "r:c:s:S:R:t:l:x:")) != -1) {
+		switch (c) {
+		case 'r': o.rows = atoi(optarg); break;
+		case 'c': o.cols = atoi(optarg); break;
+		case 's': o.sheets = atoi(optarg); break;
+		case 'S': o.strings = atoi(optarg); break;
+		case 'R': o.run = atoi(optarg); break;
+		case 't': o.text_len = atoi(optarg); break;
+		case 'l': o.level = atoi(optarg); break;
+		case 'x': o.seed = strtoull(optarg, NULL, 10); break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (optind != argc - 1 || o.rows < 0 || o.cols < 0 || o.sheets < 0
+	    || o.run < 1 || o.text_len < 0 || o.level < 0 || o.level > 9) {
+		usage();
+		return 1;
+	}
+
+	rnd_state = o.seed ? o.seed : 1;
+
+	gen_content(&content, &o);
+
+	memset(&z, 0, sizeof(z));
+	zip_add(&z, "mimetype", mimetype, sizeof(mimetype) - 1, -1);
+	zip_add(&z, "content.xml", content.p, content.len, o.level);
+	zip_add(&z, "META-INF/manifest.xml", manifest, sizeof(manifest) - 1,
+		o.level);
+	zip_fin(&z);
+
+	if (content.len > UINT32_MAX || z.out.len > UINT32_MAX) {
+		fprintf(stderr, "odsgen: too big for zip without Zip64\n");
+		return 1;
+	}
+
+	fp = fopen(argv[optind], "wb");
+	if (!fp || fwrite(z.out.p, 1, z.out.len, fp) != z.out.len
+	    || fclose(fp)) {
+		fprintf(stderr, "odsgen: failed to write \"%s\"\n",
+			argv[optind]);
+		return 1;
+	}
+
+	printf("%s: content.xml %zu bytes, archive %zu bytes\n", argv[optind],
+	       content.len, z.out.len);
+
+	free(content.p);
+	free(z.out.p);
+	free(z.cd.p);
+
+	return 0;
+}
@@ -0,0 +1,82 @@
+/*
+ * String dictionary: strings hash-consed into dense codes.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dict.h"
+#include "hash.h"
+
+void dict_init(struct dict *dict)
+{
+	memset(dict, 0, sizeof(*dict));
+	dict->n = 1; /* No string */
+}
+
+static int grow(struct dict *dict)
+{
+	const char **strs;
+	unsigned *hashes, h, hmask;
+	int *htab, i, sz = dict->sz ? dict->sz * 2 : 64;
+
+	strs = realloc(dict->strs, sz * sizeof(*strs));
+	if (!strs)
+		return -1;
+	dict->strs = strs;
+
+	hashes = realloc(dict->hashes, sz * sizeof(*hashes));
+	if (!hashes)
+		return -1;
+	dict->hashes = hashes;
+
+	/* Power of 2, load factor is below 1/2 */
+	hmask = sz * 2 - 1;
+	htab = calloc(hmask + 1, sizeof(*htab));
+	if (!htab)
+		return -1;
+
+	for (i = 1; i < dict->n; i++) {
+		h = hashes[i] & hmask;
+		while (htab[h])
+			h = (h + 1) & hmask;
+		htab[h] = i;
+	}
+
+	free(dict->htab);
+	dict->htab = htab;
+	dict->hmask = hmask;
+	dict->sz = sz;
+
+	return 0;
+}
+
+int dict_add(struct dict *dict, const char *s)
+{
+	unsigned hs, h;
+	int c;
+
+	if (dict->n >= dict->sz && grow(dict))
+		return 0;
+
+	hs = hash_str(s);
+	for (h = hs & dict->hmask; (c = dict->htab[h]);
+	     h = (h + 1) & dict->hmask) {
+		if (dict->hashes[c] == hs && !strcmp(dict->strs[c], s))
+			return c;
+	}
+
+	dict->strs[dict->n] = s;
+	dict->hashes[dict->n] = hs;
+	dict->htab[h] = dict->n;
+
+	return dict->n++;
+}
+
+void dict_free(struct dict *dict)
+{
+	free(dict->strs);
+	free(dict->hashes);
+	free(dict->htab);
+	dict_init(dict);
+}
@@ -0,0 +1,48 @@
+#ifndef _DICT_H
+#define _DICT_H
+
+#include <stddef.h>
+
+/*
+ * String dictionary. Each distinct string is kept once and is identified
+ * by a dense integer code: 1, 2, ... in the order of adding. 0 means
+ * "no string". Strings are kept by pointer, not copied.
+ */
+struct dict {
+	const char **strs; /* By code */
+	unsigned *hashes; /* By code */
+	int n, sz;
+	int *htab; /* Open addressing, 0 is a free slot */
+	unsigned hmask;
+};
+
+void dict_init(struct dict *dict);
+
+/*
+ * Code of the string, it is added if new: then @s must live as long as
+ * the dictionary. 0 if no memory.
+ */
+int dict_add(struct dict *dict, const char *s);
+
+/* NULL for 0 or unknown code */
+static inline const char *dict_str(const struct dict *dict, int code)
+{
+	return code > 0 && code < dict->n ? dict->strs[code] : NULL;
+}
+
+/* Number of codes: the last one plus one */
+static inline int dict_size(const struct dict *dict)
+{
+	return dict->n;
+}
+
+/* Memory of the tables. Strings are the caller's */
+static inline size_t dict_mem_size(const struct dict *dict)
+{
+	return dict->sz * (sizeof(*dict->strs) + sizeof(*dict->hashes))
+		+ (dict->sz ? (dict->hmask + 1) * sizeof(*dict->htab) : 0);
+}
+
+void dict_free(struct dict *dict);
+
+#endif
@@ -0,0 +1,525 @@
+/*
+ * Sheet export as CSV, TSV or JSON lines.
+ *
+ * Rows of the area are split into blocks of row runs. A block is
+ * formatted into its own buffer: every distinct line once and a list of
+ * segments -- line and how many times it is repeated. Workers format
+ * blocks ahead, the caller's thread writes them out in order through a
+ * big output buffer. Repeated rows are expanded only there.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "export.h"
+#include "ods_int.h"
+#include "pool.h"
+
+#define BLOCK_RUNS 1024 /* Row runs in a block */
+#define OUT_SZ (1 << 20)
+
+/* Line repeated @n times */
+struct seg {
+	size_t off;
+	size_t len;
+	int n;
+};
+
+struct export;
+
+struct block {
+	struct pool_task task; /* Must be the first */
+	struct export *ex;
+	int k1, k2; /* Row runs [k1, k2) */
+	int from, to; /* Rows [from, to) */
+	char *buf;
+	size_t len, sz;
+	struct seg *segs;
+	int nsegs, segs_sz;
+	const char **span;
+	int err;
+	int done;
+};
+
+struct export {
+	struct sheet_ctx *ctx;
+	int row1, col1, row2, col2;
+	int fmt;
+	int c0; /* First column of the area */
+	int kfirst, klast; /* Row runs of the area [kfirst, klast) */
+	int nblocks;
+	pthread_mutex_t lock;
+	pthread_cond_t done; /* A block is formatted */
+	/* Output */
+	int fd;
+	char *out;
+	size_t out_len;
+};
+
+int export_format(const char *name)
+{
+	if (!strcmp(name, "csv"))
+		return EXPORT_CSV;
+	if (!strcmp(name, "tsv"))
+		return EXPORT_TSV;
+	if (!strcmp(name, "jsonl"))
+		return EXPORT_JSONL;
+
+	return -1;
+}
+
+/* Room for @n more bytes */
+static int reserve(struct block *b, size_t n)
+{
+	char *p;
+
+	if (b->len + n <= b->sz)
+		return 0;
+
+	p = realloc(b->buf, b->sz * 2 + n);
+	if (!p)
+		return -1;
+
+	b->buf = p;
+	b->sz = b->sz * 2 + n;
+
+	return 0;
+}
+
+static char *csv_field(char *p, const char *s)
+{
+	const char *q;
+
+	if (!strpbrk(s, ",\"\r\n")) {
+		q = s + strlen(s);
+		memcpy(p, s, q - s);
+		return p + (q - s);
+	}
+
+	*p++ = '"';
+	for (; *s; s++) {
+		if (*s == '"')
+			*p++ = '"';
+		*p++ = *s;
+	}
+	*p++ = '"';
+
+	return p;
+}
+
+static char *tsv_field(char *p, const char *s)
+{
+	for (; *s; s++) {
+		switch (*s) {
+		case '\t': *p++ = '\\'; *p++ = 't'; break;
+		case '\n': *p++ = '\\'; *p++ = 'n'; break;
+		case '\r': *p++ = '\\'; *p++ = 'r'; break;
+		case '\\': *p++ = '\\'; *p++ = '\\'; break;
+		default: *p++ = *s;
+		}
+	}
+
+	return p;
+}
+
+static char *json_field(char *p, const char *s)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char c;
+
+	*p++ = '"';
+	for (; *s; s++) {
+		c = *s;
+		switch (c) {
+		case '"': *p++ = '\\'; *p++ = '"'; break;
+		case '\\': *p++ = '\\'; *p++ = '\\'; break;
+		case '\n': *p++ = '\\'; *p++ = 'n'; break;
+		case '\r': *p++ = '\\'; *p++ = 'r'; break;
+		case '\t': *p++ = '\\'; *p++ = 't'; break;
+		default:
+			if (c < 0x20) {
+				memcpy(p, "\\u00", 4);
+				p[4] = hex[c >> 4];
+				p[5] = hex[c & 15];
+				p += 6;
+			} else {
+				*p++ = c;
+			}
+		}
+	}
+	*p++ = '"';
+
+	return p;
+}
+
+/* Format the span as a line, add it as a segment of @n rows */
+static int add_line(struct block *b, int n)
+{
+	struct export *ex = b->ex;
+	int i, ncols = ex->col2 - ex->col1 + 1;
+	const char *s;
+	struct seg *sg;
+	char *p;
+
+	if (b->nsegs == b->segs_sz) {
+		sg = realloc(b->segs, (b->segs_sz * 2 + 16) * sizeof(*sg));
+		if (!sg)
+			return -1;
+		b->segs = sg;
+		b->segs_sz = b->segs_sz * 2 + 16;
+	}
+
+	sg = &b->segs[b->nsegs++];
+	sg->off = b->len;
+	sg->n = n;
+
+	if (ex->fmt == EXPORT_JSONL) {
+		if (reserve(b, 1))
+			return -1;
+		b->buf[b->len++] = '[';
+	}
+
+	for (i = 0; i < ncols; i++) {
+		s = b->span[i];
+		/* Worst case: every byte is escaped as \u00XX */
+		if (reserve(b, (s ? strlen(s) * 6 : 4) + 4))
+			return -1;
+		p = b->buf + b->len;
+
+		if (i)
+			*p++ = ex->fmt == EXPORT_TSV ? '\t' : ',';
+
+		switch (ex->fmt) {
+		case EXPORT_CSV:
+			if (s)
+				p = csv_field(p, s);
+			break;
+		case EXPORT_TSV:
+			if (s)
+				p = tsv_field(p, s);
+			break;
+		default:
+			if (s) {
+				p = json_field(p, s);
+			} else {
+				memcpy(p, "null", 4);
+				p += 4;
+			}
+		}
+
+		b->len = p - b->buf;
+	}
+
+	if (reserve(b, 2))
+		return -1;
+	if (ex->fmt == EXPORT_JSONL)
+		b->buf[b->len++] = ']';
+	b->buf[b->len++] = '\n';
+
+	sg->len = b->len - sg->off;
+
+	return 0;
+}
+
+static int add_rows(struct block *b, int k, int n)
+{
+	struct export *ex = b->ex;
+
+	if (fill_span(ex->ctx, k, ex->c0, ex->col1, ex->col2 - ex->col1 + 1,
+		      b->span, NULL, NULL, NULL))
+		return -1;
+
+	return add_line(b, n);
+}
+
+static int format_block(struct block *b)
+{
+	struct row_run *rr;
+	int k, s, e, cur = b->from;
+
+	b->len = 0;
+	b->nsegs = 0;
+
+	for (k = b->k1; k < b->k2; k++) {
+		rr = &b->ex->ctx->rows[k];
+		s = rr->row > b->from ? rr->row : b->from;
+		e = rr->row + rr->n < b->to ? rr->row + rr->n : b->to;
+
+		/* Empty rows before the run */
+		if (s > cur && add_rows(b, -1, s - cur))
+			return -1;
+		if (e > s && add_rows(b, k, e - s))
+			return -1;
+		if (e > cur)
+			cur = e;
+	}
+
+	if (b->to > cur && add_rows(b, -1, b->to - cur))
+		return -1;
+
+	return 0;
+}
+
+static void format_task(struct pool_task *task)
+{
+	struct block *b = (struct block *)task;
+	struct export *ex = b->ex;
+
+	b->err = format_block(b);
+
+	pthread_mutex_lock(&ex->lock);
+	b->done = 1;
+	pthread_cond_broadcast(&ex->done);
+	pthread_mutex_unlock(&ex->lock);
+}
+
+/* Set the block up as the i-th one of the area */
+static void setup_block(struct export *ex, struct block *b, int i)
+{
+	struct row_run *rows = ex->ctx->rows;
+
+	b->k1 = ex->kfirst + i * BLOCK_RUNS;
+	b->k2 = b->k1 + BLOCK_RUNS < ex->klast ? b->k1 + BLOCK_RUNS : ex->klast;
+	b->from = i ? rows[b->k1].row : ex->row1;
+	b->to = i < ex->nblocks - 1 ? rows[b->k2].row : ex->row2 + 1;
+	b->done = 0;
+	b->err = 0;
+}
+
+static int write_all(int fd, const char *p, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int out_flush(struct export *ex)
+{
+	if (write_all(ex->fd, ex->out, ex->out_len))
+		return -1;
+
+	ex->out_len = 0;
+
+	return 0;
+}
+
+/* Write @len bytes at @p @n times */
+static int out_write(struct export *ex, const char *p, size_t len, int n)
+{
+	int m;
+
+	if (len > OUT_SZ / 2) {
+		/* Long line: no point in copying */
+		if (out_flush(ex))
+			return -1;
+		while (n--) {
+			if (write_all(ex->fd, p, len))
+				return -1;
+		}
+		return 0;
+	}
+
+	while (n) {
+		if (ex->out_len + len > OUT_SZ && out_flush(ex))
+			return -1;
+
+		/* As many copies as fit */
+		m = (OUT_SZ - ex->out_len) / len;
+		if (m > n)
+			m = n;
+		n -= m;
+		while (m--) {
+			memcpy(ex->out + ex->out_len, p, len);
+			ex->out_len += len;
+		}
+	}
+
+	return 0;
+}
+
+static int emit_block(struct export *ex, struct block *b)
+{
+	int i;
+
+	for (i = 0; i < b->nsegs; i++) {
+		if (out_write(ex, b->buf + b->segs[i].off, b->segs[i].len,
+			      b->segs[i].n))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Format blocks on the pool, @nslots of them at once */
+static int run_pool(struct export *ex, struct block *slots, int nslots,
+		    struct pool *pool, struct ebuf *ebuf)
+{
+	struct block *b;
+	int i, err = 0;
+
+	for (i = 0; i < nslots && i < ex->nblocks; i++) {
+		setup_block(ex, &slots[i], i);
+		pool_submit(pool, &slots[i].task);
+	}
+
+	for (i = 0; i < ex->nblocks; i++) {
+		b = &slots[i % nslots];
+
+		pthread_mutex_lock(&ex->lock);
+		while (!b->done)
+			pthread_cond_wait(&ex->done, &ex->lock);
+		pthread_mutex_unlock(&ex->lock);
+
+		if (b->err) {
+			ebuf_add(ebuf, "export: no memory\n");
+			err = -1;
+			break;
+		}
+
+		if (emit_block(ex, b)) {
+			ebuf_add(ebuf, "export: write failed: %s\n",
+				 strerror(errno));
+			err = -1;
+			break;
+		}
+
+		if (i + nslots < ex->nblocks) {
+			setup_block(ex, b, i + nslots);
+			pool_submit(pool, &b->task);
+		}
+	}
+
+	/* Submitted blocks are finished by pool_free() */
+	return err;
+}
+
+int export_area(void *sheet_ctx, int row1, int col1, int row2, int col2,
+		int fmt, int fd, int threads, struct ebuf *ebuf)
+{
+	struct sheet_ctx *ctx = (struct sheet_ctx *)sheet_ctx;
+	struct export ex;
+	struct block *slots;
+	struct pool *pool = NULL;
+	char *out;
+	int i, nslots, err = 0;
+
+	if (check_area(row1, col1, row2, col2)) {
+		ebuf_add(ebuf, "export: invalid area\n");
+		return -1;
+	}
+
+	memset(&ex, 0, sizeof(ex));
+	ex.ctx = ctx;
+	ex.row1 = row1;
+	ex.col1 = col1;
+	ex.row2 = row2;
+	ex.col2 = col2;
+	ex.fmt = fmt;
+	ex.fd = fd;
+	ex.c0 = first_col(ctx, col1);
+
+	/* Row runs overlapping [row1, row2] */
+	ex.kfirst = first_row_run(ctx, 0, ctx->nrows, row1);
+	ex.klast = first_row_run(ctx, ex.kfirst, ctx->nrows, row2);
+	if (ex.klast < ctx->nrows && ctx->rows[ex.klast].row <= row2)
+		ex.klast++;
+
+	ex.nblocks = (ex.klast - ex.kfirst + BLOCK_RUNS - 1) / BLOCK_RUNS;
+	if (!ex.nblocks)
+		ex.nblocks = 1;
+
+	/* Display text is made lazily, workers must only read it */
+	if (threads > 1 && ex.nblocks > 1) {
+		if (cell_texts(ctx)) {
+			ebuf_add(ebuf, "export: no memory for display text\n");
+			return -1;
+		}
+	} else {
+		threads = 1;
+	}
+
+	nslots = threads > 1 ? threads * 2 : 1;
+	if (nslots > ex.nblocks)
+		nslots = ex.nblocks;
+
+	slots = calloc(nslots, sizeof(*slots));
+	out = malloc(OUT_SZ);
+	if (!slots || !out) {
+		ebuf_add(ebuf, "export: no memory\n");
+		err = -1;
+		goto out;
+	}
+	ex.out = out;
+
+	for (i = 0; i < nslots; i++) {
+		slots[i].task.fn = format_task;
+		slots[i].ex = &ex;
+		slots[i].span = malloc((col2 - col1 + 1) *
+				       sizeof(*slots[i].span));
+		if (!slots[i].span) {
+			ebuf_add(ebuf, "export: no memory\n");
+			err = -1;
+			goto out;
+		}
+	}
+
+	if (threads > 1) {
+		pool = pool_new(threads < nslots ? threads : nslots, ebuf);
+		if (!pool) {
+			err = -1;
+			goto out;
+		}
+		pthread_mutex_init(&ex.lock, NULL);
+		pthread_cond_init(&ex.done, NULL);
+
+		err = run_pool(&ex, slots, nslots, pool, ebuf);
+
+		pool_free(pool);
+		pthread_mutex_destroy(&ex.lock);
+		pthread_cond_destroy(&ex.done);
+	} else {
+		for (i = 0; i < ex.nblocks && !err; i++) {
+			setup_block(&ex, slots, i);
+			if (format_block(slots)) {
+				ebuf_add(ebuf, "export: no memory\n");
+				err = -1;
+			} else if (emit_block(&ex, slots)) {
+				ebuf_add(ebuf, "export: write failed: %s\n",
+					 strerror(errno));
+				err = -1;
+			}
+		}
+	}
+
+	if (!err && out_flush(&ex)) {
+		ebuf_add(ebuf, "export: write failed: %s\n", strerror(errno));
+		err = -1;
+	}
+
+out:
+	if (slots) {
+		for (i = 0; i < nslots; i++) {
+			free(slots[i].buf);
+			free(slots[i].segs);
+			free(slots[i].span);
+		}
+	}
+	free(slots);
+	free(out);
+
+	return err;
+}
@@ -0,0 +1,25 @@
+#ifndef _EXPORT_H
+#define _EXPORT_H
+
+#include "ebuf.h"
+
+/* Text formats of sheet export */
+enum {
+	EXPORT_CSV,   /* RFC 4180 quoting, "\n" line ends */
+	EXPORT_TSV,   /* Tab, newline and backslash are escaped as \t \n \\ */
+	EXPORT_JSONL, /* Row per line: JSON array of strings, null if empty */
+};
+
+/* Format by name: "csv", "tsv", "jsonl". -1 if unknown */
+int export_format(const char *name);
+
+/*
+ * Write display text of the area of the sheet to @fd, a line per row.
+ * Blocks of rows are formatted on @threads threads (0, 1: on the
+ * caller's one) and written in order. A run of repeated rows is
+ * formatted once.
+ */
+int export_area(void *sheet_ctx, int row1, int col1, int row2, int col2,
+		int fmt, int fd, int threads, struct ebuf *ebuf);
+
+#endif
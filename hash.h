@@ -0,0 +1,40 @@
+#ifndef _HASH_H
+#define _HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* FNV-1a of @n bytes */
+static inline unsigned hash_mem(const char *s, size_t n)
+{
+	unsigned h = 2166136261u;
+
+	while (n--)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+
+	return h;
+}
+
+/* FNV-1a of a null-terminated string */
+static inline unsigned hash_str(const char *s)
+{
+	unsigned h = 2166136261u;
+
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+
+	return h;
+}
+
+/* 64-bit FNV-1a: for keys stored on disk */
+static inline uint64_t hash_mem64(const char *s, size_t n)
+{
+	uint64_t h = 14695981039346656037ull;
+
+	while (n--)
+		h = (h ^ (unsigned char)*s++) * 1099511628211ull;
+
+	return h;
+}
+
+#endif
@@ -1,24 +1,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <getopt.h>
+#include <unistd.h>
 
 #include "ods.h"
-
-static int parse_cell_name(const char *s, int *row, int *col)
-{
-	char c;
-	int n;
-
-	if (sscanf(s, "%c%u%n", &c, row, &n) != 2)
-		return -1;
-
-	if (c < 'A' || c > 'Z' || row <= 0)
-		return -1;
-	*col = c - 'A';
-	(*row)--;
-
-	return n;
-}
+#include "export.h"
+#include "serve.h"
+#include "batch.h"
 
 struct cell_area {
 	int row1, col1;
@@ -27,29 +17,68 @@ struct cell_area {
 
 static int parse_cell_area(const char *s, struct cell_area *area)
 {
-	char c;
-	int n, row, col;
+	return ods_parse_area(s, &area->row1, &area->col1, &area->row2,
+			      &area->col2);
+}
 
-	n = parse_cell_name(s, &area->row1, &area->col1);
-	if (n < 0)
-		return -1;
+static int print_row(void *priv, int row, const char **vals, int n)
+{
+	int i;
 
-	if (!s[n]) {
-		area->row2 = area->row1;
-		area->col2 = area->col1;
-		return 0;
+	for (i = 0; i < n; i++) {
+		putchar('\t');
+		/* Same as printf("%s") of NULL */
+		fputs(vals[i] ? vals[i] : "(null)", stdout);
 	}
+	putchar('\n');
 
-	if (s[n] != ':')
-		return -1;
+	return 0;
+}
 
-	s += n + 1;
+#define STAT(f) { #f, offsetof(struct ods_stats, f) }
+#define STAT_NOTE(f, note) { #f, offsetof(struct ods_stats, f), note }
 
-	n = parse_cell_name(s, &area->row2, &area->col2);
-	if (n < 0 || s[n])
-		return -1;
+static const struct {
+	const char *name;
+	size_t off;
+	const char *note;
+} stat_names[] = {
+	STAT(zip_index_ns),
+	STAT(zip_inflate_ns),
+	STAT(zip_compressed),
+	STAT(zip_inflated),
+	STAT(xml_parse_ns),
+	STAT(xml_elems),
+	STAT(xml_attrs),
+	STAT(xml_texts),
+	STAT(ods_open_ns),
+	STAT(ods_build_ns),
+	STAT(ods_sheets),
+	STAT(ods_cell_runs),
+	STAT_NOTE(bulk_allocs, "arena chunks, cell/row arrays, inflate buffers"),
+	STAT(bulk_alloc_bytes),
+};
 
-	return 0;
+/* At exit: whatever path main() leaves by */
+static void print_stats(void)
+{
+	struct ods_stats st;
+	int i;
+
+	ods_get_stats(&st);
+	for (i = 0; i < sizeof(stat_names) / sizeof(stat_names[0]); i++) {
+		fprintf(stderr, "%-16s %llu", stat_names[i].name,
+			(unsigned long long)*(uint64_t *)
+			((char *)&st + stat_names[i].off));
+		if (stat_names[i].note)
+			fprintf(stderr, " (%s)", stat_names[i].note);
+		fputc('\n', stderr);
+	}
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Read values from Open Document Spreadsheet files (.ods):\nUsage: [--cache[=<dir>]] [--stats] [--compact] <ods-file> [<sheet> [B1[:H99]]]\n       [--cache[=<dir>]] [--threads <n>] --format=csv|tsv|jsonl <ods-file> <sheet> [B1[:H99]]\n       --serve <socket> [--threads <n>] [--mem-cap <MB>]\n       --batch [--jobs <n>] <sheet> <B1[:H99]> [<ods-file>...] (names from stdin if none)\n");
 }
 
 int main(int argc, char *argv[])
@@ -57,13 +86,122 @@ int main(int argc, char *argv[])
 	struct ebuf ebuf;
 	char ebuf_buf[1024];
 	void *ctx, *sheet_ctx;
-	int i, j;
 	struct cell_area ca;
 	const char *s;
 	const char *fname, *sheet = NULL, *area = NULL;
+	const char *sheets[2];
+	struct ods_opts opts;
+	struct serve_opts sopts;
+	struct batch_opts bopts;
+	const char *sock = NULL;
+	int fmt = -1, nrows, ncols, print_flags = 0, batch_mode = 0;
+	int threads = 0;
+	static const struct option lopts[] = {
+		{ "cache", optional_argument, NULL, 'c' },
+		{ "serve", required_argument, NULL, 's' },
+		{ "threads", required_argument, NULL, 't' },
+		{ "mem-cap", required_argument, NULL, 'm' },
+		{ "stats", no_argument, NULL, 'S' },
+		{ "format", required_argument, NULL, 'f' },
+		{ "compact", no_argument, NULL, 'C' },
+		{ "batch", no_argument, NULL, 'b' },
+		{ "jobs", required_argument, NULL, 'j' },
+		{ NULL, 0, NULL, 0 },
+	};
+	int c, ret;
 
-	if (argc < 2 || argc > 4) {
-		fprintf(stderr, "Read values from Open Document Spreadsheet files (.ods):\nUsage: <ods-file> [<sheet> [B1[:H99]]]\n");
+	memset(&opts, 0, sizeof(opts));
+	memset(&sopts, 0, sizeof(sopts));
+	memset(&bopts, 0, sizeof(bopts));
+
+	while ((c = getopt_long(argc, argv, "", lopts, NULL)) != -1) {
+		switch (c) {
+		case 'c':
+			opts.cache = 1;
+			opts.cache_dir = optarg;
+			break;
+		case 's':
+			sock = optarg;
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'm':
+			sopts.mem_cap = strtoul(optarg, NULL, 10) << 20;
+			break;
+		case 'f':
+			fmt = export_format(optarg);
+			if (fmt < 0) {
+				usage();
+				return -1;
+			}
+			break;
+		case 'C':
+			print_flags |= ODS_PRINT_COMPACT;
+			break;
+		case 'b':
+			batch_mode = 1;
+			break;
+		case 'j':
+			bopts.jobs = atoi(optarg);
+			break;
+		case 'S':
+			ods_stats_enable(1);
+			atexit(print_stats);
+			break;
+		default:
+			usage();
+			return -1;
+		}
+	}
+
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if (sock) {
+		if (argc != 1) {
+			usage();
+			return -1;
+		}
+
+		sopts.threads = threads;
+		ebuf_init(&ebuf, ebuf_buf, sizeof(ebuf_buf));
+		if (serve(sock, &sopts, &ebuf)) {
+			fprintf(stderr, "%s", ebuf_s(&ebuf));
+			return -1;
+		}
+		return 0;
+	}
+
+	if (batch_mode) {
+		if (argc < 3) {
+			usage();
+			return -1;
+		}
+
+		bopts.sheet = argv[1];
+		if (parse_cell_area(argv[2], &ca)) {
+			fprintf(stderr, "Invalid cell area format\n");
+			return -1;
+		}
+		bopts.row1 = ca.row1;
+		bopts.col1 = ca.col1;
+		bopts.row2 = ca.row2;
+		bopts.col2 = ca.col2;
+		if (!bopts.jobs)
+			bopts.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+		ebuf_init(&ebuf, ebuf_buf, sizeof(ebuf_buf));
+		/* Failed files are reported on the way */
+		ret = batch(&bopts, argc > 3 ? argv + 3 : NULL, argc - 3,
+			    &ebuf);
+		if (ret < 0)
+			fprintf(stderr, "%s", ebuf_s(&ebuf));
+		return ret ? -1 : 0;
+	}
+
+	if (argc < 2 || argc > 4 || (fmt >= 0 && argc < 3)) {
+		usage();
 		return -1;
 	}
 
@@ -82,7 +220,27 @@ int main(int argc, char *argv[])
 
 	ebuf_init(&ebuf, ebuf_buf, sizeof(ebuf_buf));
 
-	ctx = ods_open(fname, &ebuf);
+	/* Snapshot has no XML to print the sheet */
+	if (sheet && !area && fmt < 0)
+		opts.cache = 0;
+
+	/* Sheet is known up front -- don't parse the others */
+	if (sheet) {
+		sheets[0] = sheet;
+		sheets[1] = NULL;
+		opts.sheets = sheets;
+	}
+
+	/* And so is the area -- don't parse past it */
+	if (area) {
+		opts.area = 1;
+		opts.row1 = ca.row1;
+		opts.col1 = ca.col1;
+		opts.row2 = ca.row2;
+		opts.col2 = ca.col2;
+	}
+
+	ctx = ods_open_ex(fname, &opts, &ebuf);
 	if (!ctx) {
 		fprintf(stderr, "%s", ebuf_s(&ebuf));
 		return -1;
@@ -93,8 +251,13 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
-	if (!area)
-		return ods_print_sheet(ctx, sheet);
+	if (!area && fmt < 0) {
+		if (ods_write_sheet(ctx, sheet, stdout, print_flags, &ebuf)) {
+			fprintf(stderr, "%s", ebuf_s(&ebuf));
+			return -1;
+		}
+		return 0;
+	}
 
 	sheet_ctx = ods_open_sheet(ctx, sheet, &ebuf);
 	if (!sheet_ctx) {
@@ -102,11 +265,38 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
-	for (i = ca.row1; i <= ca.row2; i++) {
-		for (j = ca.col1; j <= ca.col2; j++) {
-			printf("\t%s", ods_sheet_val(sheet_ctx, i, j));
+	if (fmt >= 0) {
+		if (!area) {
+			ods_sheet_dims(sheet_ctx, &nrows, &ncols);
+			if (!nrows || !ncols) {
+				ods_close_sheet(sheet_ctx);
+				ods_close(ctx);
+				return 0;
+			}
+			ca.row1 = ca.col1 = 0;
+			ca.row2 = nrows - 1;
+			ca.col2 = ncols - 1;
+		}
+
+		if (!threads)
+			threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+		if (export_area(sheet_ctx, ca.row1, ca.col1, ca.row2, ca.col2,
+				fmt, STDOUT_FILENO, threads, &ebuf)) {
+			fprintf(stderr, "%s", ebuf_s(&ebuf));
+			return -1;
 		}
-		printf("\n");
+
+		ods_close_sheet(sheet_ctx);
+		ods_close(ctx);
+
+		return 0;
+	}
+
+	if (ods_sheet_rows(sheet_ctx, ca.row1, ca.col1, ca.row2, ca.col2,
+			   print_row, NULL, &ebuf)) {
+		fprintf(stderr, "%s", ebuf_s(&ebuf));
+		return -1;
 	}
 	printf("\n");
 
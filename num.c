@@ -0,0 +1,223 @@
+/*
+ * Parsing of numbers, dates and durations from ODS attribute values.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "num.h"
+
+/* Exactly representable powers of ten */
+static const double exact_pow10[] = {
+	1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+	1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+	1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static int is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+/*
+ * Fast path: if the decimal mantissa fits in 53 bits and the power of ten
+ * is exact, one multiplication or division gives the correctly rounded
+ * result. Anything else (long mantissas, big exponents) goes to strtod().
+ */
+int num_parse_double(const char *s, double *v)
+{
+	const char *p = s;
+	uint64_t m = 0;
+	int neg = 0, nd = 0, e = 0, ee = 0, eneg = 0;
+	double d;
+	char *end;
+
+	if (*p == '-' || *p == '+')
+		neg = *p++ == '-';
+
+	for (; is_digit(*p); p++, nd++)
+		m = m * 10 + *p - '0';
+
+	if (*p == '.') {
+		for (p++; is_digit(*p); p++, nd++, e--)
+			m = m * 10 + *p - '0';
+	}
+
+	if (!nd)
+		return -1;
+
+	if (*p == 'e' || *p == 'E') {
+		p++;
+		if (*p == '-' || *p == '+')
+			eneg = *p++ == '-';
+		if (!is_digit(*p))
+			return -1;
+		for (; is_digit(*p) && ee < 10000; p++)
+			ee = ee * 10 + *p - '0';
+		e += eneg ? -ee : ee;
+	}
+
+	if (*p)
+		return -1;
+
+	/* Leading zeros do not count, but they are rare */
+	if (nd > 19 || m > (1ULL << 53) || e < -22 || e > 22) {
+		d = strtod(s, &end);
+		if (*end)
+			return -1;
+		*v = d;
+		return 0;
+	}
+
+	d = (double)m;
+	d = e < 0 ? d / exact_pow10[-e] : d * exact_pow10[e];
+	*v = neg ? -d : d;
+
+	return 0;
+}
+
+/* Parse exactly @n digits */
+static const char *parse_int(const char *p, int n, int *v)
+{
+	for (*v = 0; n--; p++) {
+		if (!is_digit(*p))
+			return NULL;
+		*v = *v * 10 + *p - '0';
+	}
+
+	return p;
+}
+
+/* Days since 1970-01-01 in the proleptic Gregorian calendar */
+static long days_from_civil(long y, int m, int d)
+{
+	long era, yoe, doy, doe;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+	return era * 146097 + doe - 719468;
+}
+
+/* Fraction of a second: ".5" */
+static const char *parse_frac(const char *p, double *v)
+{
+	double k = 0.1;
+
+	*v = 0;
+	if (*p != '.')
+		return p;
+
+	for (p++; is_digit(*p); p++, k /= 10)
+		*v += (*p - '0') * k;
+
+	return p;
+}
+
+int num_parse_date(const char *s, double *v)
+{
+	const char *p = s;
+	int y, m, d, hh = 0, mm = 0, ss = 0, neg = 0;
+	double frac = 0;
+
+	if (*p == '-') {
+		neg = 1;
+		p++;
+	}
+
+	if (!(p = parse_int(p, 4, &y)) || *p++ != '-'
+	    || !(p = parse_int(p, 2, &m)) || *p++ != '-'
+	    || !(p = parse_int(p, 2, &d)))
+		return -1;
+
+	if (m < 1 || m > 12 || d < 1 || d > 31)
+		return -1;
+
+	if (*p == 'T') {
+		if (!(p = parse_int(p + 1, 2, &hh)) || *p++ != ':'
+		    || !(p = parse_int(p, 2, &mm)) || *p++ != ':'
+		    || !(p = parse_int(p, 2, &ss)))
+			return -1;
+		p = parse_frac(p, &frac);
+	}
+
+	/* Timezone is not expected in ODS, but "Z" is harmless */
+	if (*p == 'Z')
+		p++;
+
+	if (*p)
+		return -1;
+
+	*v = days_from_civil(neg ? -y : y, m, d) * 86400.0
+		+ hh * 3600 + mm * 60 + ss + frac;
+
+	return 0;
+}
+
+/* ISO 8601 duration: [-]P[nD][T[nH][nM][n[.f]S]] */
+int num_parse_duration(const char *s, double *v)
+{
+	const char *p = s;
+	int neg = 0, t = 0, any = 0;
+	double sum = 0, frac;
+	long n;
+
+	if (*p == '-') {
+		neg = 1;
+		p++;
+	}
+
+	if (*p++ != 'P')
+		return -1;
+
+	while (*p) {
+		if (*p == 'T' && !t) {
+			t = 1;
+			p++;
+			continue;
+		}
+
+		if (!is_digit(*p))
+			return -1;
+		for (n = 0; is_digit(*p) && n < 100000000; p++)
+			n = n * 10 + *p - '0';
+		p = parse_frac(p, &frac);
+
+		if (!t && *p == 'D')
+			sum += (n + frac) * 86400;
+		else if (t && *p == 'H')
+			sum += (n + frac) * 3600;
+		else if (t && *p == 'M')
+			sum += (n + frac) * 60;
+		else if (t && *p == 'S')
+			sum += n + frac;
+		else
+			return -1;
+
+		p++;
+		any = 1;
+	}
+
+	if (!any)
+		return -1;
+
+	*v = neg ? -sum : sum;
+
+	return 0;
+}
+
+int num_parse_bool(const char *s, double *v)
+{
+	if (!strcmp(s, "true"))
+		*v = 1;
+	else if (!strcmp(s, "false"))
+		*v = 0;
+	else
+		return -1;
+
+	return 0;
+}
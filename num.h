@@ -0,0 +1,21 @@
+#ifndef _NUM_H
+#define _NUM_H
+
+/*
+ * Parsing of ODS attribute values. All functions need the whole string
+ * to be consumed and return 0 on success or -1 on bad format.
+ */
+
+/* office:value: "1234.5", "-1E-05" */
+int num_parse_double(const char *s, double *v);
+
+/* office:date-value: "2024-03-05" or "2024-03-05T10:20:30.5". Unix time */
+int num_parse_date(const char *s, double *v);
+
+/* office:time-value: "PT13H05M10S", "-P1DT02H00M00.5S". Seconds */
+int num_parse_duration(const char *s, double *v);
+
+/* office:boolean-value: "true" or "false" */
+int num_parse_bool(const char *s, double *v);
+
+#endif
@@ -7,324 +7,2069 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
 
+#include "arena.h"
+#include "num.h"
+#include "pool.h"
+#include "ring.h"
+#include "snap.h"
+#include "stats.h"
 #include "xml.h"
 #include "zip.h"
 #include "ods.h"
+#include "ods_int.h"
 
 #define SPREADSHEET_ELEM_PATH "/office:document-content/office:body/office:spreadsheet"
 
-#define ROWS 150
-#define COLS 26
+static const struct {
+	const char *name;
+	int type;
+	int atom; /* Attribute with the value */
+	int (*parse)(const char *s, double *v);
+} cell_types[] = {
+	{ "float",      ODS_TYPE_FLOAT,      ATOM_OFFICE_VALUE,
+	  num_parse_double },
+	{ "string",     ODS_TYPE_STRING,     ATOM_UNKNOWN, NULL },
+	{ "percentage", ODS_TYPE_PERCENTAGE, ATOM_OFFICE_VALUE,
+	  num_parse_double },
+	{ "currency",   ODS_TYPE_CURRENCY,   ATOM_OFFICE_VALUE,
+	  num_parse_double },
+	{ "date",       ODS_TYPE_DATE,       ATOM_OFFICE_DATE_VALUE,
+	  num_parse_date },
+	{ "time",       ODS_TYPE_TIME,       ATOM_OFFICE_TIME_VALUE,
+	  num_parse_duration },
+	{ "boolean",    ODS_TYPE_BOOLEAN,    ATOM_OFFICE_BOOLEAN_VALUE,
+	  num_parse_bool },
+};
+
+/* Number of repeated rows/cols: at least one */
+static int get_repeated(struct xml_elem *elem, int atom)
+{
+	const char *s;
+	int n;
+
+	s = xml_get_attr_atom(elem, atom);
+	if (!s)
+		return 1;
 
-struct ctx {
-	struct xml_elem *root;
-	struct xml_elem *spreadsheet;
+	n = atoi(s);
+
+	return n > 0 ? n : 1;
+}
+
+/*
+ * Area load: the filter numbers rows and cells of the loaded sheets as
+ * they are parsed, keeps those in the area and drops the others. Kept
+ * ones are listed with their positions, the sheet is built from the list.
+ */
+
+struct area_cell {
+	int col;
+	int n;
+	struct xml_elem *elem;
 };
 
-struct sheet_ctx {
-	struct ctx *ctx;
-	const char *name;
+struct area_sheet {
 	struct xml_elem *sheet;
-	const char *val[ROWS][COLS];
+	struct row_run *rows; /* Cells: [cell, cell + ncells) of @cells */
+	int nrows, rows_sz;
+	struct area_cell *cells;
+	int ncells, cells_sz;
 };
 
-struct zip_extr_wr_ctx {
-	FILE *fp;
+struct area {
+	int row1, col1, row2, col2;
+	int nleft; /* Loaded sheets not passed yet, -1: all are loaded */
+	struct area_sheet *sheets;
+	int nsheets, sheets_sz;
+	/* Parsing position */
+	struct area_sheet *cur; /* NULL: out of a loaded sheet */
+	int done; /* Rows of the current sheet are past the area */
+	struct xml_elem *row; /* Kept row */
+	int nrow, ncol; /* Next row and column */
 	struct ebuf *ebuf;
 };
 
-static int zip_extr_wr(const char *buf, int n, void *priv)
+static void free_area(struct area *a)
 {
-	struct zip_extr_wr_ctx *ctx = (struct zip_extr_wr_ctx *)priv;
+	int i;
 
-	if (!n) { /* End of data? */
-		if (fflush(ctx->fp))
-			goto wr_err;
-	} else {
-		if (fwrite(buf, n, 1, ctx->fp) != 1)
-			goto wr_err;
+	if (!a)
+		return;
+
+	for (i = 0; i < a->nsheets; i++) {
+		free(a->sheets[i].rows);
+		free(a->sheets[i].cells);
+	}
+	free(a->sheets);
+	free(a);
+}
+
+static int new_area(struct ctx *ctx, const struct ods_opts *opts,
+		    struct ebuf *ebuf)
+{
+	struct area *a;
+	int i;
+
+	if (check_area(opts->row1, opts->col1, opts->row2, opts->col2)) {
+		ebuf_add(ebuf, "ods: invalid area\n");
+		return -1;
+	}
+
+	a = calloc(1, sizeof(*a));
+	if (!a) {
+		ebuf_add(ebuf, "ods: no memory for area\n");
+		return -1;
+	}
+
+	a->row1 = opts->row1;
+	a->col1 = opts->col1;
+	a->row2 = opts->row2;
+	a->col2 = opts->col2;
+	a->nleft = -1;
+	if (ctx->sheets) {
+		for (i = 0; ctx->sheets[i]; i++)
+			;
+		a->nleft = i;
 	}
+	a->ebuf = ebuf;
+
+	ctx->area = a;
 
 	return 0;
+}
 
-wr_err:
-	ebuf_add(ctx->ebuf, "ods: failed to write to a tmp file: %s\n", strerror(errno));
-	return -1;
+static struct area_sheet *find_area_sheet(struct area *a,
+					  struct xml_elem *sheet)
+{
+	int i;
+
+	for (i = 0; a && i < a->nsheets; i++) {
+		if (a->sheets[i].sheet == sheet)
+			return &a->sheets[i];
+	}
+
+	return NULL;
 }
 
-void *ods_open(const char *fname, struct ebuf *ebuf)
+static int area_sheet_start(struct area *a, struct xml_elem *sheet)
 {
-	struct xml_elem *root, *spreadsheet;
-	struct ctx *ctx;
-	struct zip_extr_wr_ctx wr_ctx;
-	FILE *fp;
-
-	/* Extract content.xml from ods-file to a temp file */
-	fp = tmpfile();
-	if (!fp) {
-		ebuf_add(ebuf, "ods: failed to create a tmp file: %s\n",
-			strerror(errno));
-		return NULL;
+	struct area_sheet *s;
+
+	if (a->nsheets == a->sheets_sz) {
+		s = realloc(a->sheets, (a->sheets_sz * 2 + 4) * sizeof(*s));
+		if (!s)
+			return -1;
+		a->sheets = s;
+		a->sheets_sz = a->sheets_sz * 2 + 4;
 	}
-	wr_ctx.fp = fp;
-	wr_ctx.ebuf = ebuf;
-	if (zip_extract(fname, "content.xml", zip_extr_wr, &wr_ctx, ebuf)) {
-		ebuf_add(ebuf, "ods: failed to extract \"content.xml\"\n");
-		fclose(fp);
-		return NULL;
+
+	s = &a->sheets[a->nsheets++];
+	memset(s, 0, sizeof(*s));
+	s->sheet = sheet;
+
+	a->cur = s;
+	a->done = 0;
+	a->row = NULL;
+	a->nrow = 0;
+
+	return 0;
+}
+
+static int area_row(struct area *a, struct xml_elem *elem)
+{
+	struct area_sheet *s = a->cur;
+	struct row_run *r;
+	int row = a->nrow, n;
+
+	if (a->done || row >= ODS_MAX_ROWS)
+		return XML_DROP;
+
+	n = get_repeated(elem, ATOM_TABLE_NUMBER_ROWS_REPEATED);
+	if (n > ODS_MAX_ROWS - row)
+		n = ODS_MAX_ROWS - row;
+	a->nrow += n;
+
+	if (row > a->row2) {
+		/* Rows only go down: the rest of the sheet is not needed */
+		a->done = 1;
+		a->row = NULL;
+		return a->nleft > 0 && !--a->nleft ? XML_STOP : XML_DROP;
 	}
 
-	if (fseek(fp, 0, SEEK_SET)) {
-		ebuf_add(ebuf, "ods: failed to seek to the begining of the tmp file: %s\n", strerror(errno));
-		fclose(fp);
-		return NULL;
+	if (row + n <= a->row1)
+		return XML_DROP;
+
+	if (s->nrows == s->rows_sz) {
+		r = realloc(s->rows, (s->rows_sz * 2 + 16) * sizeof(*r));
+		if (!r)
+			return -1;
+		s->rows = r;
+		s->rows_sz = s->rows_sz * 2 + 16;
 	}
 
-	ctx = calloc(sizeof(*ctx), 1);
-	if (!ctx) {
-		ebuf_add(ebuf, "ods: no memory for spreadsheet ctx\n");
-		fclose(fp);
-		return NULL;
+	r = &s->rows[s->nrows++];
+	r->row = row;
+	r->n = n;
+	r->cell = s->ncells;
+	r->ncells = 0;
+
+	a->row = elem;
+	a->ncol = 0;
+
+	return 0;
+}
+
+static int area_cell(struct area *a, struct xml_elem *elem)
+{
+	struct area_sheet *s = a->cur;
+	struct area_cell *c;
+	int col = a->ncol, n;
+
+	if (col >= ODS_MAX_COLS)
+		return XML_DROP;
+
+	n = get_repeated(elem, ATOM_TABLE_NUMBER_COLUMNS_REPEATED);
+	if (n > ODS_MAX_COLS - col)
+		n = ODS_MAX_COLS - col;
+	a->ncol += n;
+
+	if (col > a->col2 || col + n <= a->col1)
+		return XML_DROP;
+
+	if (s->ncells == s->cells_sz) {
+		c = realloc(s->cells, (s->cells_sz * 2 + 64) * sizeof(*c));
+		if (!c)
+			return -1;
+		s->cells = c;
+		s->cells_sz = s->cells_sz * 2 + 64;
 	}
 
-	ctx->root = xml_parse(fp, ebuf);
-	fclose(fp);
-	if (!ctx->root) {
-		ebuf_add(ebuf, "ods: failed to parse spreadsheet\n");
-		goto err;
+	c = &s->cells[s->ncells++];
+	c->col = col;
+	c->n = n;
+	c->elem = elem;
+	s->rows[s->nrows - 1].ncells++;
+
+	return 0;
+}
+
+/* Rows of a sheet may be inside header rows and row groups, which nest */
+static int is_row_group(struct xml_elem *p)
+{
+	return p->atom == ATOM_TABLE_TABLE_HEADER_ROWS
+	       || p->atom == ATOM_TABLE_TABLE_ROW_GROUP;
+}
+
+/* Is @p the sheet itself or a row group in it */
+static int is_rows_parent(struct xml_elem *sheet, struct xml_elem *p)
+{
+	for (; p != sheet; p = p->parent) {
+		if (!p || !is_row_group(p))
+			return 0;
 	}
 
-	ctx->spreadsheet = xml_get_elem(ctx->root, SPREADSHEET_ELEM_PATH);
-	if (!ctx->spreadsheet) {
-		ebuf_add(ebuf, "ods: spreadsheet root elem not found\n");
-		goto err;
+	return 1;
+}
+
+/* Next child of the sheet in document order, row groups are walked into */
+static struct xml_elem *next_row_elem(struct xml_elem *sheet,
+				      struct xml_elem *p)
+{
+	if (is_row_group(p) && p->child)
+		return p->child;
+
+	while (!p->pnext) {
+		p = p->parent;
+		if (p == sheet)
+			return NULL;
 	}
 
-	return ctx;
+	return p->pnext;
+}
 
-err:
-	xml_free(ctx->root);
-	free(ctx);
-	return NULL;
+/* Rows and cells of the loaded sheet, as open_sheet() walks them */
+static int area_filter(struct area *a, struct xml_elem *elem)
+{
+	struct xml_elem *sheet = a->cur ? a->cur->sheet : NULL;
+	struct xml_elem *parent = elem->parent;
+	int r;
+
+	if (!sheet)
+		return 0;
+
+	if (elem->atom == ATOM_TABLE_TABLE_ROW
+	    && is_rows_parent(sheet, parent))
+		r = area_row(a, elem);
+	else if ((elem->atom == ATOM_TABLE_TABLE_CELL
+		  || elem->atom == ATOM_TABLE_COVERED_TABLE_CELL)
+		 && parent == a->row)
+		r = area_cell(a, elem);
+	else
+		return 0;
+
+	if (r < 0)
+		ebuf_add(a->ebuf, "ods: no memory for area\n");
+
+	return r;
 }
 
-void ods_close(void *_ctx)
+/* Feed inflated content.xml straight into the parser -- no tmp file */
+static int zip_extr_wr(const char *buf, int n, void *priv)
 {
-	struct ctx *ctx = (struct ctx *)_ctx;
+	if (!n) /* End of data? */
+		return 0;
 
-	if (!ctx)
-		return;
+	return xml_parser_feed((struct xml_parser *)priv, buf, n);
+}
 
-	xml_free(ctx->root);
+static int is_loaded(struct ctx *ctx, const char *name)
+{
+	char **p;
+
+	if (!ctx->sheets)
+		return 1;
+
+	for (p = ctx->sheets; *p; p++) {
+		if (!strcmp(*p, name))
+			return 1;
+	}
+
+	return 0;
 }
 
-/* Row and col args are only needed for output in error messages */
-static const char *get_cell_val(struct xml_elem *cell, int row, int col,
-				struct ebuf *ebuf)
+/* Skip content of sheets that are not requested and cells out of the area */
+static int sheet_filter(void *priv, struct xml_elem *elem)
 {
-	const char *type;
-	struct xml_elem *p;
-	char *s, *q;
-	char buf[256];
-	int n;
+	struct ctx *ctx = (struct ctx *)priv;
+	const char *name;
 
-	type = xml_get_attr(cell, "office:value-type");
-	if (!type)
-		return NULL;
+	if (elem->atom != ATOM_TABLE_TABLE
+	    || elem->parent->atom != ATOM_OFFICE_SPREADSHEET)
+		return ctx->area ? area_filter(ctx->area, elem) : 0;
 
-	/* For float cells we also return text value -- how user see it. */
-	if (!strcmp(type, "string") || !strcmp(type, "float")) {
-		p = cell->child;
-		if (!p || p->pnext || strcmp(p->name, "text:p")) {
-			ebuf_add(ebuf, "xml: expected \"text:p\" elem in the string cell (%d, %d)\n", row, col);
-			return NULL;
-		}
+	name = xml_get_attr_atom(elem, ATOM_TABLE_NAME);
 
-		p = p->child;
-		if (!p) {
-			s = "";
-		} else if (!p->pnext && p->type == XML_ELEM_TYPE_TEXT) {
-			s = p->name;
-		} else { /* Impossible for float cells? */
-			/* Concat text parts */
-			q = buf;
-			do {
-				if (p->type == XML_ELEM_TYPE_TEXT) {
-					n = strlen(p->name);
-					if (q + n - buf > sizeof(buf) - 1) {
-						ebuf_add(ebuf, "xml: too long text in (%d,%d)\n", row, col);
-						return NULL;
-					}
-					memcpy(q, p->name, n + 1);
-					q += n;
-				}
-				p = p->pnext;
-			} while (p);
-			s = buf;
-		}
-	} /*else if (!strcmp(type, "float")) {
-		s = xml_get_attr(cell, "office:value");
-	}*/ else { /* Unknown cell type */
-		return NULL;
+	if (!name || !is_loaded(ctx, name)) {
+		if (ctx->area)
+			ctx->area->cur = NULL;
+		return XML_SKIP;
 	}
 
-	s = strdup(s);
-	if (!s)
-		ebuf_add(ebuf, "xml: no memory for cell value copy\n");
+	if (ctx->area && area_sheet_start(ctx->area, elem)) {
+		ebuf_add(ctx->area->ebuf, "ods: no memory for area\n");
+		return -1;
+	}
 
-	return s;
+	return 0;
 }
 
-static void handle_row(struct xml_elem *row, const char **val, int nrow,
-			struct ebuf *ebuf)
+static int copy_sheet_names(struct ctx *ctx, const char * const *sheets,
+			    struct ebuf *ebuf)
 {
-	struct xml_elem *p;
 	int i, n;
-	const char *s;
 
-	//printf("Handle row %d\n", nrow);
-	for (p = row->child, i = 0; p && i < COLS; p = p->pnext) {
-		if (!strcmp(p->name, "table:table-cell")
-		    || !strcmp(p->name, "table:covered-table-cell")) {
-			s = xml_get_attr(p, "table:number-columns-repeated");
-			n = s ? atoi(s) : 1; /* Number of columns with the same value */
-			if (i + n > COLS)
-				n = COLS - i;
-			s = get_cell_val(p, nrow, i, ebuf);
-			//printf("Get col (%d, %d) val: \"%s\"\n", i, nrow, s);
-			//printf("%d cols has the same value\n", n);
-			i += n;
-			while (n--)
-				*val++ = s;
-		}
+	for (n = 0; sheets[n]; n++)
+		;
+
+	ctx->sheets = calloc(n + 1, sizeof(*ctx->sheets));
+	if (!ctx->sheets)
+		goto nomem;
+
+	for (i = 0; i < n; i++) {
+		ctx->sheets[i] = strdup(sheets[i]);
+		if (!ctx->sheets[i])
+			goto nomem;
 	}
+
+	return 0;
+
+nomem:
+	ebuf_add(ebuf, "ods: no memory for sheet names\n");
+	return -1;
 }
 
-void *ods_open_sheet(void *_ctx, const char *name, struct ebuf *ebuf)
+static void free_sheet_names(struct ctx *ctx)
 {
-	struct ctx *ctx = (struct ctx *)_ctx;
-	struct xml_elem *sheet, *p, *q;
-	struct sheet_ctx *sh_ctx;
-	int i, n;
-	const char *s;
+	char **p;
 
-	sheet = xml_get_child_with_attr(ctx->spreadsheet, "table:table",
-				        "table:name", name);
-	if (!sheet) {
-		ebuf_add(ebuf, "ods: sheet not found\n");
-		return NULL;
+	if (!ctx->sheets)
+		return;
+
+	for (p = ctx->sheets; *p; p++)
+		free(*p);
+	free(ctx->sheets);
+}
+
+/* List sheets and index them by name */
+static int list_sheets(struct ctx *ctx, struct ebuf *ebuf)
+{
+	struct xml_elem *p;
+	int n = 0;
+
+	for (p = ctx->spreadsheet->child; p; p = p->pnext)
+		n += p->atom == ATOM_TABLE_TABLE;
+
+	ctx->names = malloc((n + 1) * sizeof(*ctx->names));
+	if (!ctx->names
+	    || xml_index_children(ctx->spreadsheet, ATOM_TABLE_TABLE,
+				  ATOM_TABLE_NAME)) {
+		ebuf_add(ebuf, "ods: no memory for sheet index\n");
+		return -1;
 	}
 
-	sh_ctx = calloc(sizeof(*sh_ctx), 1);
-	if (!sh_ctx) {
-		ebuf_add(ebuf, "ods: no memory for sheet ctx\n");
-		return NULL;
+	for (p = ctx->spreadsheet->child; p; p = p->pnext) {
+		if (p->atom == ATOM_TABLE_TABLE)
+			ctx->names[ctx->nnames++] =
+				xml_get_attr_atom(p, ATOM_TABLE_NAME);
 	}
 
-	sh_ctx->ctx = ctx;
+	return 0;
+}
 
-	sh_ctx->name = strdup(name);
-	if (!sh_ctx->name) {
-		ebuf_add(ebuf, "ods: No memory for sheet name\n");
-		free(sh_ctx);
+static void free_frags(struct ctx *ctx)
+{
+	int i;
+
+	for (i = 0; i < ctx->nfrags; i++)
+		xml_free(ctx->frags[i]);
+	free(ctx->frags);
+}
+
+/* Parse content.xml as it is inflated */
+static struct xml_elem *load(struct ctx *ctx, void *zip, int i,
+			     struct ebuf *ebuf)
+{
+	struct xml_parser *xp;
+
+	xp = xml_parser_new(ebuf);
+	if (!xp)
+		return NULL;
+
+	if (ctx->sheets || ctx->area)
+		xml_parser_filter(xp, sheet_filter, ctx);
+
+	if (zip_entry_extract(zip, i, zip_extr_wr, xp, ebuf)) {
+		ebuf_add(ebuf, "ods: failed to extract \"content.xml\"\n");
+		xml_parser_free(xp);
 		return NULL;
 	}
 
-	sh_ctx->sheet = sheet;
+	return xml_parser_fin(xp);
+}
 
-	for (i = 0, p = sheet->child, q = NULL; p && i < ROWS;) {
-		if (!strcmp(p->name, "table:table-row")) {
-			handle_row(p, sh_ctx->val[i], i, ebuf);
-			s = xml_get_attr(p, "table:number-rows-repeated");
-			n = s ? atoi(s) : 1;
-			if (i + n > ROWS)
-				n = ROWS - i;
-			while (--n) {
-				memcpy(sh_ctx->val[i + 1], sh_ctx->val[i],
-					COLS * sizeof(void *));
-				i++;
-			}
+/*
+ * Pipelined loading: content.xml is inflated on a worker thread into a ring
+ * of buffers, the caller's thread parses them as they are filled.
+ */
 
-			i++;
-		} else if (!q && !strcmp(p->name, "table:table-header-rows")) {
-			q = p;
-		}
+#define RING_BUFS 4
+#define RING_BUF_SZ (1 << 20)
 
-		p = (p != q) ? p->pnext : p->child;
+struct inflate_job {
+	struct pool_task task; /* Must be the first */
+	void *zip;
+	int i;
+	struct ring *ring;
+	int err;
+	struct ebuf ebuf;
+	char ebuf_buf[256];
+};
 
-		if (!p && q) {
-			p = q->pnext;
-			q = NULL;
-		}
-	}
+static int ring_wr(const char *buf, int n, void *priv)
+{
+	if (!n) /* End of data? */
+		return 0;
 
-	return sh_ctx;
+	return ring_write((struct ring *)priv, buf, n);
 }
 
-void ods_close_sheet(void *sheet_ctx)
+static void inflate_entry(struct pool_task *task)
 {
-	struct sheet_ctx *ctx = (struct sheet_ctx *)sheet_ctx;
-	int i, j;
-	const char **v, *p;
+	struct inflate_job *job = (struct inflate_job *)task;
 
-	if (!ctx)
-		return;
+	job->err = zip_entry_extract(job->zip, job->i, ring_wr, job->ring,
+				     &job->ebuf);
+	ring_close(job->ring);
+}
+
+static struct xml_elem *load_pipelined(struct ctx *ctx, void *zip, int i,
+				       struct ebuf *ebuf)
+{
+	struct inflate_job job;
+	struct xml_parser *xp;
+	struct pool *pool;
+	const char *buf;
+	int n, r, err = 0, stopped = 0;
+
+	memset(&job, 0, sizeof(job));
+	job.task.fn = inflate_entry;
+	job.zip = zip;
+	job.i = i;
+	ebuf_init(&job.ebuf, job.ebuf_buf, sizeof(job.ebuf_buf));
+
+	xp = xml_parser_new(ebuf);
+	if (!xp)
+		return NULL;
+
+	if (ctx->sheets || ctx->area)
+		xml_parser_filter(xp, sheet_filter, ctx);
+
+	job.ring = ring_new(RING_BUFS, RING_BUF_SZ, ebuf);
+	if (!job.ring)
+		goto err;
+
+	pool = pool_new(1, ebuf);
+	if (!pool)
+		goto err;
+
+	pool_submit(pool, &job.task);
+
+	while ((buf = ring_read(job.ring, &n))) {
+		r = xml_parser_feed(xp, buf, n);
+		if (r) {
+			/* Unblock and stop the inflate stage */
+			ring_abort(job.ring);
+			if (r > 0)
+				stopped = 1;
+			else
+				err = 1;
+			break;
+		}
+	}
+
+	pool_free(pool);
 
 	/*
-	 * There can be a sequence of rows that are copy of each other.
-	 * There can be a sequence of cols with the same pointer.
+	 * Inflate errors after the parser has failed or stopped are just
+	 * a result
 	 */
-	for (i = 0, v = ctx->val[0]; i < ROWS; i++) {
-		if (!i || memcmp(v, v - COLS, COLS * sizeof(*v))) {
-			for (j = 0, p = NULL; j < COLS; j++, v++) {
-				if (*v != p) {
-					p = *v;
-					free((void *)p);
-				}
-			}
+	if (!err && !stopped && job.err) {
+		ebuf_add(ebuf, "%sods: failed to extract \"content.xml\"\n",
+			 ebuf_s(&job.ebuf));
+		err = 1;
+	}
+
+	if (err)
+		goto err;
+
+	ring_free(job.ring);
+
+	return xml_parser_fin(xp);
+
+err:
+	ring_free(job.ring);
+	xml_parser_free(xp);
+	return NULL;
+}
+
+/*
+ * Parallel loading. content.xml is inflated into memory and parsed with
+ * content of all sheets skipped. Source of each sheet is found on the way
+ * and parsed in place into a tree of its own by a worker: the buffer is
+ * kept while the trees live. Sheets content is then moved to the main
+ * tree.
+ */
+
+struct sheet_job {
+	struct pool_task task; /* Must be the first */
+	struct xml_elem *elem; /* Empty sheet in the main tree */
+	char *p, *end; /* Sheet source: from the start tag to the end */
+	struct xml_elem *root; /* Parsed sheet */
+	struct ebuf ebuf;
+	char ebuf_buf[256];
+};
+
+struct loader {
+	struct ctx *ctx;
+	struct xml_parser *xp;
+	char *buf; /* content.xml */
+	size_t len;
+	struct sheet_job *jobs;
+	int njobs, jobs_sz;
+	struct ebuf *ebuf;
+};
+
+static int split_filter(void *priv, struct xml_elem *elem)
+{
+	struct loader *ld = (struct loader *)priv;
+	struct sheet_job *job;
+	char *p, *q;
+
+	if (elem->type != XML_ELEM_TYPE_ELEM || elem->atom != ATOM_TABLE_TABLE
+	    || elem->parent->atom != ATOM_OFFICE_SPREADSHEET)
+		return 0;
+
+	/* Not requested */
+	if (sheet_filter(ld->ctx, elem) == XML_SKIP)
+		return XML_SKIP;
+
+	/* Start tag has no '<' inside */
+	q = ld->buf + xml_parser_offset(ld->xp);
+	for (p = q - 1; p > ld->buf && *p != '<'; p--)
+		;
+
+	if (ld->njobs == ld->jobs_sz) {
+		job = realloc(ld->jobs, (ld->jobs_sz * 2 + 8) * sizeof(*job));
+		if (!job) {
+			ebuf_add(ld->ebuf, "ods: no memory for sheet jobs\n");
+			return -1;
 		}
+		ld->jobs = job;
+		ld->jobs_sz = ld->jobs_sz * 2 + 8;
 	}
 
-	free((void *)ctx->name);
-	free(ctx);
+	job = &ld->jobs[ld->njobs];
+	memset(job, 0, sizeof(*job));
+	job->elem = elem;
+	job->p = p;
+	job->end = (char *)xml_skip(q, ld->buf + ld->len);
+	if (!job->end) {
+		ebuf_add(ld->ebuf, "ods: end of sheet not found\n");
+		return -1;
+	}
+	ld->njobs++;
+
+	return XML_SKIP;
 }
 
-const char *ods_sheet_val(void *sheet_ctx, int row, int col)
+/* Sheets sources do not overlap: each is parsed in place on its own */
+static void parse_sheet(struct pool_task *task)
 {
-	if (row < 0 || row >= ROWS || col < 0 || col >= COLS)
-		return NULL;
+	struct sheet_job *job = (struct sheet_job *)task;
 
-	return ((struct sheet_ctx *)sheet_ctx)->val[row][col];
+	job->root = xml_parse_mem(job->p, job->end - job->p, &job->ebuf);
 }
 
-void ods_print_sheet_names(void *_ctx)
+/* Biggest sheets go first */
+static int cmp_job_size(const void *a, const void *b)
 {
-	struct ctx *ctx = (struct ctx *)_ctx;
-	struct xml_elem *p;
-	char *tname;
+	const struct sheet_job *x = *(const struct sheet_job **)a;
+	const struct sheet_job *y = *(const struct sheet_job **)b;
+	long d = (y->end - y->p) - (x->end - x->p);
 
-	for (p = ctx->spreadsheet->child; p; p = p->pnext) {
-		if (!strcmp(p->name, "table:table")) {
-			tname = xml_get_attr(p, "table:name");
-			printf("%s\n", tname);
-		}
-	}
+	return d < 0 ? -1 : d > 0;
 }
 
-int ods_print_sheet(void *_ctx, const char *name)
+static struct xml_elem *load_parallel(struct ctx *ctx, void *zip, int i,
+				      int nthreads, struct ebuf *ebuf)
 {
-	struct ctx *ctx = (struct ctx *)_ctx;
-	struct xml_elem *sheet;
+	struct loader ld;
+	struct sheet_job **order = NULL;
+	struct xml_elem *root = NULL, *p;
+	struct pool *pool;
+	int k;
 
-	sheet = xml_get_child_with_attr(ctx->spreadsheet, "table:table",
-				        "table:name", name);
-	if (!sheet) {
-		fprintf(stderr, "Failed to get sheet \"%s\"\n", name);
-		return -1;
+	memset(&ld, 0, sizeof(ld));
+	ld.ctx = ctx;
+	ld.ebuf = ebuf;
+
+	/* Exactly sized, inflated in one go */
+	ld.buf = zip_entry_read(zip, i, NULL, ebuf);
+	if (!ld.buf) {
+		ebuf_add(ebuf, "ods: failed to extract \"content.xml\"\n");
+		return NULL;
 	}
+	ld.len = zip_entry_size(zip, i);
 
-	xml_print(sheet, stdout);
+	ld.xp = xml_parser_new(ebuf);
+	if (!ld.xp)
+		goto out;
+
+	xml_parser_filter(ld.xp, split_filter, &ld);
+
+	if (ld.len > INT_MAX) {
+		ebuf_add(ebuf, "ods: too big \"content.xml\"\n");
+		xml_parser_free(ld.xp);
+		goto out;
+	}
+
+	if (xml_parser_feed(ld.xp, ld.buf, ld.len) < 0) {
+		xml_parser_free(ld.xp);
+		goto out;
+	}
+
+	root = xml_parser_fin(ld.xp);
+	if (!root || !ld.njobs)
+		goto out;
+
+	ctx->frags = calloc(ld.njobs, sizeof(*ctx->frags));
+	order = malloc(ld.njobs * sizeof(*order));
+	if (!ctx->frags || !order) {
+		ebuf_add(ebuf, "ods: no memory for sheet jobs\n");
+		goto err;
+	}
+
+	for (k = 0; k < ld.njobs; k++) {
+		ebuf_init(&ld.jobs[k].ebuf, ld.jobs[k].ebuf_buf,
+			  sizeof(ld.jobs[k].ebuf_buf));
+		ld.jobs[k].task.fn = parse_sheet;
+		order[k] = &ld.jobs[k];
+	}
+	qsort(order, ld.njobs, sizeof(*order), cmp_job_size);
+
+	pool = pool_new(nthreads < ld.njobs ? nthreads : ld.njobs, ebuf);
+	if (!pool)
+		goto err;
+
+	for (k = 0; k < ld.njobs; k++)
+		pool_submit(pool, &order[k]->task);
+
+	pool_free(pool);
+
+	/* Sheet trees point into it */
+	ctx->content = ld.buf;
+	ctx->content_sz = ld.len;
+	ld.buf = NULL;
+
+	/* Stitch in document order, keep the sheet trees for freeing */
+	for (k = 0; k < ld.njobs; k++) {
+		if (ld.jobs[k].root)
+			ctx->frags[ctx->nfrags++] = ld.jobs[k].root;
+	}
+
+	for (k = 0; k < ld.njobs; k++) {
+		if (!ld.jobs[k].root) {
+			/* Positions are relative to the sheet start */
+			ebuf_add(ebuf, "%sods: failed to parse sheet \"%s\"\n",
+				 ebuf_s(&ld.jobs[k].ebuf),
+				 xml_get_attr_atom(ld.jobs[k].elem,
+						   ATOM_TABLE_NAME));
+			goto err;
+		}
+
+		ld.jobs[k].elem->child = ld.jobs[k].root->child;
+		for (p = ld.jobs[k].elem->child; p; p = p->pnext)
+			p->parent = ld.jobs[k].elem;
+	}
+
+out:
+	free(order);
+	free(ld.jobs);
+	free(ld.buf);
+	return root;
+
+err:
+	xml_free(root);
+	root = NULL;
+	goto out;
+}
+
+void *ods_open(const char *fname, struct ebuf *ebuf)
+{
+	return ods_open_ex(fname, NULL, ebuf);
+}
+
+/* Snapshot is valid for the same file with the same content.xml */
+static int make_snap_key(const char *fname, void *zip, int i,
+			 struct snap_key *key)
+{
+	struct stat st;
+
+	if (stat(fname, &st))
+		return -1;
+
+	key->path = realpath(fname, NULL);
+	if (!key->path)
+		return -1;
+
+	key->size = st.st_size;
+	key->mtime_sec = st.st_mtim.tv_sec;
+	key->mtime_nsec = st.st_mtim.tv_nsec;
+	key->crc = zip_entry_crc32(zip, i);
+
+	return 0;
+}
+
+/* Snapshot of all sheets. Failure is not an error: there is just none */
+static void save_snap(struct ctx *ctx, const char *fname,
+		      const struct snap_key *key)
+{
+	struct ebuf ebuf;
+	char ebuf_buf[256];
+	struct snap_wr *w;
+	struct sheet_ctx *sh;
+	struct xml_elem *p;
+	const char *name;
+	int n = 0;
+
+	ebuf_init(&ebuf, ebuf_buf, sizeof(ebuf_buf));
+
+	for (p = ctx->spreadsheet->child; p; p = p->pnext) {
+		if (p->atom == ATOM_TABLE_TABLE)
+			n++;
+	}
+
+	w = snap_wr_new(fname, key, n, &ebuf);
+	if (!w)
+		return;
+
+	for (p = ctx->spreadsheet->child; p; p = p->pnext) {
+		if (p->atom != ATOM_TABLE_TABLE)
+			continue;
+
+		name = xml_get_attr_atom(p, ATOM_TABLE_NAME);
+		sh = name ? ods_open_sheet(ctx, name, &ebuf) : NULL;
+		if (!sh) {
+			snap_wr_fin(w, 0);
+			return;
+		}
+
+		n = cell_texts(sh) || snap_wr_sheet(w, sh);
+		ods_close_sheet(sh);
+		if (n) {
+			snap_wr_fin(w, 0);
+			return;
+		}
+	}
+
+	snap_wr_fin(w, 1);
+}
+
+static void *open_ex(const char *fname, const struct ods_opts *opts,
+		     struct ebuf *ebuf)
+{
+	struct ctx *ctx;
+	struct snap_key key;
+	char *snap = NULL;
+	void *zip;
+	int i;
+
+	ctx = calloc(sizeof(*ctx), 1);
+	if (!ctx) {
+		ebuf_add(ebuf, "ods: no memory for spreadsheet ctx\n");
+		return NULL;
+	}
+
+	memset(&key, 0, sizeof(key));
+
+	zip = zip_open(fname, ebuf);
+	if (!zip)
+		goto err;
+
+	i = zip_find(zip, "content.xml");
+	if (i < 0) {
+		ebuf_add(ebuf, "ods: no \"content.xml\" in ods-file\n");
+		zip_close(zip);
+		goto err;
+	}
+
+	if (opts && opts->cache && !make_snap_key(fname, zip, i, &key)) {
+		snap = snap_path(key.path, opts->cache_dir);
+		ctx->snap = snap ? snap_open(snap, &key) : NULL;
+		if (ctx->snap) {
+			zip_close(zip);
+			free(snap);
+			free((char *)key.path);
+			return ctx;
+		}
+	}
+
+	/* Snapshot needs all sheets */
+	if (opts && opts->sheets && !snap
+	    && copy_sheet_names(ctx, opts->sheets, ebuf)) {
+		zip_close(zip);
+		goto err;
+	}
+
+	if (opts && opts->area && !snap && opts->threads <= 1
+	    && new_area(ctx, opts, ebuf)) {
+		zip_close(zip);
+		goto err;
+	}
+
+	if (opts && opts->threads > 1)
+		ctx->root = load_parallel(ctx, zip, i, opts->threads, ebuf);
+	else if (opts && opts->pipeline)
+		ctx->root = load_pipelined(ctx, zip, i, ebuf);
+	else
+		ctx->root = load(ctx, zip, i, ebuf);
+
+	zip_close(zip);
+
+	if (!ctx->root) {
+		ebuf_add(ebuf, "ods: failed to parse spreadsheet\n");
+		goto err;
+	}
+
+	ctx->spreadsheet = xml_get_elem(ctx->root, SPREADSHEET_ELEM_PATH);
+	if (!ctx->spreadsheet) {
+		ebuf_add(ebuf, "ods: spreadsheet root elem not found\n");
+		goto err;
+	}
+
+	if (list_sheets(ctx, ebuf))
+		goto err;
+
+	if (snap)
+		save_snap(ctx, snap, &key);
+
+	free(snap);
+	free((char *)key.path);
+
+	return ctx;
+
+err:
+	free(snap);
+	free((char *)key.path);
+	free_frags(ctx);
+	free(ctx->content);
+	xml_free(ctx->root);
+	free_sheet_names(ctx);
+	free(ctx->names);
+	free_area(ctx->area);
+	free(ctx);
+	return NULL;
+}
+
+void *ods_open_ex(const char *fname, const struct ods_opts *opts,
+		  struct ebuf *ebuf)
+{
+	uint64_t t0 = stats_clock();
+	void *ctx;
+
+	ctx = open_ex(fname, opts, ebuf);
+	STATS_TIME(ods_open_ns, t0);
+
+	return ctx;
+}
+
+void ods_close(void *_ctx)
+{
+	struct ctx *ctx = (struct ctx *)_ctx;
+
+	if (!ctx)
+		return;
+
+	snap_close(ctx->snap);
+	free_frags(ctx);
+	free(ctx->content);
+	xml_free(ctx->root);
+	free_sheet_names(ctx);
+	free(ctx->names);
+	free_area(ctx->area);
+	free(ctx);
+}
+
+/*
+ * Display text: text nodes of the paragraph. Only a text made of several
+ * parts needs a copy.
+ */
+static const char *make_text(struct arena *arena, struct xml_elem *par)
+{
+	struct xml_elem *p;
+	char *s, *q;
+	size_t n;
+
+	p = par->child;
+	if (!p)
+		return "";
+
+	if (!p->pnext && p->type == XML_ELEM_TYPE_TEXT)
+		return p->name;
+
+	for (n = 0; p; p = p->pnext) {
+		if (p->type == XML_ELEM_TYPE_TEXT)
+			n += strlen(p->name);
+	}
+
+	s = arena_alloc(arena, n + 1);
+	if (!s)
+		return NULL;
+
+	for (p = par->child, q = s; p; p = p->pnext) {
+		if (p->type == XML_ELEM_TYPE_TEXT) {
+			n = strlen(p->name);
+			memcpy(q, p->name, n);
+			q += n;
+		}
+	}
+	*q = '\0';
+
+	return s;
+}
+
+/*
+ * Get type and native value of the cell. Returns -1 if there is no value.
+ * Row and col args are only needed for output in error messages.
+ */
+static int get_cell_val(struct xml_elem *cell, int row, int col,
+			struct cell_run *run, struct ebuf *ebuf)
+{
+	const char *type, *s;
+	int i;
+
+	type = xml_get_attr_atom(cell, ATOM_OFFICE_VALUE_TYPE);
+	if (!type)
+		return -1;
+
+	for (i = 0; i < sizeof(cell_types) / sizeof(*cell_types); i++) {
+		if (!strcmp(type, cell_types[i].name))
+			break;
+	}
+
+	if (i == sizeof(cell_types) / sizeof(*cell_types))
+		return -1; /* Unknown cell type */
+
+	run->type = cell_types[i].type;
+	run->num = 0;
+
+	/* Text as user see it */
+	run->text = xml_get_child_atom(cell, ATOM_TEXT_P);
+	if (!run->text && run->type == ODS_TYPE_STRING) {
+		ebuf_add(ebuf, "xml: expected \"text:p\" elem in the string cell (%d, %d)\n", row, col);
+		return -1;
+	}
+
+	if (!cell_types[i].parse)
+		return 0;
+
+	s = xml_get_attr_atom(cell, cell_types[i].atom);
+	if (!s || cell_types[i].parse(s, &run->num)) {
+		ebuf_add(ebuf, "ods: bad %s value in the cell (%d, %d)\n",
+			 type, row, col);
+		if (!run->text)
+			return -1;
+		run->type = ODS_TYPE_STRING; /* Still have the text */
+	}
+
+	return 0;
+}
+
+static int add_cell_run(struct sheet_ctx *ctx, struct cell_run *run,
+			struct ebuf *ebuf)
+{
+	struct cell_run *p;
+
+	if (ctx->ncells == ctx->cells_sz) {
+		p = realloc(ctx->cells, (ctx->cells_sz * 2 + 64) * sizeof(*p));
+		if (!p) {
+			ebuf_add(ebuf, "ods: no memory for cells\n");
+			return -1;
+		}
+		ctx->cells = p;
+		ctx->cells_sz = ctx->cells_sz * 2 + 64;
+		STATS_ALLOC(ctx->cells_sz * sizeof(*p));
+	}
+
+	ctx->cells[ctx->ncells++] = *run;
+	STATS_ADD(ods_cell_runs, 1);
+
+	return 0;
+}
+
+static int add_row_run(struct sheet_ctx *ctx, int row, int n, int cell,
+		       struct ebuf *ebuf)
+{
+	struct row_run *p;
+
+	if (ctx->nrows == ctx->rows_sz) {
+		p = realloc(ctx->rows, (ctx->rows_sz * 2 + 16) * sizeof(*p));
+		if (!p) {
+			ebuf_add(ebuf, "ods: no memory for rows\n");
+			return -1;
+		}
+		ctx->rows = p;
+		ctx->rows_sz = ctx->rows_sz * 2 + 16;
+		STATS_ALLOC(ctx->rows_sz * sizeof(*p));
+	}
+
+	p = &ctx->rows[ctx->nrows++];
+	p->row = row;
+	p->n = n;
+	p->cell = cell;
+	p->ncells = ctx->ncells - cell;
+
+	return 0;
+}
+
+/* Add cell runs of the row, nothing if it is empty */
+static int handle_row(struct sheet_ctx *ctx, struct xml_elem *row, int nrow,
+		      struct ebuf *ebuf)
+{
+	struct xml_elem *p;
+	struct cell_run run;
+	int i, n;
+
+	for (p = row->child, i = 0; p && i < ODS_MAX_COLS; p = p->pnext) {
+		if (p->atom == ATOM_TABLE_TABLE_CELL
+		    || p->atom == ATOM_TABLE_COVERED_TABLE_CELL) {
+			/* Number of columns with the same value */
+			n = get_repeated(p, ATOM_TABLE_NUMBER_COLUMNS_REPEATED);
+			if (n > ODS_MAX_COLS - i)
+				n = ODS_MAX_COLS - i;
+			if (!get_cell_val(p, nrow, i, &run, ebuf)) {
+				run.col = i;
+				run.n = n;
+				if (add_cell_run(ctx, &run, ebuf))
+					return -1;
+			}
+			i += n;
+		}
+	}
+
+	return 0;
+}
+
+/* Rows and cells kept by area_filter() */
+static int area_rows(struct sheet_ctx *ctx, struct area_sheet *plan,
+		     struct ebuf *ebuf)
+{
+	struct area_cell *c, *end;
+	struct row_run *r;
+	struct cell_run run;
+	int cell;
+
+	for (r = plan->rows; r < plan->rows + plan->nrows; r++) {
+		cell = ctx->ncells;
+		c = plan->cells + r->cell;
+		for (end = c + r->ncells; c < end; c++) {
+			if (!get_cell_val(c->elem, r->row, c->col, &run, ebuf)) {
+				run.col = c->col;
+				run.n = c->n;
+				if (add_cell_run(ctx, &run, ebuf))
+					return -1;
+			}
+		}
+		if (ctx->ncells > cell
+		    && add_row_run(ctx, r->row, r->n, cell, ebuf))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/* Binary search of the column containing physical column @col */
+static struct column *find_col(struct column *cols, int ncols, int col)
+{
+	struct column *p;
+	int l = 0, r = ncols - 1, m;
+
+	while (l <= r) {
+		m = (l + r) / 2;
+		p = &cols[m];
+		if (col < p->col)
+			r = m - 1;
+		else if (col >= p->col + p->n)
+			l = m + 1;
+		else
+			return p;
+	}
+
+	return NULL;
+}
+
+static void *col_alloc(struct sheet_ctx *ctx, size_t sz)
+{
+	return arena_zalloc(&ctx->arena, sz ? sz : 1);
+}
+
+/*
+ * Turn cell runs into columns. Physical columns are split at every cell
+ * run boundary, so a cell run covers whole columns. Then every column gets
+ * arrays spanning the row runs it has values in.
+ */
+static int build_columns(struct sheet_ctx *ctx, struct ebuf *ebuf)
+{
+	struct cell_run *c, *end;
+	struct column *p;
+	int *pts, npts, i, j, r, k;
+
+	if (!ctx->ncells)
+		return 0;
+
+	pts = malloc(2 * ctx->ncells * sizeof(*pts));
+	if (!pts)
+		goto nomem;
+
+	for (i = 0; i < ctx->ncells; i++) {
+		pts[2 * i] = ctx->cells[i].col;
+		pts[2 * i + 1] = ctx->cells[i].col + ctx->cells[i].n;
+	}
+
+	qsort(pts, 2 * ctx->ncells, sizeof(*pts), cmp_int);
+	for (i = 1, npts = 1; i < 2 * ctx->ncells; i++) {
+		if (pts[i] != pts[npts - 1])
+			pts[npts++] = pts[i];
+	}
+
+	ctx->cols = calloc(npts - 1, sizeof(*ctx->cols));
+	if (!ctx->cols) {
+		free(pts);
+		goto nomem;
+	}
+
+	for (i = 0; i < npts - 1; i++) {
+		ctx->cols[i].col = pts[i];
+		ctx->cols[i].n = pts[i + 1] - pts[i];
+		ctx->cols[i].row0 = -1;
+	}
+	ctx->ncols = npts - 1;
+	free(pts);
+
+	/* Row runs span of every column */
+	for (r = 0; r < ctx->nrows; r++) {
+		c = &ctx->cells[ctx->rows[r].cell];
+		for (end = c + ctx->rows[r].ncells; c < end; c++) {
+			p = find_col(ctx->cols, ctx->ncols, c->col);
+			for (; p < ctx->cols + ctx->ncols
+			     && p->col < c->col + c->n; p++) {
+				if (p->row0 < 0)
+					p->row0 = r;
+				p->nrows = r - p->row0 + 1;
+			}
+		}
+	}
+
+	/* Drop gaps between cell runs */
+	for (i = 0, j = 0; i < ctx->ncols; i++) {
+		if (ctx->cols[i].row0 >= 0)
+			ctx->cols[j++] = ctx->cols[i];
+	}
+	ctx->ncols = j;
+
+	for (i = 0, p = ctx->cols; i < ctx->ncols; i++, p++) {
+		k = p->nrows;
+		p->null = col_alloc(ctx, (k + 7) / 8);
+		p->type = col_alloc(ctx, k);
+		p->num = col_alloc(ctx, k * sizeof(*p->num));
+		p->src = col_alloc(ctx, k * sizeof(*p->src));
+		p->code = col_alloc(ctx, k * sizeof(*p->code));
+		if (!p->null || !p->type || !p->num || !p->src || !p->code)
+			goto nomem;
+		memset(p->null, 0xff, (k + 7) / 8);
+	}
+
+	for (r = 0; r < ctx->nrows; r++) {
+		c = &ctx->cells[ctx->rows[r].cell];
+		for (end = c + ctx->rows[r].ncells; c < end; c++) {
+			p = find_col(ctx->cols, ctx->ncols, c->col);
+			for (; p < ctx->cols + ctx->ncols
+			     && p->col < c->col + c->n; p++) {
+				k = r - p->row0;
+				p->null[k / 8] &= ~(1 << k % 8);
+				p->type[k] = c->type;
+				p->num[k] = c->num;
+				p->src[k] = c->text;
+			}
+		}
+	}
+
+	/* Cell runs are not needed anymore */
+	free(ctx->cells);
+	ctx->cells = NULL;
+	ctx->ncells = ctx->cells_sz = 0;
+
+	return 0;
+
+nomem:
+	ebuf_add(ebuf, "ods: no memory for columns\n");
+	return -1;
+}
+
+/* Sheet data is in the mapping, nothing to build */
+static void *open_snap_sheet(struct ctx *ctx, const char *name,
+			     struct ebuf *ebuf)
+{
+	struct sheet_ctx *sh_ctx;
+	struct column *c;
+	int i;
+
+	sh_ctx = calloc(sizeof(*sh_ctx), 1);
+	if (!sh_ctx) {
+		ebuf_add(ebuf, "ods: no memory for sheet ctx\n");
+		return NULL;
+	}
+
+	sh_ctx->ctx = ctx;
+	arena_init(&sh_ctx->arena);
+	dict_init(&sh_ctx->dict);
+
+	sh_ctx->name = strdup(name);
+	if (!sh_ctx->name) {
+		ebuf_add(ebuf, "ods: No memory for sheet name\n");
+		free(sh_ctx);
+		return NULL;
+	}
+
+	if (snap_load_sheet(ctx->snap, name, sh_ctx, ebuf)) {
+		ods_close_sheet(sh_ctx);
+		return NULL;
+	}
+
+	/* Heap strings are unique, they get codes as they are read */
+	for (i = 0, c = sh_ctx->cols; i < sh_ctx->ncols; i++, c++) {
+		c->code = col_alloc(sh_ctx, c->nrows * sizeof(*c->code));
+		if (!c->code) {
+			ebuf_add(ebuf, "ods: no memory for columns\n");
+			ods_close_sheet(sh_ctx);
+			return NULL;
+		}
+	}
+
+	return sh_ctx;
+}
+
+static void *open_sheet(struct ctx *ctx, const char *name,
+			struct ebuf *ebuf)
+{
+	struct xml_elem *sheet, *p;
+	struct sheet_ctx *sh_ctx;
+	struct area_sheet *plan;
+	int i, n, cell;
+
+	if (ctx->snap)
+		return open_snap_sheet(ctx, name, ebuf);
+
+	sheet = xml_get_child_with_attr_atom(ctx->spreadsheet,
+					     ATOM_TABLE_TABLE, ATOM_TABLE_NAME,
+					     name);
+	if (!sheet) {
+		ebuf_add(ebuf, "ods: sheet not found\n");
+		return NULL;
+	}
+
+	if (!is_loaded(ctx, name)) {
+		ebuf_add(ebuf, "ods: sheet was not loaded\n");
+		return NULL;
+	}
+
+	sh_ctx = calloc(sizeof(*sh_ctx), 1);
+	if (!sh_ctx) {
+		ebuf_add(ebuf, "ods: no memory for sheet ctx\n");
+		return NULL;
+	}
+
+	sh_ctx->ctx = ctx;
+
+	sh_ctx->name = strdup(name);
+	if (!sh_ctx->name) {
+		ebuf_add(ebuf, "ods: No memory for sheet name\n");
+		free(sh_ctx);
+		return NULL;
+	}
+
+	sh_ctx->sheet = sheet;
+	arena_init(&sh_ctx->arena);
+	dict_init(&sh_ctx->dict);
+
+	plan = find_area_sheet(ctx->area, sheet);
+	if (plan) {
+		if (area_rows(sh_ctx, plan, ebuf))
+			goto err;
+		goto build;
+	}
+
+	p = sheet->child;
+	for (i = 0; p && i < ODS_MAX_ROWS; p = next_row_elem(sheet, p)) {
+		if (p->atom == ATOM_TABLE_TABLE_ROW) {
+			n = get_repeated(p, ATOM_TABLE_NUMBER_ROWS_REPEATED);
+			if (n > ODS_MAX_ROWS - i)
+				n = ODS_MAX_ROWS - i;
+			cell = sh_ctx->ncells;
+			if (handle_row(sh_ctx, p, i, ebuf))
+				goto err;
+			if (sh_ctx->ncells > cell
+			    && add_row_run(sh_ctx, i, n, cell, ebuf))
+				goto err;
+			i += n;
+		}
+	}
+
+build:
+	if (build_columns(sh_ctx, ebuf))
+		goto err;
+
+	return sh_ctx;
+
+err:
+	ods_close_sheet(sh_ctx);
+	return NULL;
+}
+
+void *ods_open_sheet(void *ctx, const char *name, struct ebuf *ebuf)
+{
+	uint64_t t0 = stats_clock();
+	void *sh_ctx;
+
+	sh_ctx = open_sheet((struct ctx *)ctx, name, ebuf);
+	STATS_TIME(ods_build_ns, t0);
+	if (sh_ctx)
+		STATS_ADD(ods_sheets, 1);
+
+	return sh_ctx;
+}
+
+void ods_close_sheet(void *sheet_ctx)
+{
+	struct sheet_ctx *ctx = (struct sheet_ctx *)sheet_ctx;
+
+	if (!ctx)
+		return;
+
+	arena_free(&ctx->arena);
+	dict_free(&ctx->dict);
+	if (!ctx->heap) /* Not mapped */
+		free(ctx->rows);
+	free(ctx->cells);
+	free(ctx->cols);
+	free((void *)ctx->name);
+	free(ctx);
+}
+
+/* Binary search of the row run containing @row */
+static struct row_run *find_row(struct sheet_ctx *ctx, int row)
+{
+	struct row_run *p;
+	int l = 0, r = ctx->nrows - 1, m;
+
+	while (l <= r) {
+		m = (l + r) / 2;
+		p = &ctx->rows[m];
+		if (row < p->row)
+			r = m - 1;
+		else if (row >= p->row + p->n)
+			l = m + 1;
+		else
+			return p;
+	}
+
+	return NULL;
+}
+
+/* Column and index of the cell in it, -1 if the cell is empty */
+static int find_cell(struct sheet_ctx *ctx, int row, int col,
+		     struct column **pcol)
+{
+	struct row_run *rr;
+	struct column *c;
+	int k;
+
+	if (row < 0 || row >= ODS_MAX_ROWS || col < 0 || col >= ODS_MAX_COLS)
+		return -1;
+
+	rr = find_row(ctx, row);
+	if (!rr)
+		return -1;
+
+	c = find_col(ctx->cols, ctx->ncols, col);
+	if (!c)
+		return -1;
+
+	k = rr - ctx->rows - c->row0;
+	if (k < 0 || k >= c->nrows || c->null[k / 8] & 1 << k % 8)
+		return -1;
+
+	*pcol = c;
+
+	return k;
+}
+
+/* Dictionary code of the display text, 0 if there is none */
+static int cell_code(struct sheet_ctx *ctx, struct column *c, int k)
+{
+	const char *s;
+	char *mark;
+	int code;
+
+	if (c->code[k])
+		return c->code[k];
+
+	mark = arena_mark(&ctx->arena);
+
+	if (c->str) {
+		if (!c->str[k] || c->str[k] >= ctx->heap_sz)
+			return 0;
+		s = ctx->heap + c->str[k];
+	} else {
+		if (!c->src[k])
+			return 0;
+		s = make_text(&ctx->arena, c->src[k]);
+		if (!s)
+			return -1;
+	}
+
+	code = dict_add(&ctx->dict, s);
+
+	/* Text made of parts is already there, or no memory for its code */
+	if (dict_str(&ctx->dict, code) != s)
+		arena_rewind(&ctx->arena, mark);
+
+	if (!code)
+		return -1;
+
+	c->code[k] = code;
+
+	return code;
+}
+
+/* Make display text of all cells. -1 if out of memory */
+int cell_texts(struct sheet_ctx *ctx)
+{
+	struct column *c;
+	int i, k;
+
+	for (i = 0, c = ctx->cols; i < ctx->ncols; i++, c++) {
+		for (k = 0; k < c->nrows; k++) {
+			if (!(c->null[k / 8] & 1 << k % 8)
+			    && cell_code(ctx, c, k) < 0)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+const char *ods_sheet_val(void *sheet_ctx, int row, int col,
+			  struct ebuf *ebuf)
+{
+	struct sheet_ctx *ctx = (struct sheet_ctx *)sheet_ctx;
+
+	return dict_str(&ctx->dict, ods_sheet_code(ctx, row, col, ebuf));
+}
+
+int ods_sheet_code(void *sheet_ctx, int row, int col, struct ebuf *ebuf)
+{
+	struct sheet_ctx *ctx = (struct sheet_ctx *)sheet_ctx;
+	struct column *c;
+	int k, code;
+
+	k = find_cell(ctx, row, col, &c);
+	if (k < 0)
+		return 0;
+
+	code = cell_code(ctx, c, k);
+	if (code < 0)
+		ebuf_add(ebuf, "ods: no memory for display text\n");
+
+	return code;
+}
+
+const char *ods_sheet_code_val(void *sheet_ctx, int code)
+{
+	struct sheet_ctx *ctx = (struct sheet_ctx *)sheet_ctx;
+
+	return dict_str(&ctx->dict, code);
+}
+
+int ods_sheet_ncodes(void *sheet_ctx)
+{
+	struct sheet_ctx *ctx = (struct sheet_ctx *)sheet_ctx;
+
+	return dict_size(&ctx->dict);
+}
+
+int ods_sheet_type(void *sheet_ctx, int row, int col)
+{
+	struct column *c;
+	int k;
+
+	k = find_cell((struct sheet_ctx *)sheet_ctx, row, col, &c);
+
+	return k < 0 ? ODS_TYPE_NONE : c->type[k];
+}
+
+void ods_sheet_dims(void *sheet_ctx, int *nrows, int *ncols)
+{
+	struct sheet_ctx *ctx = (struct sheet_ctx *)sheet_ctx;
+	struct row_run *rr;
+	struct column *c;
+
+	/* Row runs and columns are only made for non-empty cells */
+	rr = ctx->nrows ? &ctx->rows[ctx->nrows - 1] : NULL;
+	c = ctx->ncols ? &ctx->cols[ctx->ncols - 1] : NULL;
+
+	*nrows = rr ? rr->row + rr->n : 0;
+	*ncols = c ? c->col + c->n : 0;
+}
+
+int ods_sheet_num(void *sheet_ctx, int row, int col, double *v)
+{
+	struct column *c;
+	int k;
+
+	k = find_cell((struct sheet_ctx *)sheet_ctx, row, col, &c);
+	if (k < 0 || c->type[k] == ODS_TYPE_STRING)
+		return -1;
+
+	*v = c->num[k];
+
+	return 0;
+}
+
+/* Index of the first row run in [l, r) ending after @row */
+int first_row_run(struct sheet_ctx *ctx, int l, int r, int row)
+{
+	int m;
+
+	while (l < r) {
+		m = (l + r) / 2;
+		if (ctx->rows[m].row + ctx->rows[m].n <= row)
+			l = m + 1;
+		else
+			r = m;
+	}
+
+	return l;
+}
+
+int ods_sheet_col(void *sheet_ctx, int col, int row, int n, double *num,
+		  unsigned char *type)
+{
+	struct sheet_ctx *ctx = (struct sheet_ctx *)sheet_ctx;
+	struct row_run *rr, *end;
+	struct column *c;
+	int k, i, j;
+
+	if (col < 0 || col >= ODS_MAX_COLS || row < 0 || n < 0
+	    || n > ODS_MAX_ROWS - row)
+		return -1;
+
+	memset(num, 0, n * sizeof(*num));
+	memset(type, ODS_TYPE_NONE, n);
+
+	c = find_col(ctx->cols, ctx->ncols, col);
+	if (!c)
+		return 0;
+
+	end = ctx->rows + c->row0 + c->nrows;
+	rr = ctx->rows + first_row_run(ctx, c->row0, c->row0 + c->nrows, row);
+	for (; rr < end && rr->row < row + n; rr++) {
+		k = rr - ctx->rows - c->row0;
+		if (c->null[k / 8] & 1 << k % 8)
+			continue;
+
+		i = rr->row > row ? rr->row - row : 0;
+		j = rr->row + rr->n - row;
+		if (j > n)
+			j = n;
+		for (; i < j; i++) {
+			num[i] = c->num[k];
+			type[i] = c->type[k];
+		}
+	}
+
+	return 0;
+}
+
+/* Index of the first column ending after @col */
+int first_col(struct sheet_ctx *ctx, int col)
+{
+	int l = 0, r = ctx->ncols, m;
+
+	while (l < r) {
+		m = (l + r) / 2;
+		if (ctx->cols[m].col + ctx->cols[m].n <= col)
+			l = m + 1;
+		else
+			r = m;
+	}
+
+	return l;
+}
+
+/*
+ * Fill cells [col1, col1 + n) of row run @r (-1: empty row). Columns are
+ * walked from @c0 -- the first one ending after @col1. Any of the outputs
+ * may be NULL. Returns -1 if there was no memory for display text of a
+ * cell: it is left empty.
+ */
+int fill_span(struct sheet_ctx *ctx, int r, int c0, int col1, int n,
+	      const char **vals, int *code, double *num, unsigned char *type)
+{
+	struct column *c, *end = ctx->cols + ctx->ncols;
+	const char *s = NULL;
+	int i, j, k, t = 0, err = 0;
+
+	if (vals)
+		memset(vals, 0, n * sizeof(*vals));
+	if (code)
+		memset(code, 0, n * sizeof(*code));
+	if (num)
+		memset(num, 0, n * sizeof(*num));
+	if (type)
+		memset(type, ODS_TYPE_NONE, n);
+
+	if (r < 0)
+		return 0;
+
+	for (c = ctx->cols + c0; c < end && c->col < col1 + n; c++) {
+		k = r - c->row0;
+		if (k < 0 || k >= c->nrows || c->null[k / 8] & 1 << k % 8)
+			continue;
+
+		i = c->col > col1 ? c->col - col1 : 0;
+		j = c->col + c->n - col1;
+		if (j > n)
+			j = n;
+
+		if (vals || code) {
+			t = cell_code(ctx, c, k);
+			if (t < 0) {
+				err = -1;
+				t = 0;
+			}
+			s = dict_str(&ctx->dict, t);
+		}
+
+		for (; i < j; i++) {
+			if (vals)
+				vals[i] = s;
+			if (code)
+				code[i] = t;
+			if (num)
+				num[i] = c->num[k];
+			if (type)
+				type[i] = c->type[k];
+		}
+	}
+
+	return err;
+}
+
+int check_area(int row1, int col1, int row2, int col2)
+{
+	return row1 < 0 || row1 > row2 || row2 >= ODS_MAX_ROWS
+		|| col1 < 0 || col1 > col2 || col2 >= ODS_MAX_COLS ? -1 : 0;
+}
+
+/* Row run of @row, -1 if none. @r is the current position, it only grows */
+static int row_run_of(struct sheet_ctx *ctx, int *r, int row)
+{
+	while (*r < ctx->nrows && ctx->rows[*r].row + ctx->rows[*r].n <= row)
+		(*r)++;
+
+	return *r < ctx->nrows && ctx->rows[*r].row <= row ? *r : -1;
+}
+
+int ods_sheet_rows(void *sheet_ctx, int row1, int col1, int row2, int col2,
+		   int (*fn)(void *priv, int row, const char **vals, int n),
+		   void *priv, struct ebuf *ebuf)
+{
+	struct sheet_ctx *ctx = (struct sheet_ctx *)sheet_ctx;
+	const char **span;
+	int n, row, r, k, cur = -2, c0, ret = 0;
+
+	if (check_area(row1, col1, row2, col2)) {
+		ebuf_add(ebuf, "ods: invalid cell area\n");
+		return -1;
+	}
+
+	n = col2 - col1 + 1;
+	span = malloc(n * sizeof(*span));
+	if (!span) {
+		ebuf_add(ebuf, "ods: no memory\n");
+		return -1;
+	}
+
+	c0 = first_col(ctx, col1);
+	r = first_row_run(ctx, 0, ctx->nrows, row1);
+
+	for (row = row1; row <= row2 && !ret; row++) {
+		/* Repeated rows share the span */
+		k = row_run_of(ctx, &r, row);
+		if (k != cur) {
+			if (fill_span(ctx, k, c0, col1, n, span, NULL, NULL,
+				      NULL)) {
+				ebuf_add(ebuf, "ods: no memory for display text\n");
+				ret = -1;
+				break;
+			}
+			cur = k;
+		}
+
+		ret = fn(priv, row, span, n);
+	}
+
+	free(span);
+
+	return ret;
+}
+
+/* Values, their codes and/or typed values of the area */
+static int read_area(struct sheet_ctx *ctx, int row1, int col1, int row2,
+		     int col2, int order, const char **vals, int *code,
+		     double *num, unsigned char *type, struct ebuf *ebuf)
+{
+	const char **sv = NULL;
+	int *sc = NULL;
+	double *sn = NULL;
+	unsigned char *st = NULL;
+	int nrows, n, row, r, k, i, j, cur = -2, c0, err = 0;
+
+	if (check_area(row1, col1, row2, col2)) {
+		ebuf_add(ebuf, "ods: invalid cell area\n");
+		return -1;
+	}
+
+	nrows = row2 - row1 + 1;
+	n = col2 - col1 + 1;
+	c0 = first_col(ctx, col1);
+	r = first_row_run(ctx, 0, ctx->nrows, row1);
+
+	if (order == ODS_COL_MAJOR) {
+		/* Row is made in a span, then scattered */
+		sv = vals ? malloc(n * sizeof(*sv)) : NULL;
+		sc = code ? malloc(n * sizeof(*sc)) : NULL;
+		sn = num ? malloc(n * sizeof(*sn)) : NULL;
+		st = type ? malloc(n) : NULL;
+		if ((vals && !sv) || (code && !sc) || (num && !sn)
+		    || (type && !st)) {
+			free(sv);
+			free(sc);
+			free(sn);
+			free(st);
+			ebuf_add(ebuf, "ods: no memory\n");
+			return -1;
+		}
+	}
+
+	for (row = row1, i = 0; row <= row2 && !err; row++, i++) {
+		k = row_run_of(ctx, &r, row);
+
+		if (order != ODS_COL_MAJOR) {
+			if (k == cur) {
+				/* Repeated row: copy the previous one */
+				if (vals)
+					memcpy(vals + i * n, vals + (i - 1) * n,
+					       n * sizeof(*vals));
+				if (code)
+					memcpy(code + i * n, code + (i - 1) * n,
+					       n * sizeof(*code));
+				if (num)
+					memcpy(num + i * n, num + (i - 1) * n,
+					       n * sizeof(*num));
+				if (type)
+					memcpy(type + i * n, type + (i - 1) * n,
+					       n);
+			} else {
+				err = fill_span(ctx, k, c0, col1, n,
+						vals ? vals + i * n : NULL,
+						code ? code + i * n : NULL,
+						num ? num + i * n : NULL,
+						type ? type + i * n : NULL);
+			}
+			cur = k;
+			continue;
+		}
+
+		if (k != cur) {
+			err = fill_span(ctx, k, c0, col1, n, sv, sc, sn, st);
+			cur = k;
+		}
+
+		for (j = 0; j < n; j++) {
+			if (vals)
+				vals[j * nrows + i] = sv[j];
+			if (code)
+				code[j * nrows + i] = sc[j];
+			if (num)
+				num[j * nrows + i] = sn[j];
+			if (type)
+				type[j * nrows + i] = st[j];
+		}
+	}
+
+	free(sv);
+	free(sc);
+	free(sn);
+	free(st);
+
+	if (err)
+		ebuf_add(ebuf, "ods: no memory for display text\n");
+
+	return err;
+}
+
+int ods_sheet_vals(void *sheet_ctx, int row1, int col1, int row2, int col2,
+		   int order, const char **vals, struct ebuf *ebuf)
+{
+	return read_area((struct sheet_ctx *)sheet_ctx, row1, col1, row2, col2,
+			 order, vals, NULL, NULL, NULL, ebuf);
+}
+
+int ods_sheet_codes(void *sheet_ctx, int row1, int col1, int row2, int col2,
+		    int order, int *code, struct ebuf *ebuf)
+{
+	return read_area((struct sheet_ctx *)sheet_ctx, row1, col1, row2, col2,
+			 order, NULL, code, NULL, NULL, ebuf);
+}
+
+int ods_sheet_nums(void *sheet_ctx, int row1, int col1, int row2, int col2,
+		   int order, double *num, unsigned char *type,
+		   struct ebuf *ebuf)
+{
+	return read_area((struct sheet_ctx *)sheet_ctx, row1, col1, row2, col2,
+			 order, NULL, NULL, num, type, ebuf);
+}
+
+void ods_print_sheet_names(void *_ctx)
+{
+	struct ctx *ctx = (struct ctx *)_ctx;
+	int i, n;
+
+	n = ctx->snap ? snap_nsheets(ctx->snap) : ctx->nnames;
+	for (i = 0; i < n; i++)
+		printf("%s\n", ods_sheet_name(ctx, i));
+}
+
+void ods_stats_enable(int on)
+{
+	stats_enable(on);
+}
+
+void ods_get_stats(struct ods_stats *st)
+{
+	stats_get(st);
+}
+
+void ods_reset_stats(void)
+{
+	stats_reset();
+}
+
+const char *ods_sheet_name(void *_ctx, int i)
+{
+	struct ctx *ctx = (struct ctx *)_ctx;
+
+	if (ctx->snap)
+		return i >= 0 && i < snap_nsheets(ctx->snap) ?
+			snap_sheet_name(ctx->snap, i) : NULL;
+
+	return i >= 0 && i < ctx->nnames ? ctx->names[i] : NULL;
+}
+
+int ods_write_sheet(void *_ctx, const char *name, FILE *fp, int flags,
+		    struct ebuf *ebuf)
+{
+	struct ctx *ctx = (struct ctx *)_ctx;
+	struct xml_elem *sheet;
+
+	if (!ctx->spreadsheet) {
+		ebuf_add(ebuf, "No XML of sheet \"%s\" in snapshot\n", name);
+		return -1;
+	}
+
+	sheet = xml_get_child_with_attr_atom(ctx->spreadsheet,
+					     ATOM_TABLE_TABLE, ATOM_TABLE_NAME,
+					     name);
+	if (!sheet) {
+		ebuf_add(ebuf, "Failed to get sheet \"%s\"\n", name);
+		return -1;
+	}
+
+	if (!is_loaded(ctx, name)) {
+		ebuf_add(ebuf, "Sheet \"%s\" was not loaded\n", name);
+		return -1;
+	}
+
+	if (xml_print_ex(sheet, fp, flags & ODS_PRINT_COMPACT ?
+			 XML_PRINT_COMPACT : 0)) {
+		ebuf_add(ebuf, "Failed to write sheet \"%s\"\n", name);
+		return -1;
+	}
+
+	return 0;
+}
+
+int ods_print_sheet(void *ctx, const char *name)
+{
+	struct ebuf ebuf;
+	char ebuf_buf[256];
+
+	ebuf_init(&ebuf, ebuf_buf, sizeof(ebuf_buf));
+
+	if (ods_write_sheet(ctx, name, stdout, 0, &ebuf)) {
+		fprintf(stderr, "%s", ebuf_s(&ebuf));
+		return -1;
+	}
+
+	return 0;
+}
+
+size_t ods_mem_size(void *_ctx)
+{
+	struct ctx *ctx = (struct ctx *)_ctx;
+	size_t n = sizeof(*ctx) + ctx->content_sz;
+	int i;
+
+	if (ctx->root)
+		n += xml_mem_size(ctx->root);
+
+	for (i = 0; i < ctx->nfrags; i++)
+		n += xml_mem_size(ctx->frags[i]);
+
+	return n;
+}
+
+size_t ods_sheet_mem_size(void *sheet_ctx)
+{
+	struct sheet_ctx *ctx = (struct sheet_ctx *)sheet_ctx;
+
+	/* Display text made of parts is in the arena */
+	return sizeof(*ctx) + ctx->arena.size
+		+ ctx->rows_sz * sizeof(*ctx->rows)
+		+ ctx->ncols * sizeof(*ctx->cols)
+		+ dict_mem_size(&ctx->dict);
+}
+
+/* Cell name like "B7" or "AMJ1048576": column letters then row number */
+static int parse_cell_name(const char *s, int *row, int *col)
+{
+	const char *p = s;
+	long r;
+
+	for (*col = 0; *p >= 'A' && *p <= 'Z'; p++) {
+		*col = *col * 26 + *p - 'A' + 1;
+		if (*col > ODS_MAX_COLS)
+			return -1;
+	}
+
+	if (p == s || *p < '1' || *p > '9')
+		return -1;
+
+	for (r = 0; *p >= '0' && *p <= '9'; p++) {
+		r = r * 10 + *p - '0';
+		if (r > ODS_MAX_ROWS)
+			return -1;
+	}
+
+	(*col)--;
+	*row = r - 1;
+
+	return p - s;
+}
+
+int ods_parse_area(const char *s, int *row1, int *col1, int *row2,
+		   int *col2)
+{
+	int n;
+
+	n = parse_cell_name(s, row1, col1);
+	if (n < 0)
+		return -1;
+
+	if (!s[n]) {
+		*row2 = *row1;
+		*col2 = *col1;
+		return 0;
+	}
+
+	if (s[n] != ':')
+		return -1;
+
+	s += n + 1;
+
+	n = parse_cell_name(s, row2, col2);
+	if (n < 0 || s[n])
+		return -1;
 
 	return 0;
 }
@@ -1,21 +1,166 @@
 #ifndef _ODS_H
 #define _ODS_H
 
+#include <stdio.h>
+
 #include "ebuf.h"
+#include "stats.h"
+
+/* Sheet size limits (as in LibreOffice): rows 1..1048576, cols A..XFD */
+#define ODS_MAX_ROWS 1048576
+#define ODS_MAX_COLS 16384
 
 void *ods_open(const char *fname, struct ebuf *ebuf);
 
+/* Open options. Zeroed fields mean defaults */
+struct ods_opts {
+	/*
+	 * Load only these sheets (NULL-terminated list of names), others
+	 * are skipped while parsing. All sheets are still listed.
+	 */
+	const char * const *sheets;
+	/* Parse sheets on this many threads. 0, 1: on the caller's one */
+	int threads;
+	/* Inflate on another thread while parsing (if threads <= 1) */
+	int pipeline;
+	/*
+	 * Keep parsed sheets in a snapshot next to the file (or in
+	 * @cache_dir) and use it while the file is not changed. All sheets
+	 * are loaded to make the snapshot, @sheets is ignored. Opened from
+	 * a snapshot there is no XML: ods_print_sheet() fails.
+	 */
+	int cache;
+	const char *cache_dir;
+	/*
+	 * Load only cells of the area (0-based, inclusive) of the loaded
+	 * sheets. Rows below the area are not parsed: once the last loaded
+	 * sheet is passed the rest of the file is not even inflated, sheets
+	 * after it are not listed. Ignored with @cache and @threads > 1.
+	 */
+	int area;
+	int row1, col1, row2, col2;
+};
+
+void *ods_open_ex(const char *fname, const struct ods_opts *opts,
+		  struct ebuf *ebuf);
+
 void ods_close(void *ctx);
 
 void *ods_open_sheet(void *ctx, const char *name, struct ebuf *ebuf);
 
 void ods_close_sheet(void *sheet_ctx);
 
-const char *ods_sheet_val(void *ctx, int row, int col);
+/*
+ * Display text is made as cells are first read, reading may fail for
+ * lack of memory: then the error goes to @ebuf.
+ */
+
+/* Display text of the cell, NULL if it is empty or on error */
+const char *ods_sheet_val(void *ctx, int row, int col, struct ebuf *ebuf);
+
+/*
+ * Display text is dictionary-encoded: within a sheet equal texts have
+ * equal codes, so cells may be grouped and compared by code. Codes are
+ * dense and are given as texts are first read: [1, ods_sheet_ncodes()).
+ * 0 is for an empty cell, -1 is returned on error.
+ */
+int ods_sheet_code(void *ctx, int row, int col, struct ebuf *ebuf);
+
+/* Display text of the code, NULL for 0 */
+const char *ods_sheet_code_val(void *ctx, int code);
+
+int ods_sheet_ncodes(void *ctx);
+
+/* Cell types */
+enum {
+	ODS_TYPE_NONE,       /* Empty cell */
+	ODS_TYPE_FLOAT,
+	ODS_TYPE_PERCENTAGE, /* 0.25 for 25% */
+	ODS_TYPE_CURRENCY,
+	ODS_TYPE_DATE,       /* Unix time, seconds */
+	ODS_TYPE_TIME,       /* Duration, seconds */
+	ODS_TYPE_BOOLEAN,    /* 0 or 1 */
+	ODS_TYPE_STRING,     /* Only display text */
+};
+
+int ods_sheet_type(void *ctx, int row, int col);
+
+/* Used area: rows and cols up to the last non-empty cell */
+void ods_sheet_dims(void *ctx, int *nrows, int *ncols);
+
+/* Native value of a non-string cell. Returns -1 for empty/string cell */
+int ods_sheet_num(void *ctx, int row, int col, double *v);
+
+/*
+ * Column slice: values and types of rows [row, row + n) of column @col.
+ * Empty and string cells get 0.
+ */
+int ods_sheet_col(void *ctx, int col, int row, int n, double *num,
+		  unsigned char *type);
+
+/*
+ * Area [row1, row2] x [col1, col2] in bulk. Arrays are filled in row-major
+ * or column-major order. Display text of empty cells is NULL, typed values
+ * are as for ods_sheet_col(). Return -1 on bad area or no memory.
+ */
+enum {
+	ODS_ROW_MAJOR,
+	ODS_COL_MAJOR,
+};
+
+int ods_sheet_vals(void *ctx, int row1, int col1, int row2, int col2,
+		   int order, const char **vals, struct ebuf *ebuf);
+
+int ods_sheet_codes(void *ctx, int row1, int col1, int row2, int col2,
+		    int order, int *code, struct ebuf *ebuf);
+
+int ods_sheet_nums(void *ctx, int row1, int col1, int row2, int col2,
+		   int order, double *num, unsigned char *type,
+		   struct ebuf *ebuf);
+
+/*
+ * Row visitor: @fn gets display text of the row cells [col1, col2] as one
+ * array, valid during the call. Non-zero from @fn stops and is returned.
+ */
+int ods_sheet_rows(void *ctx, int row1, int col1, int row2, int col2,
+		   int (*fn)(void *priv, int row, const char **vals, int n),
+		   void *priv, struct ebuf *ebuf);
+
+/* Name of the i-th sheet, NULL if there are fewer sheets */
+const char *ods_sheet_name(void *ctx, int i);
 
 void ods_print_sheet_names(void *ctx);
 
 int ods_print_sheet(void *ctx, const char *name);
 
+/* ods_write_sheet() flags */
+#define ODS_PRINT_COMPACT 1 /* No indentation and line breaks */
+
+/* XML of the sheet */
+int ods_write_sheet(void *ctx, const char *name, FILE *fp, int flags,
+		    struct ebuf *ebuf);
+
+/*
+ * Performance counters of all workbooks (struct ods_stats is in stats.h).
+ * They are off until enabled and cost nothing then.
+ */
+void ods_stats_enable(int on);
+
+void ods_get_stats(struct ods_stats *st);
+
+void ods_reset_stats(void);
+
+/* Heap memory held by the spreadsheet and by an opened sheet */
+size_t ods_mem_size(void *ctx);
+
+size_t ods_sheet_mem_size(void *sheet_ctx);
+
+/*
+ * Area "B7" or "B1:H99" (columns up to XFD, rows up to 1048576) into
+ * zero-based indexes. Returns -1 if it is malformed.
+ */
+int ods_parse_area(const char *s, int *row1, int *col1, int *row2,
+		   int *col2);
+
 #endif
 
@@ -0,0 +1,106 @@
+#ifndef _ODS_INT_H
+#define _ODS_INT_H
+
+/* Spreadsheet internals shared by ods.c, snap.c and export.c */
+
+#include <stdint.h>
+
+#include "arena.h"
+#include "dict.h"
+#include "xml.h"
+
+struct ctx {
+	struct xml_elem *root;
+	struct xml_elem *spreadsheet;
+	char **sheets; /* Loaded sheets, NULL-terminated. NULL: all */
+	const char **names; /* Of all sheets in order, from the tree */
+	int nnames;
+	struct xml_elem **frags; /* Sheets parsed apart, own their nodes */
+	int nfrags;
+	char *content; /* content.xml the sheets were parsed from in place */
+	size_t content_sz;
+	void *snap; /* Sheets come from the snapshot, there is no tree */
+	struct area *area; /* Load plan of the area, ods.c */
+};
+
+/*
+ * Sheet is kept sparse and run-length encoded: repeated rows and columns
+ * are never expanded and empty cells are not stored at all.
+ */
+
+/* @n cols starting from @col have the same value. Only while loading */
+struct cell_run {
+	int col;
+	int n;
+	int type;
+	double num;
+	struct xml_elem *text; /* "text:p" or NULL */
+};
+
+/* @n rows starting from @row are the same */
+struct row_run {
+	int row;
+	int n;
+	int cell; /* While loading: cell runs [cell, cell + ncells) */
+	int ncells;
+};
+
+/*
+ * Values are stored by column: physical columns [col, col + n) have the
+ * same values in every row, they are kept once in contiguous arrays
+ * indexed by row run, for row runs [row0, row0 + nrows).
+ */
+struct column {
+	int col;
+	int n;
+	int row0;
+	int nrows;
+	unsigned char *null; /* Bitmap: no value in the row run */
+	unsigned char *type; /* ODS_TYPE_* */
+	double *num;
+	struct xml_elem **src; /* "text:p" of the cell */
+	int *code; /* Display text in the sheet dict, made on the first request */
+	const uint32_t *str; /* Snapshot: display text in the heap, 0: none */
+};
+
+struct sheet_ctx {
+	struct ctx *ctx;
+	const char *name;
+	struct xml_elem *sheet;
+	struct arena arena; /* Columns and display text */
+	struct dict dict; /* Distinct display texts of the cells */
+	struct row_run *rows; /* Sorted by row */
+	int nrows, rows_sz;
+	struct cell_run *cells; /* Sorted by col within a row run */
+	int ncells, cells_sz;
+	struct column *cols; /* Sorted by col */
+	int ncols;
+	const char *heap; /* Snapshot: strings, rows and arrays are mapped */
+	size_t heap_sz;
+};
+
+/* Sheet access, ods.c */
+
+/*
+ * Make display text of all cells: then reading them is thread-safe.
+ * Returns -1 if out of memory.
+ */
+int cell_texts(struct sheet_ctx *ctx);
+
+/* Index of the first row run in [l, r) ending after @row */
+int first_row_run(struct sheet_ctx *ctx, int l, int r, int row);
+
+/* Index of the first column ending after @col */
+int first_col(struct sheet_ctx *ctx, int col);
+
+/*
+ * Cells [col1, col1 + n) of row run @r (-1: empty row), see ods.c.
+ * -1 if out of memory.
+ */
+int fill_span(struct sheet_ctx *ctx, int r, int c0, int col1, int n,
+	      const char **vals, int *code, double *num, unsigned char *type);
+
+/* -1 if the area is out of the sheet limits */
+int check_area(int row1, int col1, int row2, int col2);
+
+#endif
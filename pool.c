@@ -0,0 +1,125 @@
+/*
+ * Thread pool.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+struct pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work; /* New task or stop */
+	pthread_cond_t done; /* All tasks are done */
+	struct pool_task *head, *tail;
+	int busy; /* Tasks queued or running */
+	int stop;
+	int nthreads;
+	pthread_t threads[];
+};
+
+static void *worker(void *arg)
+{
+	struct pool *pool = (struct pool *)arg;
+	struct pool_task *task;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->head && !pool->stop)
+			pthread_cond_wait(&pool->work, &pool->lock);
+
+		if (!pool->head)
+			break;
+
+		task = pool->head;
+		pool->head = task->next;
+		if (!pool->head)
+			pool->tail = NULL;
+		pthread_mutex_unlock(&pool->lock);
+
+		task->fn(task);
+
+		pthread_mutex_lock(&pool->lock);
+		if (!--pool->busy)
+			pthread_cond_broadcast(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+struct pool *pool_new(int nthreads, struct ebuf *ebuf)
+{
+	struct pool *pool;
+	int err;
+
+	pool = calloc(1, sizeof(*pool) + nthreads * sizeof(pthread_t));
+	if (!pool) {
+		ebuf_add(ebuf, "pool: no memory\n");
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (; pool->nthreads < nthreads; pool->nthreads++) {
+		err = pthread_create(&pool->threads[pool->nthreads], NULL,
+				     worker, pool);
+		if (err) {
+			ebuf_add(ebuf, "pool: failed to create thread: %s\n",
+				 strerror(err));
+			pool_free(pool);
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
+void pool_submit(struct pool *pool, struct pool_task *task)
+{
+	task->next = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail)
+		pool->tail->next = task;
+	else
+		pool->head = task;
+	pool->tail = task;
+	pool->busy++;
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_wait(struct pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (pool->busy)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_free(struct pool *pool)
+{
+	int i;
+
+	if (!pool)
+		return;
+
+	pool_wait(pool);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->done);
+	free(pool);
+}
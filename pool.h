@@ -0,0 +1,27 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include "ebuf.h"
+
+/*
+ * Worker threads running tasks from a FIFO queue. Task memory belongs
+ * to the submitter and must live until the task is done.
+ */
+struct pool_task {
+	void (*fn)(struct pool_task *task);
+	struct pool_task *next;
+};
+
+struct pool;
+
+struct pool *pool_new(int nthreads, struct ebuf *ebuf);
+
+void pool_submit(struct pool *pool, struct pool_task *task);
+
+/* Wait until all submitted tasks are done */
+void pool_wait(struct pool *pool);
+
+/* Wait for the tasks and stop the threads */
+void pool_free(struct pool *pool);
+
+#endif
@@ -0,0 +1,169 @@
+/*
+ * Ring of buffers for the two stage pipeline.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "ring.h"
+
+struct ring_buf {
+	char *p;
+	int n;
+};
+
+struct ring {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int nbufs, buf_sz;
+	int head; /* Buffer being filled */
+	int tail; /* Buffer being read */
+	int nfull; /* Filled ones, including being read */
+	int reading; /* Tail buffer is given to the consumer */
+	int closed, aborted;
+	struct ring_buf bufs[];
+};
+
+struct ring *ring_new(int nbufs, int buf_sz, struct ebuf *ebuf)
+{
+	struct ring *ring;
+	int i;
+
+	ring = calloc(1, sizeof(*ring) + nbufs * sizeof(struct ring_buf));
+	if (!ring)
+		goto nomem;
+
+	ring->nbufs = nbufs;
+	ring->buf_sz = buf_sz;
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->cond, NULL);
+
+	for (i = 0; i < nbufs; i++) {
+		ring->bufs[i].p = malloc(buf_sz);
+		if (!ring->bufs[i].p) {
+			ring_free(ring);
+			goto nomem;
+		}
+	}
+
+	return ring;
+
+nomem:
+	ebuf_add(ebuf, "ring: no memory for buffers\n");
+	return NULL;
+}
+
+void ring_free(struct ring *ring)
+{
+	int i;
+
+	if (!ring)
+		return;
+
+	for (i = 0; i < ring->nbufs; i++)
+		free(ring->bufs[i].p);
+
+	pthread_mutex_destroy(&ring->lock);
+	pthread_cond_destroy(&ring->cond);
+	free(ring);
+}
+
+/* Give the head buffer to the consumer and wait for an empty one */
+static int put(struct ring *ring)
+{
+	int r;
+
+	pthread_mutex_lock(&ring->lock);
+
+	ring->head = (ring->head + 1) % ring->nbufs;
+	ring->nfull++;
+	pthread_cond_broadcast(&ring->cond);
+
+	while (ring->nfull == ring->nbufs && !ring->aborted)
+		pthread_cond_wait(&ring->cond, &ring->lock);
+
+	r = ring->aborted ? -1 : 0;
+
+	pthread_mutex_unlock(&ring->lock);
+
+	return r;
+}
+
+int ring_write(struct ring *ring, const char *buf, int n)
+{
+	struct ring_buf *b;
+	int k;
+
+	while (n) {
+		b = &ring->bufs[ring->head];
+		k = ring->buf_sz - b->n;
+		if (k > n)
+			k = n;
+
+		memcpy(b->p + b->n, buf, k);
+		b->n += k;
+		buf += k;
+		n -= k;
+
+		if (b->n == ring->buf_sz && put(ring))
+			return -1;
+	}
+
+	return 0;
+}
+
+void ring_close(struct ring *ring)
+{
+	pthread_mutex_lock(&ring->lock);
+
+	if (ring->bufs[ring->head].n) {
+		ring->head = (ring->head + 1) % ring->nbufs;
+		ring->nfull++;
+	}
+	ring->closed = 1;
+	pthread_cond_broadcast(&ring->cond);
+
+	pthread_mutex_unlock(&ring->lock);
+}
+
+const char *ring_read(struct ring *ring, int *n)
+{
+	struct ring_buf *b;
+
+	pthread_mutex_lock(&ring->lock);
+
+	/* Release the previous one */
+	if (ring->reading) {
+		ring->bufs[ring->tail].n = 0;
+		ring->tail = (ring->tail + 1) % ring->nbufs;
+		ring->nfull--;
+		ring->reading = 0;
+		pthread_cond_broadcast(&ring->cond);
+	}
+
+	while (!ring->nfull && !ring->closed)
+		pthread_cond_wait(&ring->cond, &ring->lock);
+
+	if (!ring->nfull) {
+		pthread_mutex_unlock(&ring->lock);
+		return NULL;
+	}
+
+	b = &ring->bufs[ring->tail];
+	ring->reading = 1;
+
+	pthread_mutex_unlock(&ring->lock);
+
+	*n = b->n;
+
+	return b->p;
+}
+
+void ring_abort(struct ring *ring)
+{
+	pthread_mutex_lock(&ring->lock);
+	ring->aborted = 1;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+}
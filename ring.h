@@ -0,0 +1,32 @@
+#ifndef _RING_H
+#define _RING_H
+
+#include "ebuf.h"
+
+/*
+ * Bounded ring of buffers between a producer and a consumer thread.
+ * Producer blocks while all buffers are full, consumer -- while all are
+ * empty.
+ */
+struct ring;
+
+struct ring *ring_new(int nbufs, int buf_sz, struct ebuf *ebuf);
+
+void ring_free(struct ring *ring);
+
+/* Producer: returns -1 if the consumer has aborted */
+int ring_write(struct ring *ring, const char *buf, int n);
+
+/* Producer: no more data */
+void ring_close(struct ring *ring);
+
+/*
+ * Consumer: next filled buffer, NULL when the producer has closed the
+ * ring. The buffer is valid until the next call.
+ */
+const char *ring_read(struct ring *ring, int *n);
+
+/* Consumer: stop reading, further writes fail */
+void ring_abort(struct ring *ring);
+
+#endif
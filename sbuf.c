@@ -2,7 +2,6 @@
  * String buffer
  */
 
-#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
@@ -12,39 +11,76 @@ void sbuf_init(struct sbuf *sbuf, char *buf, int buf_sz)
 {
 	sbuf->buf = sbuf->tail = buf;
 	sbuf->buf_sz = buf_sz;
+	sbuf->max_sz = 0;
 }
 
-int sbuf_add(struct sbuf *sbuf, int c)
+int sbuf_init_heap(struct sbuf *sbuf, int buf_sz, int max_sz)
 {
-	if (sbuf->tail - sbuf->buf >= sbuf->buf_sz)
+	sbuf->buf = sbuf->tail = malloc(buf_sz + 1);
+	if (!sbuf->buf)
 		return -1;
 
-	*(sbuf->tail)++ = c;
+	sbuf->buf_sz = buf_sz;
+	sbuf->max_sz = max_sz;
+
+	return 0;
+}
+
+void sbuf_free(struct sbuf *sbuf)
+{
+	if (sbuf->max_sz)
+		free(sbuf->buf);
+	sbuf->buf = sbuf->tail = NULL;
+	sbuf->buf_sz = sbuf->max_sz = 0;
+}
+
+/* Room for @n more chars */
+static int grow(struct sbuf *sbuf, int n)
+{
+	int len = sbuf->tail - sbuf->buf, sz = sbuf->buf_sz;
+	char *p;
+
+	if (!sbuf->max_sz || n > sbuf->max_sz - len)
+		return -1;
+
+	while (sz < len + n)
+		sz = sz < sbuf->max_sz / 2 ? sz * 2 : sbuf->max_sz;
+
+	p = realloc(sbuf->buf, sz + 1);
+	if (!p)
+		return -1;
+
+	sbuf->buf = p;
+	sbuf->tail = p + len;
+	sbuf->buf_sz = sz;
 
 	return 0;
 }
 
-char *sbuf_dup(struct sbuf *sbuf)
+int sbuf_add(struct sbuf *sbuf, int c)
 {
-	char *s;
-	int n = sbuf->tail - sbuf->buf;
+	if (sbuf->tail - sbuf->buf >= sbuf->buf_sz && grow(sbuf, 1))
+		return -1;
+
+	*(sbuf->tail)++ = c;
 
-	s = malloc(n + 1);
-	if (!s) {
-		fprintf(stderr, "%s: No memory!\n", __func__);
-		return NULL;
-	}
+	return 0;
+}
 
-	memcpy(s, sbuf->buf, n);
-	*(s + n) = '\0';
+/*
+ * Add @n chars at once. @s may overlap the buffer (buffer may be set over
+ * the string being parsed), then nothing to copy if it is already there.
+ */
+int sbuf_addn(struct sbuf *sbuf, const char *s, int n)
+{
+	if (sbuf->tail - sbuf->buf + n > sbuf->buf_sz && grow(sbuf, n))
+		return -1;
 
-	/*
-	 * WARNING: Automatically trash, since it is
-	 * the very usual case.
-	 */
-	sbuf_trash(sbuf);
+	if (sbuf->tail != s)
+		memmove(sbuf->tail, s, n);
+	sbuf->tail += n;
 
-	return s;
+	return 0;
 }
 
 void sbuf_trash(struct sbuf *sbuf)
@@ -1,18 +1,30 @@
 #ifndef _SBUF_H
 #define _SBUF_H
 
-/* String buffer */
+/*
+ * String buffer: over the caller's memory of a fixed size or on the
+ * heap, growing up to a limit. There is always room for a null after
+ * the content.
+ */
 struct sbuf {
 	char *buf;
 	char *tail;
 	int buf_sz;
+	int max_sz; /* Heap buffer grows up to it, 0: caller's buffer */
 };
 
+/* Caller's buffer: @buf_sz chars, plus one for null */
 void sbuf_init(struct sbuf *sbuf, char *buf, int buf_sz);
 
+int sbuf_init_heap(struct sbuf *sbuf, int buf_sz, int max_sz);
+
+/* Free the heap buffer. The sbuf is left empty */
+void sbuf_free(struct sbuf *sbuf);
+
+/* -1 if the buffer is full or no memory */
 int sbuf_add(struct sbuf *sbuf, int c);
 
-char *sbuf_dup(struct sbuf *sbuf);
+int sbuf_addn(struct sbuf *sbuf, const char *s, int n);
 
 void sbuf_trash(struct sbuf *sbuf);
 
@@ -0,0 +1,150 @@
+/*
+ * Vectorized scanning for the XML tokenizer. AVX2 or SSE2 code is
+ * selected at compile time (e.g. CFLAGS=-mavx2), otherwise a plain
+ * byte loop is used. Newlines are counted by popcount over the mask of
+ * the scanned block, so line/column tracking stays exact.
+ */
+
+#include <stddef.h>
+
+#include "scan.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define VEC_SZ 32
+typedef __m256i vec;
+#define vec_load(p)     _mm256_loadu_si256((const __m256i *)(p))
+#define vec_set1(c)     _mm256_set1_epi8(c)
+#define vec_eq(a, b)    _mm256_cmpeq_epi8(a, b)
+#define vec_or(a, b)    _mm256_or_si256(a, b)
+#define vec_mask(a)     ((unsigned)_mm256_movemask_epi8(a))
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define VEC_SZ 16
+typedef __m128i vec;
+#define vec_load(p)     _mm_loadu_si128((const __m128i *)(p))
+#define vec_set1(c)     _mm_set1_epi8(c)
+#define vec_eq(a, b)    _mm_cmpeq_epi8(a, b)
+#define vec_or(a, b)    _mm_or_si128(a, b)
+#define vec_mask(a)     ((unsigned)_mm_movemask_epi8(a))
+#endif
+
+#ifdef VEC_SZ
+
+#define VEC_MASK_ALL ((unsigned)((1ull << VEC_SZ) - 1))
+
+/* Account newlines from the mask in the first @n bytes of block @p */
+static void count_nl(unsigned mask, int n, const char *p, struct scan_nl *nl)
+{
+	if (n < VEC_SZ)
+		mask &= (1u << n) - 1;
+
+	if (!mask)
+		return;
+
+	nl->n += __builtin_popcount(mask);
+	nl->last = p + 31 - __builtin_clz(mask);
+}
+
+#endif
+
+static const char *scan_delim_tail(const char *p, const char *end,
+				   int a, int b, struct scan_nl *nl)
+{
+	for (; p < end; p++) {
+		if (*p == a || *p == b)
+			break;
+
+		if (*p == '\n') {
+			nl->n++;
+			nl->last = p;
+		}
+	}
+
+	return p;
+}
+
+const char *scan_delim(const char *p, const char *end, int a, int b,
+		       struct scan_nl *nl)
+{
+#ifdef VEC_SZ
+	vec va = vec_set1(a), vb = vec_set1(b), vn = vec_set1('\n'), v;
+	unsigned m;
+	int i;
+#endif
+
+	nl->n = 0;
+	nl->last = NULL;
+
+#ifdef VEC_SZ
+	for (; end - p >= VEC_SZ; p += VEC_SZ) {
+		v = vec_load(p);
+		m = vec_mask(vec_or(vec_eq(v, va), vec_eq(v, vb)));
+		if (m) {
+			i = __builtin_ctz(m);
+			count_nl(vec_mask(vec_eq(v, vn)), i, p, nl);
+			return p + i;
+		}
+
+		count_nl(vec_mask(vec_eq(v, vn)), VEC_SZ, p, nl);
+	}
+#endif
+
+	return scan_delim_tail(p, end, a, b, nl);
+}
+
+const char *scan_space(const char *p, const char *end, struct scan_nl *nl)
+{
+#ifdef VEC_SZ
+	vec vs = vec_set1(' '), vt = vec_set1('\t'), vn = vec_set1('\n'), v;
+	unsigned m, mn;
+	int i;
+#endif
+
+	nl->n = 0;
+	nl->last = NULL;
+
+#ifdef VEC_SZ
+	for (; end - p >= VEC_SZ; p += VEC_SZ) {
+		v = vec_load(p);
+		mn = vec_mask(vec_eq(v, vn));
+		m = ~(vec_mask(vec_or(vec_eq(v, vs), vec_eq(v, vt))) | mn)
+			& VEC_MASK_ALL;
+		if (m) {
+			i = __builtin_ctz(m);
+			count_nl(mn, i, p, nl);
+			return p + i;
+		}
+
+		count_nl(mn, VEC_SZ, p, nl);
+	}
+#endif
+
+	for (; p < end; p++) {
+		if (*p == '\n') {
+			nl->n++;
+			nl->last = p;
+		} else if (*p != ' ' && *p != '\t') {
+			break;
+		}
+	}
+
+	return p;
+}
+
+/* Chars allowed in tag/attribute name after the first one */
+static const unsigned char name_char[256] = {
+	['a' ... 'z'] = 1,
+	['A' ... 'Z'] = 1,
+	['0' ... '9'] = 1,
+	['_'] = 1, [':'] = 1, ['.'] = 1, ['-'] = 1,
+};
+
+/* Names are short, so a plain table-driven loop is enough */
+const char *scan_name(const char *p, const char *end)
+{
+	while (p < end && name_char[(unsigned char)*p])
+		p++;
+
+	return p;
+}
@@ -0,0 +1,24 @@
+#ifndef _SCAN_H
+#define _SCAN_H
+
+/*
+ * Bulk scanning of the parser input. Each function returns pointer to
+ * the first interesting char in [p, end) or @end, and reports newlines
+ * it has passed over: their number and position of the last one.
+ */
+struct scan_nl {
+	int n;
+	const char *last;
+};
+
+/* Find the first @a or @b */
+const char *scan_delim(const char *p, const char *end, int a, int b,
+		       struct scan_nl *nl);
+
+/* Skip spaces (' ', '\t', '\n') */
+const char *scan_space(const char *p, const char *end, struct scan_nl *nl);
+
+/* Skip the rest of tag/attribute name. There are no newlines in names */
+const char *scan_name(const char *p, const char *end);
+
+#endif
@@ -0,0 +1,958 @@
+/*
+ * Query server: workbooks stay parsed between requests.
+ *
+ * Requests are served by a thread pool, one request per task. Idle
+ * connections are polled by the accepting thread, so a quiet client
+ * does not hold a worker; a worker hands the connection back after the
+ * response. The cache lock guards the LRU list, memory accounting,
+ * connections and latency counters. Requests on the same workbook are
+ * serialized by its own lock: opened sheets make display text lazily.
+ */
+
+#define _GNU_SOURCE /* ppoll(), accept4() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "ods.h"
+#include "pool.h"
+#include "serve.h"
+
+#define MAX_REQ_SZ (64 * 1024)
+#define MAX_REQ_ARGS 4
+
+/* A client stuck in the middle of a frame is dropped */
+#define IO_TIMEOUT_S 10
+
+#define DEF_THREADS 4
+#define DEF_MEM_CAP (1024UL * 1024 * 1024)
+
+enum {
+	REQ_LIST_SHEETS,
+	REQ_READ_RANGE,
+	REQ_DUMP_SHEET,
+	REQ_STATS,
+	REQ_NR,
+};
+
+static const struct {
+	const char *name;
+	int nargs;
+} reqs[] = {
+	[REQ_LIST_SHEETS] = { "list-sheets", 1 },
+	[REQ_READ_RANGE]  = { "read-range",  3 },
+	[REQ_DUMP_SHEET]  = { "dump-sheet",  2 },
+	[REQ_STATS]       = { "stats",       0 },
+};
+
+/*
+ * Latency histogram, microseconds. Log-linear: exact below 16, then
+ * 8 buckets per power of two (error is under 12.5%).
+ */
+#define LAT_SUB 8
+#define LAT_NBUCKETS (16 + 40 * LAT_SUB)
+
+struct lat_hist {
+	unsigned long count;
+	unsigned long b[LAT_NBUCKETS];
+};
+
+struct sheet_ent {
+	char *name;
+	void *sheet;
+};
+
+struct book {
+	struct book *prev, *next; /* LRU, the most recent first */
+	char *path;
+	struct timespec mtime;
+	off_t size;
+	void *ctx;
+	struct sheet_ent *sheets;
+	int nsheets, sheets_sz;
+	size_t mem;
+	int refs;
+	int stale; /* Out of the cache, freed on the last put */
+	pthread_mutex_t lock;
+};
+
+struct conn {
+	struct pool_task task; /* Must be the first */
+	struct server *srv;
+	int fd;
+	int busy; /* Given to a worker, not polled */
+	struct conn *prev, *next;
+	char req[MAX_REQ_SZ + 1];
+};
+
+struct server {
+	int fd;
+	int wake[2]; /* Workers wake the accepting thread: a conn is idle */
+	struct pool *pool;
+	pthread_mutex_t lock;
+	struct book *head, *tail;
+	int nbooks;
+	size_t mem, mem_cap;
+	struct conn *conns;
+	struct lat_hist lat[REQ_NR];
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static int lat_bucket(unsigned long us)
+{
+	int e, i;
+
+	if (us < 16)
+		return us;
+
+	e = 63 - __builtin_clzl(us); /* >= 4 */
+	i = 16 + (e - 4) * LAT_SUB + (us >> (e - 3) & (LAT_SUB - 1));
+
+	return i < LAT_NBUCKETS ? i : LAT_NBUCKETS - 1;
+}
+
+/* Upper bound of the bucket */
+static unsigned long lat_value(int i)
+{
+	int e;
+
+	if (i < 16)
+		return i;
+
+	e = (i - 16) / LAT_SUB + 4;
+
+	return ((unsigned long)(LAT_SUB + (i - 16) % LAT_SUB + 1) << (e - 3))
+		- 1;
+}
+
+static unsigned long lat_percentile(const struct lat_hist *h, int pct)
+{
+	unsigned long n, want;
+	int i;
+
+	if (!h->count)
+		return 0;
+
+	want = (h->count * pct + 99) / 100;
+	for (i = 0, n = 0; i < LAT_NBUCKETS; i++) {
+		n += h->b[i];
+		if (n >= want)
+			break;
+	}
+
+	return lat_value(i < LAT_NBUCKETS ? i : LAT_NBUCKETS - 1);
+}
+
+static void free_book(struct book *b)
+{
+	int i;
+
+	if (!b)
+		return;
+
+	for (i = 0; i < b->nsheets; i++) {
+		ods_close_sheet(b->sheets[i].sheet);
+		free(b->sheets[i].name);
+	}
+	free(b->sheets);
+	ods_close(b->ctx);
+	pthread_mutex_destroy(&b->lock);
+	free(b->path);
+	free(b);
+}
+
+static void free_books(struct book *b)
+{
+	struct book *next;
+
+	for (; b; b = next) {
+		next = b->next;
+		free_book(b);
+	}
+}
+
+static void lru_unlink(struct server *srv, struct book *b)
+{
+	if (b->prev)
+		b->prev->next = b->next;
+	else
+		srv->head = b->next;
+
+	if (b->next)
+		b->next->prev = b->prev;
+	else
+		srv->tail = b->prev;
+
+	b->prev = b->next = NULL;
+}
+
+static void lru_push(struct server *srv, struct book *b)
+{
+	b->prev = NULL;
+	b->next = srv->head;
+	if (srv->head)
+		srv->head->prev = b;
+	else
+		srv->tail = b;
+	srv->head = b;
+}
+
+/* Out of the cache. Unused book goes to @dead to be freed unlocked */
+static void drop_book(struct server *srv, struct book *b, struct book **dead)
+{
+	lru_unlink(srv, b);
+	srv->nbooks--;
+	srv->mem -= b->mem;
+
+	if (b->refs) {
+		b->stale = 1;
+		return;
+	}
+
+	b->next = *dead;
+	*dead = b;
+}
+
+/* Least recently used books over the memory cap, except @keep */
+static void evict(struct server *srv, struct book *keep, struct book **dead)
+{
+	struct book *b, *prev;
+
+	for (b = srv->tail; b && srv->mem > srv->mem_cap; b = prev) {
+		prev = b->prev;
+		if (b != keep)
+			drop_book(srv, b, dead);
+	}
+}
+
+static struct book *find_book(struct server *srv, const char *path)
+{
+	struct book *b;
+
+	/* There are few of them */
+	for (b = srv->head; b; b = b->next) {
+		if (!strcmp(b->path, path))
+			return b;
+	}
+
+	return NULL;
+}
+
+static int same_file(const struct book *b, const struct stat *st)
+{
+	return b->size == st->st_size
+		&& b->mtime.tv_sec == st->st_mtim.tv_sec
+		&& b->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static struct book *load_book(const char *path, const struct stat *st,
+			      struct ebuf *ebuf)
+{
+	struct book *b;
+
+	b = calloc(sizeof(*b), 1);
+	if (!b) {
+		ebuf_add(ebuf, "serve: no memory for workbook\n");
+		return NULL;
+	}
+
+	pthread_mutex_init(&b->lock, NULL);
+	b->mtime = st->st_mtim;
+	b->size = st->st_size;
+
+	b->path = strdup(path);
+	if (!b->path) {
+		ebuf_add(ebuf, "serve: no memory for workbook\n");
+		free_book(b);
+		return NULL;
+	}
+
+	b->ctx = ods_open(path, ebuf);
+	if (!b->ctx) {
+		free_book(b);
+		return NULL;
+	}
+
+	b->mem = ods_mem_size(b->ctx);
+
+	return b;
+}
+
+/* Cached workbook of the file, parsed if it is not there or has changed */
+static struct book *get_book(struct server *srv, const char *path,
+			     struct ebuf *ebuf)
+{
+	struct book *b, *nb, *dead = NULL;
+	struct stat st;
+
+	if (stat(path, &st)) {
+		ebuf_add(ebuf, "serve: failed to stat \"%s\": %s\n", path,
+			 strerror(errno));
+		return NULL;
+	}
+
+	pthread_mutex_lock(&srv->lock);
+	b = find_book(srv, path);
+	if (b && same_file(b, &st)) {
+		lru_unlink(srv, b);
+		lru_push(srv, b);
+		b->refs++;
+		pthread_mutex_unlock(&srv->lock);
+		return b;
+	}
+	if (b)
+		drop_book(srv, b, &dead);
+	pthread_mutex_unlock(&srv->lock);
+
+	free_books(dead);
+	dead = NULL;
+
+	/* Parsing is long, others are not kept waiting */
+	nb = load_book(path, &st, ebuf);
+	if (!nb)
+		return NULL;
+
+	pthread_mutex_lock(&srv->lock);
+	b = find_book(srv, path);
+	if (b && same_file(b, &st)) {
+		/* Loaded by another client meanwhile */
+		lru_unlink(srv, b);
+		lru_push(srv, b);
+		nb->next = dead;
+		dead = nb;
+	} else {
+		if (b)
+			drop_book(srv, b, &dead);
+		b = nb;
+		lru_push(srv, b);
+		srv->nbooks++;
+		srv->mem += b->mem;
+	}
+	b->refs++;
+	evict(srv, b, &dead);
+	pthread_mutex_unlock(&srv->lock);
+
+	free_books(dead);
+
+	return b;
+}
+
+/* Done with the book, @mem is its current size */
+static void put_book(struct server *srv, struct book *b, size_t mem)
+{
+	struct book *dead = NULL;
+
+	pthread_mutex_lock(&srv->lock);
+	if (!b->stale) {
+		srv->mem += mem - b->mem;
+		evict(srv, b, &dead);
+	}
+	b->mem = mem;
+	if (!--b->refs && b->stale) {
+		b->next = dead;
+		dead = b;
+	}
+	pthread_mutex_unlock(&srv->lock);
+
+	free_books(dead);
+}
+
+static size_t book_mem(struct book *b)
+{
+	size_t n = ods_mem_size(b->ctx);
+	int i;
+
+	for (i = 0; i < b->nsheets; i++)
+		n += ods_sheet_mem_size(b->sheets[i].sheet);
+
+	return n;
+}
+
+/* Opened sheets are kept with the book */
+static void *get_sheet(struct book *b, const char *name, struct ebuf *ebuf)
+{
+	struct sheet_ent *p;
+	void *sheet;
+	int i;
+
+	for (i = 0; i < b->nsheets; i++) {
+		if (!strcmp(b->sheets[i].name, name))
+			return b->sheets[i].sheet;
+	}
+
+	if (b->nsheets == b->sheets_sz) {
+		p = realloc(b->sheets, (b->sheets_sz * 2 + 4) * sizeof(*p));
+		if (!p) {
+			ebuf_add(ebuf, "serve: no memory for sheets\n");
+			return NULL;
+		}
+		b->sheets = p;
+		b->sheets_sz = b->sheets_sz * 2 + 4;
+	}
+
+	sheet = ods_open_sheet(b->ctx, name, ebuf);
+	if (!sheet)
+		return NULL;
+
+	p = &b->sheets[b->nsheets];
+	p->name = strdup(name);
+	if (!p->name) {
+		ebuf_add(ebuf, "serve: no memory for sheets\n");
+		ods_close_sheet(sheet);
+		return NULL;
+	}
+	p->sheet = sheet;
+	b->nsheets++;
+
+	return sheet;
+}
+
+static int print_row(void *priv, int row, const char **vals, int n)
+{
+	FILE *fp = (FILE *)priv;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		fputc('\t', fp);
+		fputs(vals[i] ? vals[i] : "(null)", fp);
+	}
+	fputc('\n', fp);
+
+	return 0;
+}
+
+static int do_book_req(struct book *b, int req, char **args, FILE *fp,
+		       struct ebuf *ebuf)
+{
+	int row1, col1, row2, col2, i;
+	const char *name;
+	void *sheet;
+
+	switch (req) {
+	case REQ_LIST_SHEETS:
+		for (i = 0; (name = ods_sheet_name(b->ctx, i)); i++)
+			fprintf(fp, "%s\n", name);
+		return 0;
+	case REQ_DUMP_SHEET:
+		return ods_write_sheet(b->ctx, args[2], fp, 0, ebuf);
+	case REQ_READ_RANGE:
+		if (ods_parse_area(args[3], &row1, &col1, &row2, &col2)) {
+			ebuf_add(ebuf, "Invalid cell area format\n");
+			return -1;
+		}
+
+		sheet = get_sheet(b, args[2], ebuf);
+		if (!sheet)
+			return -1;
+
+		if (ods_sheet_rows(sheet, row1, col1, row2, col2, print_row,
+				   fp, ebuf))
+			return -1;
+		fputc('\n', fp);
+		return 0;
+	}
+
+	return -1;
+}
+
+static void print_stats(struct server *srv, FILE *fp)
+{
+	const struct lat_hist *h;
+	int i;
+
+	pthread_mutex_lock(&srv->lock);
+	for (i = 0; i < REQ_NR; i++) {
+		h = &srv->lat[i];
+		fprintf(fp, "%s count=%lu p50_us=%lu p99_us=%lu\n",
+			reqs[i].name, h->count, lat_percentile(h, 50),
+			lat_percentile(h, 99));
+	}
+	fprintf(fp, "cache books=%d mem=%zu mem_cap=%zu\n", srv->nbooks,
+		srv->mem, srv->mem_cap);
+	pthread_mutex_unlock(&srv->lock);
+}
+
+/* Split request into lines, returns the request type or -1 */
+static int parse_req(char *s, char **args, struct ebuf *ebuf)
+{
+	int i, n;
+
+	for (n = 0; n < MAX_REQ_ARGS; n++) {
+		args[n] = s;
+		s = strchr(s, '\n');
+		if (!s)
+			break;
+		*s++ = '\0';
+	}
+
+	if (s) {
+		ebuf_add(ebuf, "serve: too many request args\n");
+		return -1;
+	}
+
+	for (i = 0; i < REQ_NR; i++) {
+		if (!strcmp(args[0], reqs[i].name))
+			break;
+	}
+
+	if (i == REQ_NR) {
+		ebuf_add(ebuf, "serve: unknown request \"%s\"\n", args[0]);
+		return -1;
+	}
+
+	if (n != reqs[i].nargs) {
+		ebuf_add(ebuf, "serve: %s needs %d args\n", reqs[i].name,
+			 reqs[i].nargs);
+		return -1;
+	}
+
+	return i;
+}
+
+/* Whole output of the request into @out (free() it) */
+static int do_req(struct server *srv, char *s, char **out, size_t *len,
+		  int *type)
+{
+	struct ebuf ebuf;
+	char ebuf_buf[1024];
+	char *args[MAX_REQ_ARGS];
+	struct book *b;
+	size_t mem;
+	FILE *fp;
+	int err = -1;
+
+	ebuf_init(&ebuf, ebuf_buf, sizeof(ebuf_buf));
+
+	fp = open_memstream(out, len);
+	if (!fp)
+		return -1;
+
+	*type = parse_req(s, args, &ebuf);
+	if (*type == REQ_STATS) {
+		fputs("ok\n", fp);
+		print_stats(srv, fp);
+		err = 0;
+	} else if (*type >= 0) {
+		fputs("ok\n", fp);
+		b = get_book(srv, args[1], &ebuf);
+		if (b) {
+			pthread_mutex_lock(&b->lock);
+			err = do_book_req(b, *type, args, fp, &ebuf);
+			mem = book_mem(b);
+			pthread_mutex_unlock(&b->lock);
+			put_book(srv, b, mem);
+		}
+	}
+
+	if (err) {
+		/* Drop the partial output */
+		fclose(fp);
+		free(*out);
+		fp = open_memstream(out, len);
+		if (!fp)
+			return -1;
+		fprintf(fp, "error\n%s", ebuf_s(&ebuf));
+	}
+
+	if (fclose(fp)) {
+		free(*out);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int read_full(int fd, char *p, size_t n)
+{
+	ssize_t k;
+
+	while (n) {
+		k = read(fd, p, n);
+		if (k < 0 && errno == EINTR)
+			continue;
+		if (k <= 0)
+			return -1;
+		p += k;
+		n -= k;
+	}
+
+	return 0;
+}
+
+static int write_full(int fd, const char *p, size_t n)
+{
+	ssize_t k;
+
+	while (n) {
+		k = send(fd, p, n, MSG_NOSIGNAL);
+		if (k < 0 && errno == EINTR)
+			continue;
+		if (k <= 0)
+			return -1;
+		p += k;
+		n -= k;
+	}
+
+	return 0;
+}
+
+static void put_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static uint32_t get_be32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static unsigned long elapsed_us(const struct timespec *t0)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return (t.tv_sec - t0->tv_sec) * 1000000
+		+ (t.tv_nsec - t0->tv_nsec) / 1000;
+}
+
+/* One request of the connection. -1: the connection is to be dropped */
+static int serve_req(struct conn *c)
+{
+	struct server *srv = c->srv;
+	struct timespec t0;
+	unsigned char hdr[4];
+	char *out;
+	size_t len;
+	uint32_t n;
+	int type, i;
+
+	if (read_full(c->fd, (char *)hdr, sizeof(hdr)))
+		return -1;
+
+	n = get_be32(hdr);
+	if (n > MAX_REQ_SZ || read_full(c->fd, c->req, n))
+		return -1;
+	c->req[n] = '\0';
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	if (do_req(srv, c->req, &out, &len, &type))
+		return -1;
+
+	if (len > UINT32_MAX) {
+		free(out);
+		return -1;
+	}
+
+	put_be32(hdr, len);
+	n = write_full(c->fd, (char *)hdr, sizeof(hdr))
+		|| write_full(c->fd, out, len);
+	free(out);
+	if (n)
+		return -1;
+
+	if (type >= 0) {
+		i = lat_bucket(elapsed_us(&t0));
+		pthread_mutex_lock(&srv->lock);
+		srv->lat[type].count++;
+		srv->lat[type].b[i]++;
+		pthread_mutex_unlock(&srv->lock);
+	}
+
+	return 0;
+}
+
+static void unlink_conn(struct server *srv, struct conn *c)
+{
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		srv->conns = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+}
+
+static void serve_conn(struct pool_task *task)
+{
+	struct conn *c = (struct conn *)task;
+	struct server *srv = c->srv;
+
+	if (!serve_req(c)) {
+		/* Back to the accepting thread till the next request */
+		pthread_mutex_lock(&srv->lock);
+		c->busy = 0;
+		pthread_mutex_unlock(&srv->lock);
+
+		/* A full pipe already has a wakeup in it */
+		while (write(srv->wake[1], "", 1) < 0 && errno == EINTR)
+			;
+		return;
+	}
+
+	pthread_mutex_lock(&srv->lock);
+	unlink_conn(srv, c);
+	pthread_mutex_unlock(&srv->lock);
+
+	close(c->fd);
+	free(c);
+}
+
+static int listen_on(const char *path, struct ebuf *ebuf)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		ebuf_add(ebuf, "serve: too long socket path\n");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	/* Left from a previous run */
+	if (!stat(path, &st) && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		ebuf_add(ebuf, "serve: failed to create socket: %s\n",
+			 strerror(errno));
+		return -1;
+	}
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))
+	    || listen(fd, 64)) {
+		ebuf_add(ebuf, "serve: failed to listen on \"%s\": %s\n", path,
+			 strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void new_conn(struct server *srv)
+{
+	struct timeval tv = { IO_TIMEOUT_S, 0 };
+	struct conn *c;
+	int fd;
+
+	fd = accept4(srv->fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	c = malloc(sizeof(*c));
+	if (!c) {
+		close(fd);
+		return;
+	}
+
+	c->task.fn = serve_conn;
+	c->srv = srv;
+	c->fd = fd;
+	c->busy = 0;
+
+	pthread_mutex_lock(&srv->lock);
+	c->prev = NULL;
+	c->next = srv->conns;
+	if (srv->conns)
+		srv->conns->prev = c;
+	srv->conns = c;
+	pthread_mutex_unlock(&srv->lock);
+}
+
+/*
+ * Poll set: the listening socket, the wakeup pipe and idle connections.
+ * Returns the number of entries.
+ */
+static int poll_set(struct server *srv, struct pollfd **pfds,
+		    struct conn ***conns, int *sz)
+{
+	struct pollfd *p;
+	struct conn **cs, *c;
+	int n = 2;
+
+	pthread_mutex_lock(&srv->lock);
+	for (c = srv->conns; c; c = c->next) {
+		if (c->busy)
+			continue;
+
+		if (n == *sz) {
+			p = realloc(*pfds, (*sz * 2 + 16) * sizeof(*p));
+			if (!p)
+				break;
+			*pfds = p;
+
+			cs = realloc(*conns, (*sz * 2 + 16) * sizeof(*cs));
+			if (!cs)
+				break;
+			*conns = cs;
+
+			*sz = *sz * 2 + 16;
+		}
+
+		(*pfds)[n].fd = c->fd;
+		(*pfds)[n].events = POLLIN;
+		(*conns)[n] = c;
+		n++;
+	}
+	pthread_mutex_unlock(&srv->lock);
+
+	return n;
+}
+
+static void accept_conns(struct server *srv, const sigset_t *mask)
+{
+	struct pollfd *pfds;
+	struct conn **conns;
+	char buf[64];
+	int i, n, sz = 16;
+
+	pfds = malloc(sz * sizeof(*pfds));
+	conns = malloc(sz * sizeof(*conns));
+	if (!pfds || !conns) {
+		free(pfds);
+		free(conns);
+		return;
+	}
+
+	pfds[0].fd = srv->fd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = srv->wake[0];
+	pfds[1].events = POLLIN;
+
+	while (!stop) {
+		n = poll_set(srv, &pfds, &conns, &sz);
+
+		/* Signals get through only while waiting here */
+		if (ppoll(pfds, n, NULL, mask) < 0)
+			continue;
+
+		if (pfds[1].revents)
+			while (read(srv->wake[0], buf, sizeof(buf)) > 0)
+				;
+
+		/* A request or EOF: a worker reads it either way */
+		for (i = 2; i < n; i++) {
+			if (!pfds[i].revents)
+				continue;
+			pthread_mutex_lock(&srv->lock);
+			conns[i]->busy = 1;
+			pthread_mutex_unlock(&srv->lock);
+			pool_submit(srv->pool, &conns[i]->task);
+		}
+
+		if (pfds[0].revents)
+			new_conn(srv);
+	}
+
+	free(pfds);
+	free(conns);
+}
+
+int serve(const char *sock_path, const struct serve_opts *opts,
+	  struct ebuf *ebuf)
+{
+	struct server srv;
+	struct sigaction sa, old_int, old_term;
+	sigset_t mask, old_mask;
+	struct conn *c;
+	int threads, ret = -1;
+
+	memset(&srv, 0, sizeof(srv));
+	pthread_mutex_init(&srv.lock, NULL);
+	srv.mem_cap = opts && opts->mem_cap ? opts->mem_cap : DEF_MEM_CAP;
+	threads = opts && opts->threads > 0 ? opts->threads : DEF_THREADS;
+
+	if (pipe2(srv.wake, O_NONBLOCK | O_CLOEXEC)) {
+		ebuf_add(ebuf, "serve: failed to create pipe: %s\n",
+			 strerror(errno));
+		return -1;
+	}
+
+	srv.fd = listen_on(sock_path, ebuf);
+	if (srv.fd < 0) {
+		close(srv.wake[0]);
+		close(srv.wake[1]);
+		return -1;
+	}
+
+	/* Workers never get the signals, they inherit the mask */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, &old_int);
+	sigaction(SIGTERM, &sa, &old_term);
+
+	stop = 0;
+
+	srv.pool = pool_new(threads, ebuf);
+	if (srv.pool) {
+		mask = old_mask;
+		sigdelset(&mask, SIGINT);
+		sigdelset(&mask, SIGTERM);
+		accept_conns(&srv, &mask);
+
+		/* Clients are dropped, workers are done with them */
+		pthread_mutex_lock(&srv.lock);
+		for (c = srv.conns; c; c = c->next)
+			shutdown(c->fd, SHUT_RDWR);
+		pthread_mutex_unlock(&srv.lock);
+
+		pool_free(srv.pool);
+		ret = 0;
+	}
+
+	/* Idle ones are left */
+	while ((c = srv.conns)) {
+		unlink_conn(&srv, c);
+		close(c->fd);
+		free(c);
+	}
+
+	close(srv.fd);
+	close(srv.wake[0]);
+	close(srv.wake[1]);
+	unlink(sock_path);
+
+	sigaction(SIGINT, &old_int, NULL);
+	sigaction(SIGTERM, &old_term, NULL);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	free_books(srv.head);
+	pthread_mutex_destroy(&srv.lock);
+
+	return ret;
+}
@@ -0,0 +1,33 @@
+#ifndef _SERVE_H
+#define _SERVE_H
+
+#include <stddef.h>
+
+#include "ebuf.h"
+
+/*
+ * Query server on a Unix socket. Parsed workbooks are kept in an LRU
+ * cache, a workbook is parsed again when its file changes.
+ *
+ * Every message is a frame: 4-byte big-endian length and the payload.
+ * Request payload is the request name and its arguments, one per line:
+ *
+ *   list-sheets\n<ods-file>
+ *   read-range\n<ods-file>\n<sheet>\n<B1[:H99]>
+ *   dump-sheet\n<ods-file>\n<sheet>
+ *   stats
+ *
+ * Response payload is "ok\n" and the output as the CLI prints it, or
+ * "error\n" and the message. A client may send any number of requests.
+ */
+
+struct serve_opts {
+	int threads; /* Clients served at once. 0: default */
+	size_t mem_cap; /* Bytes of cached workbooks. 0: default */
+};
+
+/* Serve until SIGINT or SIGTERM */
+int serve(const char *sock_path, const struct serve_opts *opts,
+	  struct ebuf *ebuf);
+
+#endif
@@ -0,0 +1,553 @@
+/*
+ * Snapshot cache of parsed sheets.
+ *
+ * Layout (native byte order, all sections 8-byte aligned):
+ *   header
+ *   sheet table
+ *   for every sheet: row runs, column arrays, column table
+ *   string heap: NUL-terminated strings, offset 0 means "no string"
+ *
+ * Offsets are from the start of the file, string offsets are from the
+ * start of the heap.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hash.h"
+#include "ods.h"
+#include "snap.h"
+
+#define SNAP_MAGIC "ODSSNAP"
+#define SNAP_VERSION 2
+#define SNAP_BYTE_ORDER 0x01020304
+
+struct snap_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	/* Key */
+	uint64_t size;
+	int64_t mtime_sec, mtime_nsec;
+	uint32_t crc;
+	uint32_t nsheets;
+	uint64_t path; /* In the heap */
+	uint64_t sheets_off;
+	uint64_t heap_off, heap_sz;
+	uint64_t file_sz;
+};
+
+struct snap_sheet {
+	uint64_t name; /* In the heap */
+	uint64_t rows_off; /* struct row_run[nrows] */
+	uint64_t cols_off; /* struct snap_col[ncols] */
+	uint32_t nrows, ncols;
+};
+
+struct snap_col {
+	int32_t col, n;
+	int32_t row0, nrows;
+	uint64_t null_off; /* Bitmap */
+	uint64_t type_off; /* uint8_t[nrows] */
+	uint64_t num_off; /* double[nrows] */
+	uint64_t str_off; /* uint32_t[nrows], in the heap */
+};
+
+struct snap {
+	const char *p;
+	size_t sz;
+	const struct snap_hdr *hdr;
+	const struct snap_sheet *sheets;
+	const char *heap;
+};
+
+char *snap_path(const char *path, const char *dir)
+{
+	char *s;
+	size_t n;
+
+	if (!dir) {
+		n = strlen(path) + sizeof(".snap");
+		s = malloc(n);
+		if (s)
+			snprintf(s, n, "%s.snap", path);
+		return s;
+	}
+
+	n = strlen(dir) + 1 + 16 + sizeof(".snap");
+	s = malloc(n);
+	if (s)
+		snprintf(s, n, "%s/%016llx.snap", dir,
+			 (unsigned long long)hash_mem64(path, strlen(path)));
+
+	return s;
+}
+
+/* @n items of @sz bytes at @off are inside the file */
+static int in_file(struct snap *s, uint64_t off, uint64_t n, size_t sz)
+{
+	return off % 8 == 0 && off <= s->sz && n <= (s->sz - off) / sz;
+}
+
+static int check_hdr(struct snap *s, const struct snap_key *key)
+{
+	const struct snap_hdr *h = s->hdr;
+
+	if (memcmp(h->magic, SNAP_MAGIC, sizeof(h->magic))
+	    || h->version != SNAP_VERSION || h->byte_order != SNAP_BYTE_ORDER
+	    || h->file_sz != s->sz)
+		return -1;
+
+	if (h->size != key->size || h->mtime_sec != key->mtime_sec
+	    || h->mtime_nsec != key->mtime_nsec || h->crc != key->crc)
+		return -1;
+
+	if (!in_file(s, h->heap_off, h->heap_sz, 1) || !h->heap_sz
+	    || s->p[h->heap_off + h->heap_sz - 1])
+		return -1;
+
+	if (!in_file(s, h->sheets_off, h->nsheets, sizeof(*s->sheets)))
+		return -1;
+
+	s->heap = s->p + h->heap_off;
+	s->sheets = (const struct snap_sheet *)(s->p + h->sheets_off);
+
+	/* Path hash may collide */
+	if (h->path >= h->heap_sz || strcmp(s->heap + h->path, key->path))
+		return -1;
+
+	return 0;
+}
+
+void *snap_open(const char *fname, const struct snap_key *key)
+{
+	struct snap *s;
+	struct stat st;
+	void *p;
+	int fd;
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || st.st_size < sizeof(struct snap_hdr)) {
+		close(fd);
+		return NULL;
+	}
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	s = calloc(sizeof(*s), 1);
+	if (!s) {
+		munmap(p, st.st_size);
+		return NULL;
+	}
+
+	s->p = p;
+	s->sz = st.st_size;
+	s->hdr = p;
+
+	if (check_hdr(s, key)) {
+		snap_close(s);
+		return NULL;
+	}
+
+	return s;
+}
+
+void snap_close(void *snap)
+{
+	struct snap *s = (struct snap *)snap;
+
+	if (!s)
+		return;
+
+	munmap((void *)s->p, s->sz);
+	free(s);
+}
+
+int snap_nsheets(void *snap)
+{
+	return ((struct snap *)snap)->hdr->nsheets;
+}
+
+const char *snap_sheet_name(void *snap, int i)
+{
+	struct snap *s = (struct snap *)snap;
+
+	if (s->sheets[i].name >= s->hdr->heap_sz)
+		return "";
+
+	return s->heap + s->sheets[i].name;
+}
+
+int snap_load_sheet(void *snap, const char *name, struct sheet_ctx *sh,
+		    struct ebuf *ebuf)
+{
+	struct snap *s = (struct snap *)snap;
+	const struct snap_sheet *ss;
+	const struct snap_col *sc;
+	struct column *c;
+	int i;
+
+	for (i = 0; i < s->hdr->nsheets; i++) {
+		if (!strcmp(snap_sheet_name(s, i), name))
+			break;
+	}
+
+	if (i == s->hdr->nsheets) {
+		ebuf_add(ebuf, "ods: sheet not found\n");
+		return -1;
+	}
+
+	ss = &s->sheets[i];
+	if (!in_file(s, ss->rows_off, ss->nrows, sizeof(*sh->rows))
+	    || !in_file(s, ss->cols_off, ss->ncols, sizeof(*sc))
+	    || ss->nrows > ODS_MAX_ROWS || ss->ncols > ODS_MAX_COLS)
+		goto bad;
+
+	sh->rows = (struct row_run *)(s->p + ss->rows_off);
+	sh->nrows = ss->nrows;
+	sh->heap = s->heap;
+	sh->heap_sz = s->hdr->heap_sz;
+
+	if (!ss->ncols)
+		return 0;
+
+	sh->cols = calloc(ss->ncols, sizeof(*sh->cols));
+	if (!sh->cols) {
+		ebuf_add(ebuf, "ods: no memory for columns\n");
+		return -1;
+	}
+
+	sc = (const struct snap_col *)(s->p + ss->cols_off);
+	for (i = 0, c = sh->cols; i < ss->ncols; i++, sc++, c++) {
+		if (sc->row0 < 0 || sc->nrows <= 0
+		    || sc->row0 > (int)ss->nrows - sc->nrows
+		    || !in_file(s, sc->null_off, (sc->nrows + 7) / 8, 1)
+		    || !in_file(s, sc->type_off, sc->nrows, 1)
+		    || !in_file(s, sc->num_off, sc->nrows, sizeof(double))
+		    || !in_file(s, sc->str_off, sc->nrows, sizeof(uint32_t)))
+			goto bad;
+
+		c->col = sc->col;
+		c->n = sc->n;
+		c->row0 = sc->row0;
+		c->nrows = sc->nrows;
+		/* Read-only, nothing writes to them after loading */
+		c->null = (unsigned char *)(s->p + sc->null_off);
+		c->type = (unsigned char *)(s->p + sc->type_off);
+		c->num = (double *)(s->p + sc->num_off);
+		c->str = (const uint32_t *)(s->p + sc->str_off);
+	}
+	sh->ncols = ss->ncols;
+
+	return 0;
+
+bad:
+	ebuf_add(ebuf, "ods: broken snapshot of sheet \"%s\"\n", name);
+	return -1;
+}
+
+/* Strings are stored once: open addressing over heap offsets */
+struct heap {
+	char *buf;
+	size_t len, sz;
+	uint32_t *htab;
+	size_t hmask, nstr;
+};
+
+struct snap_wr {
+	FILE *f;
+	char *fname, *tmp;
+	uint64_t off;
+	struct snap_hdr hdr;
+	struct snap_sheet *sheets;
+	int nsheets, cur;
+	struct heap heap;
+	int err;
+	struct ebuf *ebuf;
+};
+
+static int heap_grow_htab(struct heap *h)
+{
+	uint32_t *t, o;
+	size_t sz = (h->hmask + 1) * 2, i, j;
+
+	t = calloc(sz, sizeof(*t));
+	if (!t)
+		return -1;
+
+	for (i = 0; i <= h->hmask; i++) {
+		o = h->htab[i];
+		if (!o)
+			continue;
+		j = hash_mem64(h->buf + o, strlen(h->buf + o)) & (sz - 1);
+		while (t[j])
+			j = (j + 1) & (sz - 1);
+		t[j] = o;
+	}
+
+	free(h->htab);
+	h->htab = t;
+	h->hmask = sz - 1;
+
+	return 0;
+}
+
+/* Offset of the string in the heap, 0 on error */
+static uint32_t heap_add(struct heap *h, const char *s)
+{
+	size_t n = strlen(s), i;
+	uint32_t o;
+	char *p;
+
+	if (h->nstr * 2 >= h->hmask + 1 && heap_grow_htab(h))
+		return 0;
+
+	for (i = hash_mem64(s, n) & h->hmask; (o = h->htab[i]);
+	     i = (i + 1) & h->hmask) {
+		if (!strcmp(h->buf + o, s))
+			return o;
+	}
+
+	if (h->len + n + 1 > UINT32_MAX)
+		return 0;
+
+	if (h->len + n + 1 > h->sz) {
+		p = realloc(h->buf, h->sz * 2 + n + 1);
+		if (!p)
+			return 0;
+		h->buf = p;
+		h->sz = h->sz * 2 + n + 1;
+	}
+
+	o = h->len;
+	memcpy(h->buf + o, s, n + 1);
+	h->len += n + 1;
+	h->htab[i] = o;
+	h->nstr++;
+
+	return o;
+}
+
+static void wr(struct snap_wr *w, const void *p, size_t n)
+{
+	if (w->err || !n)
+		return;
+
+	if (fwrite(p, 1, n, w->f) != n) {
+		ebuf_add(w->ebuf, "ods: failed to write snapshot: %s\n",
+			 strerror(errno));
+		w->err = 1;
+		return;
+	}
+
+	w->off += n;
+}
+
+/* Write @n bytes padded to 8, returns their offset */
+static uint64_t wr_sect(struct snap_wr *w, const void *p, size_t n)
+{
+	static const char zero[8];
+	uint64_t off = w->off;
+
+	wr(w, p, n);
+	wr(w, zero, -n & 7);
+
+	return off;
+}
+
+struct snap_wr *snap_wr_new(const char *fname, const struct snap_key *key,
+			    int nsheets, struct ebuf *ebuf)
+{
+	struct snap_wr *w;
+	size_t n;
+
+	w = calloc(sizeof(*w), 1);
+	if (!w)
+		goto nomem;
+
+	w->ebuf = ebuf;
+	w->nsheets = nsheets;
+	w->sheets = calloc(nsheets ? nsheets : 1, sizeof(*w->sheets));
+	w->fname = strdup(fname);
+	n = strlen(fname) + 32;
+	w->tmp = malloc(n);
+	w->heap.hmask = 255;
+	w->heap.htab = calloc(w->heap.hmask + 1, sizeof(*w->heap.htab));
+	w->heap.sz = 4096;
+	w->heap.buf = malloc(w->heap.sz);
+	if (!w->sheets || !w->fname || !w->tmp || !w->heap.htab
+	    || !w->heap.buf) {
+		snap_wr_fin(w, 0);
+		goto nomem;
+	}
+
+	/* Offset 0 is for "no string" */
+	w->heap.buf[0] = '\0';
+	w->heap.len = 1;
+
+	memcpy(w->hdr.magic, SNAP_MAGIC, sizeof(w->hdr.magic));
+	w->hdr.version = SNAP_VERSION;
+	w->hdr.byte_order = SNAP_BYTE_ORDER;
+	w->hdr.size = key->size;
+	w->hdr.mtime_sec = key->mtime_sec;
+	w->hdr.mtime_nsec = key->mtime_nsec;
+	w->hdr.crc = key->crc;
+	w->hdr.nsheets = nsheets;
+	w->hdr.path = heap_add(&w->heap, key->path);
+	if (!w->hdr.path) {
+		snap_wr_fin(w, 0);
+		goto nomem;
+	}
+
+	/* Written by the rename, readers never see a partial file */
+	snprintf(w->tmp, n, "%s.%d.tmp", fname, (int)getpid());
+	w->f = fopen(w->tmp, "wb");
+	if (!w->f) {
+		ebuf_add(ebuf, "ods: failed to create snapshot: %s\n",
+			 strerror(errno));
+		snap_wr_fin(w, 0);
+		return NULL;
+	}
+
+	/* Header and sheet table are rewritten at the end */
+	wr_sect(w, &w->hdr, sizeof(w->hdr));
+	w->hdr.sheets_off = wr_sect(w, w->sheets,
+				    nsheets * sizeof(*w->sheets));
+
+	return w;
+
+nomem:
+	ebuf_add(ebuf, "ods: no memory for snapshot\n");
+	return NULL;
+}
+
+int snap_wr_sheet(struct snap_wr *w, const struct sheet_ctx *sh)
+{
+	struct snap_sheet *ss;
+	struct snap_col *sc;
+	const struct column *c;
+	uint32_t *str;
+	int i, k;
+
+	if (w->err)
+		return -1;
+
+	if (w->cur == w->nsheets) {
+		ebuf_add(w->ebuf, "ods: too many sheets for snapshot\n");
+		w->err = 1;
+		return -1;
+	}
+
+	ss = &w->sheets[w->cur++];
+	ss->name = heap_add(&w->heap, sh->name);
+	ss->nrows = sh->nrows;
+	ss->ncols = sh->ncols;
+	ss->rows_off = wr_sect(w, sh->rows, sh->nrows * sizeof(*sh->rows));
+
+	sc = calloc(sh->ncols ? sh->ncols : 1, sizeof(*sc));
+	if (!sc || !ss->name)
+		goto nomem;
+
+	for (i = 0, c = sh->cols; i < sh->ncols; i++, c++) {
+		str = malloc(c->nrows * sizeof(*str));
+		if (!str)
+			goto nomem;
+
+		for (k = 0; k < c->nrows; k++) {
+			str[k] = 0;
+			if (c->null[k / 8] & 1 << k % 8 || !c->code[k])
+				continue;
+			str[k] = heap_add(&w->heap,
+					  dict_str(&sh->dict, c->code[k]));
+			if (!str[k]) {
+				free(str);
+				goto nomem;
+			}
+		}
+
+		sc[i].col = c->col;
+		sc[i].n = c->n;
+		sc[i].row0 = c->row0;
+		sc[i].nrows = c->nrows;
+		sc[i].null_off = wr_sect(w, c->null, (c->nrows + 7) / 8);
+		sc[i].type_off = wr_sect(w, c->type, c->nrows);
+		sc[i].num_off = wr_sect(w, c->num, c->nrows * sizeof(*c->num));
+		sc[i].str_off = wr_sect(w, str, c->nrows * sizeof(*str));
+		free(str);
+	}
+
+	ss->cols_off = wr_sect(w, sc, sh->ncols * sizeof(*sc));
+	free(sc);
+
+	return w->err ? -1 : 0;
+
+nomem:
+	free(sc);
+	ebuf_add(w->ebuf, "ods: no memory for snapshot\n");
+	w->err = 1;
+	return -1;
+}
+
+int snap_wr_fin(struct snap_wr *w, int ok)
+{
+	int err = !ok;
+
+	if (!w->f)
+		goto out;
+
+	if (ok && !w->err && w->cur < w->nsheets) {
+		ebuf_add(w->ebuf, "ods: missing sheets in snapshot\n");
+		w->err = 1;
+	}
+
+	if (ok && !w->err) {
+		w->hdr.heap_off = wr_sect(w, w->heap.buf, w->heap.len);
+		w->hdr.heap_sz = w->heap.len;
+		w->hdr.file_sz = w->off;
+		if (fseek(w->f, 0, SEEK_SET)) {
+			ebuf_add(w->ebuf, "ods: failed to write snapshot: %s\n",
+				 strerror(errno));
+			w->err = 1;
+		}
+		wr(w, &w->hdr, sizeof(w->hdr));
+		wr(w, w->sheets, w->nsheets * sizeof(*w->sheets));
+	}
+
+	if (fclose(w->f) && !w->err) {
+		ebuf_add(w->ebuf, "ods: failed to write snapshot: %s\n",
+			 strerror(errno));
+		w->err = 1;
+	}
+
+	err = err || w->err;
+	if (!err && rename(w->tmp, w->fname)) {
+		ebuf_add(w->ebuf, "ods: failed to rename snapshot: %s\n",
+			 strerror(errno));
+		err = 1;
+	}
+
+	if (err)
+		unlink(w->tmp);
+
+out:
+	free(w->heap.buf);
+	free(w->heap.htab);
+	free(w->sheets);
+	free(w->fname);
+	free(w->tmp);
+	free(w);
+
+	return err ? -1 : 0;
+}
@@ -0,0 +1,56 @@
+#ifndef _SNAP_H
+#define _SNAP_H
+
+/*
+ * Snapshot of parsed sheets on disk. It is used in place through a single
+ * read-only mapping: rows and column arrays are laid out as the sheet store
+ * keeps them in memory, display text is in a string heap.
+ */
+
+#include <stdint.h>
+
+#include "ebuf.h"
+#include "ods_int.h"
+
+/* The snapshot is valid only for the same ods-file */
+struct snap_key {
+	const char *path; /* Absolute */
+	uint64_t size;
+	int64_t mtime_sec, mtime_nsec;
+	uint32_t crc; /* content.xml, from the Central Dir */
+};
+
+/*
+ * Snapshot file of the ods-file: next to it if @dir is NULL, otherwise
+ * named by a hash of the path in @dir. free() it.
+ */
+char *snap_path(const char *path, const char *dir);
+
+/* Map the snapshot. NULL if there is none or it is stale or broken */
+void *snap_open(const char *fname, const struct snap_key *key);
+
+void snap_close(void *snap);
+
+int snap_nsheets(void *snap);
+
+const char *snap_sheet_name(void *snap, int i);
+
+/* Point rows and columns of the sheet to the mapping */
+int snap_load_sheet(void *snap, const char *name, struct sheet_ctx *sh,
+		    struct ebuf *ebuf);
+
+/*
+ * Writer. Sheets are added one by one, display text of all their cells
+ * must be made. The file appears only when it is complete.
+ */
+struct snap_wr;
+
+struct snap_wr *snap_wr_new(const char *fname, const struct snap_key *key,
+			    int nsheets, struct ebuf *ebuf);
+
+int snap_wr_sheet(struct snap_wr *w, const struct sheet_ctx *sh);
+
+/* Complete the file (if @ok) or drop it. Frees the writer */
+int snap_wr_fin(struct snap_wr *w, int ok);
+
+#endif
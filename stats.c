@@ -0,0 +1,35 @@
+/*
+ * Performance counters.
+ */
+
+#include <string.h>
+
+#include "stats.h"
+
+int stats_on;
+struct ods_stats stats;
+
+void stats_enable(int on)
+{
+	__atomic_store_n(&stats_on, on, __ATOMIC_RELAXED);
+}
+
+void stats_get(struct ods_stats *st)
+{
+	const uint64_t *p = (const uint64_t *)&stats;
+	uint64_t *q = (uint64_t *)st;
+	int i;
+
+	/* All fields are counters */
+	for (i = 0; i < sizeof(stats) / sizeof(*p); i++)
+		q[i] = __atomic_load_n(&p[i], __ATOMIC_RELAXED);
+}
+
+void stats_reset(void)
+{
+	uint64_t *p = (uint64_t *)&stats;
+	int i;
+
+	for (i = 0; i < sizeof(stats) / sizeof(*p); i++)
+		__atomic_store_n(&p[i], 0, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,79 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+/*
+ * Performance counters. They are off by default: then every counting
+ * point is a single test of a global flag, so they stay compiled in.
+ * Counters are process-wide and may be updated from several threads,
+ * times are summed over threads.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+struct ods_stats {
+	/* zip.c */
+	uint64_t zip_index_ns; /* EOCDR search, Central Dir indexing */
+	uint64_t zip_inflate_ns;
+	uint64_t zip_compressed; /* Bytes given to inflate */
+	uint64_t zip_inflated; /* Bytes got from inflate */
+	/* xml.c */
+	uint64_t xml_parse_ns;
+	uint64_t xml_elems; /* Tree nodes created */
+	uint64_t xml_attrs;
+	uint64_t xml_texts;
+	/* ods.c */
+	uint64_t ods_open_ns; /* ods_open() as a whole */
+	uint64_t ods_build_ns; /* ods_open_sheet() */
+	uint64_t ods_sheets; /* Sheets built */
+	uint64_t ods_cell_runs;
+	/*
+	 * Bulk allocations only: arena chunks, cell and row arrays, inflate
+	 * buffers. Small malloc()s of the library are not counted, bench/
+	 * counts all of them by wrapping malloc().
+	 */
+	uint64_t bulk_allocs;
+	uint64_t bulk_alloc_bytes;
+};
+
+extern int stats_on;
+extern struct ods_stats stats;
+
+#define STATS_ADD(field, n) do {					\
+	if (__builtin_expect(stats_on, 0))				\
+		__atomic_fetch_add(&stats.field, (n), __ATOMIC_RELAXED);	\
+} while (0)
+
+/* A bulk allocation of @sz bytes */
+#define STATS_ALLOC(sz) do {						\
+	STATS_ADD(bulk_allocs, 1);					\
+	STATS_ADD(bulk_alloc_bytes, (sz));				\
+} while (0)
+
+/* Start of a timed span, 0 if counters are off */
+static inline uint64_t stats_clock(void)
+{
+	struct timespec t;
+
+	if (__builtin_expect(!stats_on, 1))
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/* Time since @t0 of stats_clock(). Spans started while off are dropped */
+#define STATS_TIME(field, t0) do {					\
+	if (__builtin_expect(stats_on, 0) && (t0))			\
+		__atomic_fetch_add(&stats.field, stats_clock() - (t0),	\
+				   __ATOMIC_RELAXED);			\
+} while (0)
+
+void stats_enable(int on);
+
+void stats_get(struct ods_stats *st);
+
+void stats_reset(void);
+
+#endif
@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <stddef.h>
+#include <limits.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -8,6 +10,11 @@
 #include "xml.h"
 #include "stack.h"
 #include "sbuf.h"
+#include "arena.h"
+#include "atom.h"
+#include "scan.h"
+#include "hash.h"
+#include "stats.h"
 
 enum stat {
 	STAT_UNDEF          = 0, /* Undefined state */
@@ -31,7 +38,7 @@ enum stat {
 
 	/* Text */
 	STAT_TEXT_TAIL      = 12,
-	/* &lt; &amp; etc in text */
+	/* &lt; &amp; etc in text or attribute value */
 	STAT_TEXT_ESC       = 13,
 
 
@@ -47,6 +54,19 @@ enum stat {
 	STAT_COMMENT        = 17,
 	/* Empty-element tag */
 	STAT_EETAG          = 18,
+
+	/* Skipping element content: only nesting depth is tracked */
+	STAT_SKIP           = 19,
+	/* Previous char is '<' */
+	STAT_SKIP_TAG       = 20,
+	STAT_SKIP_STAG      = 21,
+	STAT_SKIP_ATTR_VAL  = 22,
+	STAT_SKIP_ETAG      = 23,
+	/* "<?...>" or "<!...>" */
+	STAT_SKIP_DECL      = 24,
+
+	/* Stopped by a handler: the rest is ignored */
+	STAT_STOP           = 25,
 };
 
 /* Check if it is valid char in tag/attribute name */
@@ -95,102 +115,430 @@ static int escape_seq2char(char *p)
 		return -1;
 }
 
-/* Create a new element and add it to the existed tree */
-static struct xml_elem *add_elem(char *name /* Save by pointer, not copy */,
-				 enum xml_elem_type type,
-				 struct xml_elem *parent,
-				 struct xml_elem **prev)
+#define ARRAY_LEN(a) (sizeof(a)/sizeof(a[0]))
+
+#define container_of(p, type, member) \
+	((type *)((char *)(p) - offsetof(type, member)))
+
+/*
+ * Tree: all its nodes and strings are allocated from one arena,
+ * elements and attributes names are interned in its symbol table.
+ */
+struct xml_index;
+
+struct xml_doc {
+	struct arena arena;
+	struct atoms atoms;
+	struct xml_index *indexes; /* Of children by attribute value */
+	struct xml_elem root;
+};
+
+#define MAX_DEPTH 256
+
+/* Token (name, attribute value, text) buffer: initial and max size */
+#define SBUF_SZ 256
+#define MAX_TOKEN_SZ (1 << 30)
+
+/*
+ * Incremental (push) parser state. Everything that used to live on the
+ * stack of xml_parse() is kept here, so the input may be delivered in
+ * arbitrary chunks -- e.g. straight from the zip inflate loop.
+ */
+struct xml_parser {
+	int stat;
+	int xml_decl;
+	int line, pos;
+	/* Start tags stack -- used to match start and end tags */
+	int st_atom[MAX_DEPTH];
+	int depth;
+	/* String buffer: the token being read, grows with long values */
+	struct sbuf sbuf;
+	/*
+	 * Current start tag: atom of the name and attributes values as
+	 * null-terminated strings one after another. Attributes
+	 * refer to it by offsets until the tag is complete.
+	 */
+	int tag_atom;
+	char *tag; /* Not used in-situ: values are left in the input */
+	int tag_len, tag_sz;
+	struct xml_attr *attr;
+	int nattr, attr_sz;
+	/* Escape sequence like "amp" in "&amp;" */
+	char esc[32];
+	char *esc_p;
+	int esc_ret; /* State to return to after escape sequence */
+	/*
+	 * In-situ parsing: the string buffer is pointed to the input at
+	 * the start of each token, so tokens are slices of the caller's
+	 * buffer. Escape sequences are decoded in place -- the write
+	 * position never overtakes the read position.
+	 */
+	int insitu;
+	/* Depth in the skipped element and if the last char in tag was '/' */
+	int skip_depth;
+	int skip_slash;
+	/* Input offset: of the current chunk and the next char to parse */
+	const char *chunk;
+	size_t chunk_off;
+	const char *next;
+	/* Names symbol table: own or the tree's one */
+	struct atoms *atoms;
+	struct atoms own_atoms;
+	const struct xml_sax *sax;
+	void *priv;
+	struct ebuf *ebuf;
+	/* Tree builder -- used by xml_parser_new() only */
+	struct dom {
+		struct xml_doc *doc;
+		struct xml_elem *root, *parent, *prev;
+		/* Previous child stack */
+		struct stack pch_stack;
+		void *pch_buf[MAX_DEPTH];
+		struct ebuf *ebuf;
+		int insitu;
+		int (*filter)(void *priv, struct xml_elem *elem);
+		void *filter_priv;
+		int dropped; /* The next end tag is of a dropped element */
+	} dom;
+};
+
+static struct xml_parser *parser_new(const struct xml_sax *sax, void *priv,
+				     struct atoms *atoms, struct ebuf *ebuf)
 {
-	struct xml_elem *elem;
+	struct xml_parser *xp;
 
-	if (parent && parent->child && !*prev) {
-		fprintf(stderr, "%s: Bug: *prev must not be null",
-			__func__);
+	xp = calloc(sizeof(*xp), 1);
+	if (!xp) {
+		ebuf_add(ebuf, "xml: no memory for parser\n");
 		return NULL;
 	}
 
-	elem = calloc(sizeof(*elem), 1);
-	if (!elem) {
-		fprintf(stderr, "%s: No memory!\n", __func__);
+	if (!atoms) {
+		if (atoms_init(&xp->own_atoms)) {
+			ebuf_add(ebuf, "xml: no memory for symbol table\n");
+			free(xp);
+			return NULL;
+		}
+		atoms = &xp->own_atoms;
+	}
+
+	if (sbuf_init_heap(&xp->sbuf, SBUF_SZ, MAX_TOKEN_SZ)) {
+		ebuf_add(ebuf, "xml: no memory for parser\n");
+		if (atoms == &xp->own_atoms)
+			atoms_free(atoms);
+		free(xp);
 		return NULL;
 	}
 
-	elem->type = type;
-	elem->name = name;
+	xp->stat = STAT_STAG;
+	xp->atoms = atoms;
+	xp->sax = sax;
+	xp->priv = priv;
+	xp->ebuf = ebuf;
 
-	if (parent) {
-		/* Add element to the end of parent's childs list */
-		if (*prev)
-			(*prev)->pnext = elem;
-		else
-			parent->child = elem;
-		elem->parent = parent;
+	return xp;
+}
 
-		*prev = elem;
+struct xml_parser *xml_sax_new(const struct xml_sax *sax, void *priv,
+			       struct ebuf *ebuf)
+{
+	return parser_new(sax, priv, NULL, ebuf);
+}
+
+/* Free parser together with a partially built tree */
+void xml_parser_free(struct xml_parser *xp)
+{
+	if (!xp)
+		return;
+
+	if (xp->dom.doc) {
+		arena_free(&xp->dom.doc->arena);
+		atoms_free(&xp->dom.doc->atoms);
+		free(xp->dom.doc);
 	}
+	if (xp->atoms == &xp->own_atoms)
+		atoms_free(&xp->own_atoms);
+	sbuf_free(&xp->sbuf);
+	free(xp->tag);
+	free(xp->attr);
+	free(xp);
+}
 
-	return elem;
+/* Null-terminate the string buffer content and return it */
+static char *sbuf_str(struct sbuf *sbuf)
+{
+	*sbuf_tail(sbuf) = '\0';
+
+	return sbuf_buf(sbuf);
 }
 
-#define ARRAY_LEN(a) (sizeof(a)/sizeof(a[0]))
+/* Intern the name from the string buffer */
+static int intern(struct xml_parser *xp)
+{
+	char *s = sbuf_buf(&xp->sbuf);
+	int a;
 
-struct xml_elem *xml_parse(FILE *fp, struct ebuf *ebuf)
+	a = atoms_intern(xp->atoms, s, sbuf_tail(&xp->sbuf) - s);
+	if (a < 0)
+		ebuf_add(xp->ebuf, "xml: no memory for symbol table\n");
+
+	sbuf_trash(&xp->sbuf);
+
+	return a;
+}
+
+/* Move string buffer content to the current start tag */
+static int tag_add(struct xml_parser *xp)
+{
+	int n = sbuf_tail(&xp->sbuf) - sbuf_buf(&xp->sbuf) + 1;
+	char *p;
+
+	if (xp->tag_len + n > xp->tag_sz) {
+		p = realloc(xp->tag, xp->tag_sz * 2 + n);
+		if (!p) {
+			ebuf_add(xp->ebuf, "xml: no memory for start tag\n");
+			return -1;
+		}
+		xp->tag = p;
+		xp->tag_sz = xp->tag_sz * 2 + n;
+	}
+
+	memcpy(xp->tag + xp->tag_len, sbuf_str(&xp->sbuf), n);
+	xp->tag_len += n;
+
+	sbuf_trash(&xp->sbuf);
+
+	return 0;
+}
+
+/* Attribute value is in the string buffer */
+static int attr_val_end(struct xml_parser *xp)
+{
+	if (!xp->insitu)
+		return tag_add(xp);
+
+	xp->attr[xp->nattr - 1].val = sbuf_str(&xp->sbuf);
+	sbuf_trash(&xp->sbuf);
+
+	return 0;
+}
+
+/* Attribute name is in the string buffer */
+static int attr_add(struct xml_parser *xp)
+{
+	struct xml_attr *p;
+
+	if (xp->nattr == xp->attr_sz) {
+		p = realloc(xp->attr, (xp->attr_sz * 2 + 8) * sizeof(*p));
+		if (!p) {
+			ebuf_add(xp->ebuf, "xml: no memory for attributes\n");
+			return -1;
+		}
+		xp->attr = p;
+		xp->attr_sz = xp->attr_sz * 2 + 8;
+	}
+
+	p = &xp->attr[xp->nattr];
+	p->atom = intern(xp);
+	if (p->atom < 0)
+		return -1;
+	p->name = (char *)atoms_name(xp->atoms, p->atom);
+
+	/* Offset, since tag buffer may be reallocated */
+	p->val = (char *)(long)xp->tag_len;
+	p->pnext = NULL;
+	xp->nattr++;
+
+	return 0;
+}
+
+/*
+ * Start tag is complete: report it and push its name. Set the next state:
+ * content or skipping it, if the handler asks so.
+ */
+static int stag_end(struct xml_parser *xp, int empty)
+{
+	struct xml_attr *p;
+	const char *name;
+	int i, r;
+
+	for (i = 0, p = xp->attr; i < xp->nattr; i++, p++) {
+		if (!xp->insitu)
+			p->val = xp->tag + (long)p->val;
+		p->pnext = i + 1 < xp->nattr ? p + 1 : NULL;
+	}
+
+	name = atoms_name(xp->atoms, xp->tag_atom);
+
+	r = xp->sax->stag(xp->priv, name, xp->tag_atom,
+			  xp->nattr ? xp->attr : NULL, empty);
+	if (r < 0) {
+		ebuf_add(xp->ebuf, "xml: %d:%d: start tag handler failed\n",
+			 xp->line, xp->pos);
+		return -1;
+	}
+
+	if (r == XML_STOP) {
+		xp->stat = STAT_STOP;
+		return 0;
+	}
+
+	xp->stat = STAT_TAG_OR_TEXT;
+
+	if (empty) {
+		if (xp->sax->etag(xp->priv, name, xp->tag_atom)) {
+			ebuf_add(xp->ebuf, "xml: %d:%d: end tag handler failed\n",
+				 xp->line, xp->pos);
+			return -1;
+		}
+	} else {
+		if (xp->depth == MAX_DEPTH) {
+			ebuf_add(xp->ebuf, "xml: too small internal tag-match stack\n");
+			return -1;
+		}
+
+		xp->st_atom[xp->depth++] = xp->tag_atom;
+
+		if (r == XML_SKIP) {
+			xp->skip_depth = 1;
+			xp->stat = STAT_SKIP;
+		}
+	}
+
+	xp->tag_len = 0;
+	xp->nattr = 0;
+
+	return 0;
+}
+
+/* Account chars [p, q) passed over by a bulk scan */
+static void advance(struct xml_parser *xp, const char *p, const char *q,
+		    struct scan_nl *nl)
+{
+	if (nl->n) {
+		xp->line += nl->n;
+		xp->pos = q - nl->last - 1;
+	} else {
+		xp->pos += q - p;
+	}
+}
+
+/* See xml_parser_feed() */
+static int parse_chunk(struct xml_parser *xp, const char *buf, int n)
 {
-	int c, quote = 0, xml_decl = 0;
+	const char *end = buf + n;
+	struct ebuf *ebuf = xp->ebuf;
+	int c, a;
 	char *p, *s;
-	int line = 0, pos = 0;
-	int stat = STAT_STAG;
-	struct xml_elem *elem = NULL, *parent = NULL, *prev = NULL,
-		*root = NULL;
-	struct xml_attr *attr = NULL, *prev_attr = NULL;
-	/* Start tags stack -- used to match start and end tags */
-	struct stack st_stack;
-	void *st_buf[256];
-	/* Previous child stack */
-	struct stack pch_stack;
-	void *pch_buf[256]; /* Size should be equal to st_buf */
-	/* String buffer */
-	struct sbuf sbuf;
-	char sb_buf[256];
-	char esc[32];
+	const char *q;
+	struct scan_nl nl;
+
+	xp->chunk = buf;
+
+	while (buf < end) {
+		if (xp->stat == STAT_STOP)
+			return XML_STOP;
+
+		/* In-situ: the next token starts here */
+		if (xp->insitu && sbuf_tail(&xp->sbuf) == sbuf_buf(&xp->sbuf))
+			sbuf_init(&xp->sbuf, (char *)buf, end - buf);
+
+		/*
+		 * Fast paths: jump straight to the next delimiter
+		 * in text, attribute value, name or spaces.
+		 */
+		switch (xp->stat) {
+			case STAT_TEXT_TAIL:
+				q = scan_delim(buf, end, '<', '&', &nl);
+				/* Overflow is reported by the byte loop */
+				if (sbuf_addn(&xp->sbuf, buf, q - buf))
+					q = buf;
+				break;
+
+			case STAT_ATTR_VAL_TAIL:
+				q = scan_delim(buf, end, '"', '&', &nl);
+				/* Overflow is reported by the byte loop */
+				if (sbuf_addn(&xp->sbuf, buf, q - buf))
+					q = buf;
+				break;
+
+			case STAT_TAG_OR_TEXT:
+			case STAT_ATTR_NAME:
+				q = scan_space(buf, end, &nl);
+				break;
+
+			case STAT_SKIP:
+				q = scan_delim(buf, end, '<', '<', &nl);
+				break;
+
+			case STAT_SKIP_STAG:
+				q = scan_delim(buf, end, '>', '"', &nl);
+				if (q != buf)
+					xp->skip_slash = q[-1] == '/';
+				break;
+
+			case STAT_SKIP_ATTR_VAL:
+				q = scan_delim(buf, end, '"', '"', &nl);
+				break;
+
+			case STAT_SKIP_ETAG:
+			case STAT_SKIP_DECL:
+				q = scan_delim(buf, end, '>', '>', &nl);
+				break;
+
+			case STAT_STAG_NAME_TAIL:
+			case STAT_ATTR_NAME_TAIL:
+			case STAT_ETAG_NAME_TAIL:
+				q = scan_name(buf, end);
+				nl.n = 0;
+				/* Overflow is reported by the byte loop */
+				if (sbuf_addn(&xp->sbuf, buf, q - buf))
+					q = buf;
+				break;
 
-	stack_init(&st_stack, st_buf, ARRAY_LEN(st_buf));
+			default:
+				q = buf;
+				break;
+		}
 
-	stack_init(&pch_stack, pch_buf, ARRAY_LEN(pch_buf));
+		if (q != buf) {
+			advance(xp, buf, q, &nl);
+			buf = q;
+			if (buf == end)
+				break;
+		}
 
-	sbuf_init(&sbuf, sb_buf, sizeof(sb_buf));
+		c = (unsigned char)*buf++;
 
-	/* Main loop */
-	while ((c = fgetc(fp)) != EOF) {
-		pos++;
+		xp->pos++;
 
 		if (c == '\n') {
-			line++;
-			pos = 0;
+			xp->line++;
+			xp->pos = 0;
 		}
 
 #ifdef _XML_DBG
 		printf("%c", c);
 #endif
 
-		switch (stat) {
+		switch (xp->stat) {
 			case STAT_DECLAR: /* Read the rest of XML declaration (after "<?") till "?>" */
 				if (c == '>') {
-					p = sbuf_buf(&sbuf);
-					s = sbuf_tail(&sbuf);
+					p = sbuf_buf(&xp->sbuf);
+					s = sbuf_tail(&xp->sbuf);
 					if (s - p < 4 || memcmp(p, "xml", 3) || *(s - 1) != '?') {
 						ebuf_add(ebuf, "xml: invalid XML declaration\n");
 						goto err;
 					}
-					sbuf_trash(&sbuf);
+					sbuf_trash(&xp->sbuf);
 
-					xml_decl = 1;
+					xp->xml_decl = 1;
 
-					stat = STAT_STAG;
+					xp->stat = STAT_STAG;
 					break;
 				}
 
-				if (sbuf_add(&sbuf, c)) {
+				if (sbuf_add(&xp->sbuf, c)) {
 					ebuf_add(ebuf, "xml: too long XML declaration\n");
 					goto err;
 				}
@@ -202,80 +550,53 @@ struct xml_elem *xml_parse(FILE *fp, struct ebuf *ebuf)
 					break; /* Skip */
 
 				if (c != '<') {
-					ebuf_add(ebuf, "xml: %d:%d: Expected '<'. Get: '%c'(%02x)\n", line, pos, c, c);
+					ebuf_add(ebuf, "xml: %d:%d: Expected '<'. Get: '%c'(%02x)\n", xp->line, xp->pos, c, c);
 					goto err;
 				}
 
-				stat = STAT_STAG_NAME;
+				xp->stat = STAT_STAG_NAME;
 				break;
 
 			case STAT_STAG_NAME: /* Start tag name */
-				if (c == '?' && !parent && !xml_decl) { /* "<?" Special case -- optional XML declaration */
-					stat = STAT_DECLAR;
+				if (c == '?' && !xp->xml_decl) { /* "<?" Special case -- optional XML declaration */
+					xp->stat = STAT_DECLAR;
 					break;
 				}
 
 				if (!is_valid_name_char(c, 1)) {
-					ebuf_add(ebuf, "xml: %d:%d: Invalid char in start tag name: '%c'(%02x)\n", line, pos, c, c);
+					ebuf_add(ebuf, "xml: %d:%d: Invalid char in start tag name: '%c'(%02x)\n", xp->line, xp->pos, c, c);
 					goto err;
 				}
 
-				sbuf_add(&sbuf, c);
+				sbuf_add(&xp->sbuf, c);
 
-				stat = STAT_STAG_NAME_TAIL;
+				xp->stat = STAT_STAG_NAME_TAIL;
 				break;
 
 			case STAT_STAG_NAME_TAIL: /* Read the rest chars of the start tag name */
 				if (is_space(c) || c == '/' || c == '>') {
-					s = sbuf_dup(&sbuf);
-					if (!s)
-						goto err;
-					/*
-					 * We have to connect the created elem to the tree
-					 * as soon as possible, since in any error it will be
-					 * freed together with all other elems in the tree.
-					 */
-					elem = add_elem(s, XML_ELEM_TYPE_UNDEF,
-							parent, &prev);
-					if (!elem)
+					xp->tag_atom = intern(xp);
+					if (xp->tag_atom < 0)
 						goto err;
-
-					if (!parent)
-						root = elem;
 #ifdef _XML_DBG
-					printf("\nGet start tag name: %s\n", elem->name);
+					printf("\nGet start tag name: %s\n", atoms_name(xp->atoms, xp->tag_atom));
 #endif
 
 					if (is_space(c)) {
-						stat = STAT_ATTR_NAME;
+						xp->stat = STAT_ATTR_NAME;
 						break;
 					}
 
 					if (c == '/') {
-						stat = STAT_EETAG;
+						xp->stat = STAT_EETAG;
 						break;
 					}
 
 					if (c == '>') {
 stag_close:
-						elem->type = XML_ELEM_TYPE_ELEM;
-
-						if (stack_push(&pch_stack,
-								prev)) {
-							ebuf_add(ebuf, "xml: too small internal pch stack\n");
-							goto err;
-						}
-
-						parent = elem;
-						prev_attr = NULL;
-						prev = NULL;
-
-						if (stack_push(&st_stack, elem->name)) {
-							ebuf_add(ebuf, "xml: too small internal tag-match stack\n");
+						xp->next = buf;
+						if (stag_end(xp, 0))
 							goto err;
-						}
-
-						stat = STAT_TAG_OR_TEXT;
 						break;
 					}
 
@@ -284,12 +605,12 @@ stag_close:
 				}
 
 				if (!is_valid_name_char(c, 0)) {
-					ebuf_add(ebuf, "xml: %d:%d: Invalid char in start tag name\n", line, pos);
+					ebuf_add(ebuf, "xml: %d:%d: Invalid char in start tag name\n", xp->line, xp->pos);
 					goto err;
 				}
 
-				if (sbuf_add(&sbuf, c)) {
-					ebuf_add(ebuf, "xml: %d:%d: Too long start tag name\n", line, pos);
+				if (sbuf_add(&xp->sbuf, c)) {
+					ebuf_add(ebuf, "xml: %d:%d: Too long start tag name\n", xp->line, xp->pos);
 					goto err;
 				}
 
@@ -297,18 +618,16 @@ stag_close:
 
 			case STAT_EETAG: /* Empty-element tag: expect '>' after '/' */
 				if (c != '>') {
-					ebuf_add(ebuf, "xml: %d:%d: Empty-element tag: expected '>'\n", line, pos);
+					ebuf_add(ebuf, "xml: %d:%d: Empty-element tag: expected '>'\n", xp->line, xp->pos);
 					goto err;
 				}
 
 #ifdef _XML_DBG
 				printf("\nEmpty-element tag\n");
 #endif
-				elem->type = XML_ELEM_TYPE_EMPTY;
-
-				prev_attr = NULL;
-
-				stat = STAT_TAG_OR_TEXT;
+				xp->next = buf;
+				if (stag_end(xp, 1))
+					goto err;
 				break;
 
 			case STAT_TAG_OR_TEXT: /* Expect a start tag, end tag or text */
@@ -320,78 +639,80 @@ stag_close:
 
 				if (c != '<') { /* Text */
 					if (c == '&') {
-						p = esc;
-						stat = STAT_TEXT_ESC;
+						xp->esc_p = xp->esc;
+						xp->esc_ret = STAT_TEXT_TAIL;
+						xp->stat = STAT_TEXT_ESC;
 					} else {
-						sbuf_add(&sbuf, c);
-						stat = STAT_TEXT_TAIL;
+						sbuf_add(&xp->sbuf, c);
+						xp->stat = STAT_TEXT_TAIL;
 					}
 					break;
 				}
 
-				stat = STAT_TAG;
+				xp->stat = STAT_TAG;
 				break;
 
 			case STAT_TEXT_ESC: /* Escape sequence like &lt; */
 				if (c == ';') {
-					*p = '\0';
-					c = escape_seq2char(esc);
+					*xp->esc_p = '\0';
+					c = escape_seq2char(xp->esc);
 					if (c < 0) {
 						c = ';';
 					} else {
 #ifdef _XML_DBG
-						printf("Found escape sequence: \"%s\" ('%c')\n", s, c);
+						printf("Found escape sequence: \"%s\" ('%c')\n", xp->esc, c);
 #endif
 					}
 
-					if (sbuf_add(&sbuf, c)) {
-						ebuf_add(ebuf, "xml: %d:%d: Too long text\n", line, pos);
+					if (sbuf_add(&xp->sbuf, c)) {
+						ebuf_add(ebuf, "xml: %d:%d: Too long text\n", xp->line, xp->pos);
 						goto err;
 					}
 
-					stat = STAT_TEXT_TAIL;
+					xp->stat = xp->esc_ret;
 					break;
 				}
 
 				if (!is_valid_esc_seq_char(c)) {
-					ebuf_add(ebuf, "xml: %d:%d: Invalid char in the escape sequence: '%c'\n", c);
+					ebuf_add(ebuf, "xml: %d:%d: Invalid char in the escape sequence: '%c'\n", xp->line, xp->pos, c);
 					goto err;
 				}
 
-				if (p >= esc + sizeof(esc) - 1) {
-					ebuf_add(ebuf, "xml: %d:%d: Too long escape sequence\n", line, pos);
+				if (xp->esc_p >= xp->esc + sizeof(xp->esc) - 1) {
+					ebuf_add(ebuf, "xml: %d:%d: Too long escape sequence\n", xp->line, xp->pos);
 					goto err;
 				}
-				*p++ = c;
+				*xp->esc_p++ = c;
 
 				break;
 
 			case STAT_TEXT_TAIL: /* Reading text tail */
 				if (c == '<') {
-					s = sbuf_dup(&sbuf);
-					if (!s)
+					s = sbuf_str(&xp->sbuf);
+#ifdef _XML_DBG
+					printf("\nGet text: \"%s\"\n", s);
+#endif
+					if (xp->sax->text(xp->priv, s,
+						sbuf_tail(&xp->sbuf) - s)) {
+						ebuf_add(ebuf, "xml: %d:%d: text handler failed\n", xp->line, xp->pos);
 						goto err;
+					}
 
-					elem = add_elem(s, XML_ELEM_TYPE_TEXT,
-							parent, &prev);
-					if (!elem)
-						goto err;
+					sbuf_trash(&xp->sbuf);
 
-#ifdef _XML_DBG
-					printf("\nGet text: \"%s\"\n", elem->name);
-#endif
-					stat = STAT_TAG;
+					xp->stat = STAT_TAG;
 					break;
 				}
 
 				if (c == '&') {
-					p = esc;
-					stat = STAT_TEXT_ESC;
+					xp->esc_p = xp->esc;
+					xp->esc_ret = STAT_TEXT_TAIL;
+					xp->stat = STAT_TEXT_ESC;
 					break;
 				}
 
-				if (sbuf_add(&sbuf, c)) {
-					ebuf_add(ebuf, "xml: %d:%d: Too long text\n", line, pos);
+				if (sbuf_add(&xp->sbuf, c)) {
+					ebuf_add(ebuf, "xml: %d:%d: Too long text\n", xp->line, xp->pos);
 					goto err;
 				}
 
@@ -399,18 +720,18 @@ stag_close:
 
 			case STAT_TAG: /* Previous char is '<'  */
 				if (c == '/') {
-					stat = STAT_ETAG_NAME; /* Next must be closing tag name */
+					xp->stat = STAT_ETAG_NAME; /* Next must be closing tag name */
 					break;
 				}
 
 				if (!is_valid_name_char(c, 1)) {
-					ebuf_add(ebuf, "xml: %d:%d: Invalid char in the start tag name\n", line, pos);
+					ebuf_add(ebuf, "xml: %d:%d: Invalid char in the start tag name\n", xp->line, xp->pos);
 					goto err;
 				}
 
-				sbuf_add(&sbuf, c);
+				sbuf_add(&xp->sbuf, c);
 
-				stat = STAT_STAG_NAME_TAIL;
+				xp->stat = STAT_STAG_NAME_TAIL;
 				break;
 
 			case STAT_ATTR_NAME:
@@ -418,7 +739,7 @@ stag_close:
 					break; /* Skip spaces */
 
 				if (c == '/') {
-					stat = STAT_EETAG;
+					xp->stat = STAT_EETAG;
 					break;
 				}
 
@@ -426,56 +747,37 @@ stag_close:
 					goto stag_close;
 
 				if (!is_valid_name_char(c, 1)) {
-					ebuf_add(ebuf, "xml: %d:%d: Invalid char in the attr name: '%c'\n", line, pos, c);
+					ebuf_add(ebuf, "xml: %d:%d: Invalid char in the attr name: '%c'\n", xp->line, xp->pos, c);
 					goto err;
 				}
 
-				sbuf_add(&sbuf, c);
+				sbuf_add(&xp->sbuf, c);
 
-				stat = STAT_ATTR_NAME_TAIL;
+				xp->stat = STAT_ATTR_NAME_TAIL;
 				break;
 
 			case STAT_ATTR_NAME_TAIL: /* Read the rest of attribute name till space or equal sign */
 				if (is_space(c)) {
-					stat = STAT_ATTR_EQU;
+					xp->stat = STAT_ATTR_EQU;
 					break;
 				}
 
 				if (c == '=') {
 attr_name_equ:
-					s = sbuf_dup(&sbuf);
-					if (!s)
-						goto err;
-
-					attr = calloc(sizeof(*attr), 1);
-					if (!attr) {
-						fprintf(stderr, "%s:%d: No memory!\n", __FILE__, __LINE__);
+					if (attr_add(xp))
 						goto err;
-					}
-
-					attr->name = s;
-
-					if (prev_attr) {
-						prev_attr->pnext = attr;
-					} else {
-						elem->attr = attr;
-					}
-
-					prev_attr = attr;
-
-					//printf("Get attr: %s\n", attr->name);
 
-					stat = STAT_ATTR_VAL;
+					xp->stat = STAT_ATTR_VAL;
 					break;
 				}
 
 				if (!is_valid_name_char(c, 0)) {
-					ebuf_add(ebuf, "xml: %d:%d: Invalid char in the attr name: '%c'\n", line, pos, c);
+					ebuf_add(ebuf, "xml: %d:%d: Invalid char in the attr name: '%c'\n", xp->line, xp->pos, c);
 					goto err;
 				}
 
-				if (sbuf_add(&sbuf, c)) {
-					ebuf_add(ebuf, "xml: %d:%d: Too long attr name\n", line, pos);
+				if (sbuf_add(&xp->sbuf, c)) {
+					ebuf_add(ebuf, "xml: %d:%d: Too long attr name\n", xp->line, xp->pos);
 					goto err;
 				}
 
@@ -488,7 +790,7 @@ attr_name_equ:
 				if (c == '=')
 					goto attr_name_equ;
 
-				ebuf_add(ebuf, "xml: %d:%d: Expected spaces or equal sign after attr name. Got '%c'\n", line, pos, c);
+				ebuf_add(ebuf, "xml: %d:%d: Expected spaces or equal sign after attr name. Got '%c'\n", xp->line, xp->pos, c);
 				goto err;
 
 			case STAT_ATTR_VAL: /* Wait for start double quote */
@@ -496,233 +798,849 @@ attr_name_equ:
 					break;
 
 				if (c == '"') {
-					stat = STAT_ATTR_VAL_TAIL;
+					xp->stat = STAT_ATTR_VAL_TAIL;
 					break;
 				}
 
-				ebuf_add(ebuf, "xml: %d:%d: Expected spaces or double quote in attr value. Got '%c'\n", line, pos, c);
+				ebuf_add(ebuf, "xml: %d:%d: Expected spaces or double quote in attr value. Got '%c'\n", xp->line, xp->pos, c);
 				goto err;
 
 			case STAT_ATTR_VAL_TAIL: /* Wait for end double quote */
 				if (c == '"') {
-					attr->val = sbuf_dup(&sbuf);
-					if (!attr->val)
+					if (attr_val_end(xp))
 						goto err;
 
-					/*
-					printf("Get attr val: %s\n", attr->val);
-					sleep(1);
-					*/
+					xp->stat = STAT_ATTR_NAME;
+					break;
+				}
 
-					stat = STAT_ATTR_NAME;
+				if (c == '&') {
+					xp->esc_p = xp->esc;
+					xp->esc_ret = STAT_ATTR_VAL_TAIL;
+					xp->stat = STAT_TEXT_ESC;
 					break;
 				}
 
-				if (sbuf_add(&sbuf, c)) {
-					ebuf_add(ebuf, "xml: %d:%d: Too long attr value\n", line, pos);
+				if (sbuf_add(&xp->sbuf, c)) {
+					ebuf_add(ebuf, "xml: %d:%d: Too long attr value\n", xp->line, xp->pos);
 					goto err;
 				}
 
-				/* TODO: escape sequences in attribute values */
-
 				break;
 
 			case STAT_ETAG_NAME:
 				if (!is_valid_name_char(c, 1)) {
-					ebuf_add(ebuf, "xml: %d:%d: Invalid char in the end tag name\n", line, pos);
+					ebuf_add(ebuf, "xml: %d:%d: Invalid char in the end tag name\n", xp->line, xp->pos);
 					goto err;
 				}
 
-				sbuf_add(&sbuf, c);
+				sbuf_add(&xp->sbuf, c);
 
-				stat = STAT_ETAG_NAME_TAIL;
+				xp->stat = STAT_ETAG_NAME_TAIL;
 				break;
 
 			case STAT_ETAG_NAME_TAIL:
 				if (c == '>') {
-					p = sbuf_tail(&sbuf);
-					*p = '\0';
-
 #ifdef _XML_DBG
-					printf("\nClosing tag name: %s\n", sbuf_buf(&sbuf));
+					printf("\nClosing tag name: %s\n", sbuf_str(&xp->sbuf));
 #endif
 
-					s = stack_pop(&st_stack);
-					if (s == EMPTY_STACK) {
-						ebuf_add(ebuf, "xml: %d:%d: Closing tag while no opening tags\n", line, pos);
+					if (!xp->depth) {
+						ebuf_add(ebuf, "xml: %d:%d: Closing tag while no opening tags\n", xp->line, xp->pos);
 						goto err;
 					}
 
-#ifdef _XML_DBG
-					printf("\nCorresponding opening tag name: %s\n", s);
-#endif
+					a = intern(xp);
+					if (a < 0)
+						goto err;
 
-					if (strcmp(s, sbuf_buf(&sbuf))) {
-						ebuf_add(ebuf, "xml: %d:%d: Opening tag doesn't match closing tag: \"%s\" vs \"%s\"\n", line, pos, s, sbuf_buf(&sbuf));
+					if (a != xp->st_atom[--xp->depth]) {
+						ebuf_add(ebuf, "xml: %d:%d: Opening tag doesn't match closing tag: \"%s\" vs \"%s\"\n", xp->line, xp->pos, atoms_name(xp->atoms, xp->st_atom[xp->depth]), atoms_name(xp->atoms, a));
 						goto err;
 					}
 
-					if (parent) {
-						parent = parent->parent;
-						prev = (struct xml_elem *)stack_pop(&pch_stack);
+					if (xp->sax->etag(xp->priv, atoms_name(xp->atoms, a), a)) {
+						ebuf_add(ebuf, "xml: %d:%d: end tag handler failed\n", xp->line, xp->pos);
+						goto err;
 					}
 
-					sbuf_trash(&sbuf);
-
-					stat = STAT_TAG_OR_TEXT;
+					xp->stat = STAT_TAG_OR_TEXT;
 					break;
 				}
 
 				if (!is_valid_name_char(c, 0)) {
-					ebuf_add(ebuf, "xml: %d:%d: Invalid char in the end tag name: '%c'\n", line, pos, c);
+					ebuf_add(ebuf, "xml: %d:%d: Invalid char in the end tag name: '%c'\n", xp->line, xp->pos, c);
+					goto err;
+				}
+
+				if (sbuf_add(&xp->sbuf, c)) {
+					ebuf_add(ebuf, "xml: %d:%d: Too long closing tag name\n", xp->line, xp->pos);
 					goto err;
 				}
 
-				if (sbuf_add(&sbuf, c)) {
-					ebuf_add(ebuf, "xml: %d:%d: Too long closing tag name\n", line, pos);
+				break;
+
+			/*
+			 * Skipping: no checks and no allocations, just find
+			 * the end tag of the skipped element.
+			 */
+			case STAT_SKIP:
+				if (c == '<')
+					xp->stat = STAT_SKIP_TAG;
+				break;
+
+			case STAT_SKIP_TAG:
+				if (c == '/') {
+					xp->stat = STAT_SKIP_ETAG;
+				} else if (c == '?' || c == '!') {
+					xp->stat = STAT_SKIP_DECL;
+				} else {
+					xp->skip_slash = 0;
+					xp->stat = STAT_SKIP_STAG;
+				}
+				break;
+
+			case STAT_SKIP_STAG:
+				if (c == '"') {
+					xp->stat = STAT_SKIP_ATTR_VAL;
+				} else if (c == '>') {
+					if (!xp->skip_slash)
+						xp->skip_depth++;
+					xp->stat = STAT_SKIP;
+				} else {
+					xp->skip_slash = c == '/';
+				}
+				break;
+
+			case STAT_SKIP_ATTR_VAL:
+				if (c == '"') {
+					xp->skip_slash = 0;
+					xp->stat = STAT_SKIP_STAG;
+				}
+				break;
+
+			case STAT_SKIP_DECL:
+				if (c == '>')
+					xp->stat = STAT_SKIP;
+				break;
+
+			case STAT_SKIP_ETAG:
+				if (c != '>')
+					break;
+
+				if (--xp->skip_depth) {
+					xp->stat = STAT_SKIP;
+					break;
+				}
+
+				/* End tag of the skipped element itself */
+				a = xp->st_atom[--xp->depth];
+				if (xp->sax->etag(xp->priv, atoms_name(xp->atoms, a), a)) {
+					ebuf_add(ebuf, "xml: %d:%d: end tag handler failed\n", xp->line, xp->pos);
 					goto err;
 				}
 
+				xp->stat = STAT_TAG_OR_TEXT;
 				break;
 
 			default:
-				ebuf_add(ebuf, "xml: Bug: Unknown internal state: %d\n", stat);
+				ebuf_add(ebuf, "xml: Bug: Unknown internal state: %d\n", xp->stat);
 				goto err;
 		}
 	}
 
-	if (ferror(fp)) {
-		ebuf_add(ebuf, "xml: Failed to read file: %s\n", strerror(errno));
-		goto err;
-	}
-
-	s = stack_pop(&st_stack);
-	if (s != EMPTY_STACK) {
-		ebuf_add(ebuf, "xml: Not all tags have being closed\n");
-		goto err;
-	}
+	xp->chunk_off += n;
 
-	return root;
+	return 0;
 
 err:
-	xml_free(root);
-	return NULL;
+	/* Poison the parser, so that further feeds fail */
+	xp->stat = STAT_UNDEF;
+	return -1;
 }
 
-static int _print_indent(int n, FILE *fp)
+/*
+ * Parse the next chunk of a document. Chunk boundaries may fall anywhere,
+ * even in the middle of a tag name. Return -1 on error -- the parser is
+ * not usable anymore and must be freed by xml_parser_free().
+ */
+int xml_parser_feed(struct xml_parser *xp, const char *buf, int n)
 {
-	if (fprintf(fp, "%*s", n, "") < 0)
-		return -1;
+	uint64_t t0 = stats_clock();
+	int r;
 
-	return 0;
+	r = parse_chunk(xp, buf, n);
+	STATS_TIME(xml_parse_ns, t0);
+
+	return r;
 }
 
-static int _print_attrs(struct xml_elem *elem, FILE *fp)
+size_t xml_parser_offset(struct xml_parser *xp)
 {
-	struct xml_attr *p;
-
-	p = elem->attr;
-	while (p) {
-		if (fprintf(fp, " %s=\"%s\"", p->name, p->val) < 0)
-			return -1;
-		p = p->pnext;
-	}
-
-	return 0;
+	return xp->chunk_off + (xp->next - xp->chunk);
 }
 
-static int _xml_print(struct xml_elem *root, int level, FILE *fp)
+/*
+ * Same as skipping in the parser, but over a complete buffer. Start tags
+ * are found out of attribute values, everything else is not checked.
+ */
+const char *xml_skip(const char *p, const char *end)
 {
-	struct xml_elem *p;
-
-	if (_print_indent(level * 2, fp))
-		return -1;
-
-	switch (root->type) {
-		default:
-		case XML_ELEM_TYPE_ELEM:
-			if (fprintf(fp, "<%s", root->name) < 0)
-				return -1;
+	struct scan_nl nl;
+	const char *q;
+	int depth = 1;
 
-			if (_print_attrs(root, fp))
-				return -1;
+	for (;;) {
+		p = scan_delim(p, end, '<', '<', &nl);
+		if (end - p < 2)
+			return NULL;
+		p++;
+
+		if (*p == '/' || *p == '?' || *p == '!') {
+			q = scan_delim(p, end, '>', '>', &nl);
+			if (q == end)
+				return NULL;
+			if (*p == '/' && !--depth)
+				return q + 1;
+			p = q + 1;
+			continue;
+		}
 
-			p = root->child;
-			if (p && !p->pnext && p->type == XML_ELEM_TYPE_TEXT &&
-				strlen(p->name) < 50) {
-				fprintf(fp, ">%s</%s>\n", p->name, root->name);
+		/* Start tag */
+		for (;;) {
+			q = scan_delim(p, end, '>', '"', &nl);
+			if (q == end)
+				return NULL;
+			if (*q == '>')
 				break;
-			}
+			p = scan_delim(q + 1, end, '"', '"', &nl);
+			if (p == end)
+				return NULL;
+			p++;
+		}
 
-			if (fprintf(fp, ">\n") < 0)
-				return -1;
+		if (q[-1] != '/')
+			depth++;
+		p = q + 1;
+	}
+}
 
-			p = root->child;
-			while (p) {
-				if (_xml_print(p, level + 1, fp))
-					return -1;
-				p = p->pnext;
-			}
+/*
+ * Finish parsing: check that the document is complete.
+ * The parser is freed in any case.
+ */
+int xml_sax_fin(struct xml_parser *xp)
+{
+	int r = -1;
 
-			if (_print_indent(level * 2, fp))
-				return -1;
+	if (xp->stat == STAT_UNDEF) {
+		ebuf_add(xp->ebuf, "xml: parser was failed before\n");
+		goto fin;
+	}
 
-			if (fprintf(fp, "</%s>\n", root->name) < 0)
-				return -1;
+	if (xp->depth && xp->stat != STAT_STOP) {
+		ebuf_add(xp->ebuf, "xml: Not all tags have being closed\n");
+		goto fin;
+	}
 
-			break;
+	r = 0;
 
-		case XML_ELEM_TYPE_EMPTY:
-			if (fprintf(fp, "<%s", root->name) < 0)
-				return -1;
+fin:
+	xml_parser_free(xp);
+	return r;
+}
 
-			if (_print_attrs(root, fp))
-				return -1;
+/* Feed the whole file to the parser */
+static int feed_file(struct xml_parser *xp, FILE *fp)
+{
+	char buf[16384];
+	int n, r;
 
-			if (fprintf(fp, "/>\n") < 0)
-				return -1;
-			break;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		r = xml_parser_feed(xp, buf, n);
+		if (r)
+			return r < 0 ? -1 : 0;
+	}
 
-		case XML_ELEM_TYPE_TEXT:
-			if (fprintf(fp, "%s\n", root->name) < 0)
-				return -1;
-			break;
+	if (ferror(fp)) {
+		ebuf_add(xp->ebuf, "xml: Failed to read file: %s\n", strerror(errno));
+		return -1;
 	}
 
 	return 0;
 }
 
-int xml_print(struct xml_elem *root, FILE *fp)
+int xml_sax_parse(FILE *fp, const struct xml_sax *sax, void *priv,
+		  struct ebuf *ebuf)
 {
-	return _xml_print(root, 0, fp);
+	struct xml_parser *xp;
+
+	xp = xml_sax_new(sax, priv, ebuf);
+	if (!xp)
+		return -1;
+
+	if (feed_file(xp, fp)) {
+		xml_parser_free(xp);
+		return -1;
+	}
+
+	return xml_sax_fin(xp);
+}
+
+/*
+ * Tree builder -- just one of the event parser clients.
+ */
+
+/* Create a new element and add it to the existed tree */
+static struct xml_elem *add_elem(struct xml_doc *doc,
+				 char *name /* Save by pointer, not copy */,
+				 enum xml_elem_type type,
+				 struct xml_elem *parent,
+				 struct xml_elem **prev,
+				 struct ebuf *ebuf)
+{
+	struct xml_elem *elem;
+
+	if (parent && parent->child && !*prev) {
+		ebuf_add(ebuf, "xml: bug: no previous sibling\n");
+		return NULL;
+	}
+
+	if (parent) {
+		elem = arena_zalloc(&doc->arena, sizeof(*elem));
+		if (!elem) {
+			ebuf_add(ebuf, "xml: no memory for elem\n");
+			return NULL;
+		}
+	} else {
+		elem = &doc->root;
+		memset(elem, 0, sizeof(*elem));
+	}
+
+	elem->type = type;
+	elem->name = name;
+
+	if (type == XML_ELEM_TYPE_TEXT)
+		STATS_ADD(xml_texts, 1);
+	else
+		STATS_ADD(xml_elems, 1);
+
+	if (parent) {
+		/* Add element to the end of parent's childs list */
+		if (*prev)
+			(*prev)->pnext = elem;
+		else
+			parent->child = elem;
+		elem->parent = parent;
+
+		*prev = elem;
+	}
+
+	return elem;
+}
+
+static int dom_stag(void *priv, const char *name, int atom,
+		    struct xml_attr *attr, int empty)
+{
+	struct dom *dom = (struct dom *)priv;
+	struct xml_elem *elem, *prev = dom->prev;
+	struct xml_attr *a, *prev_attr = NULL;
+	char *mark = arena_mark(&dom->doc->arena);
+	int r;
+
+	if (!dom->parent && dom->root) {
+		ebuf_add(dom->ebuf, "xml: more than one root element\n");
+		return -1;
+	}
+
+	/* Interned name lives as long as the tree -- no copy */
+	elem = add_elem(dom->doc, (char *)name,
+			empty ? XML_ELEM_TYPE_EMPTY : XML_ELEM_TYPE_ELEM,
+			dom->parent, &dom->prev, dom->ebuf);
+	if (!elem)
+		return -1;
+
+	elem->atom = atom;
+
+	if (!dom->parent)
+		dom->root = elem;
+
+	for (; attr; attr = attr->pnext) {
+		a = arena_zalloc(&dom->doc->arena, sizeof(*a));
+		if (!a) {
+			ebuf_add(dom->ebuf, "xml: no memory for attr\n");
+			return -1;
+		}
+
+		if (prev_attr)
+			prev_attr->pnext = a;
+		else
+			elem->attr = a;
+		prev_attr = a;
+
+		a->name = attr->name;
+		a->atom = attr->atom;
+		/* In-situ values live in the caller's buffer */
+		a->val = dom->insitu ? attr->val :
+			arena_strndup(&dom->doc->arena, attr->val,
+				      strlen(attr->val));
+		if (!a->val) {
+			ebuf_add(dom->ebuf, "xml: no memory for attr\n");
+			return -1;
+		}
+		STATS_ADD(xml_attrs, 1);
+	}
+
+	if (stack_push(&dom->pch_stack, dom->prev)) {
+		ebuf_add(dom->ebuf, "xml: too small internal pch stack\n");
+		return -1;
+	}
+
+	dom->parent = elem;
+	dom->prev = NULL;
+
+	if (!dom->filter)
+		return 0;
+
+	r = dom->filter(dom->filter_priv, elem);
+	if (r == XML_SKIP)
+		return empty ? 0 : XML_SKIP; /* Kept, but without content */
+	if (r != XML_DROP && r != XML_STOP)
+		return r;
+
+	/* Unlink the element and reuse its memory */
+	dom->parent = elem->parent;
+	dom->prev = stack_pop(&dom->pch_stack);
+	if (!dom->parent) {
+		dom->root = NULL;
+	} else if (prev) {
+		prev->pnext = NULL;
+	} else {
+		dom->parent->child = NULL;
+	}
+	arena_rewind(&dom->doc->arena, mark);
+
+	if (r == XML_STOP)
+		return XML_STOP;
+
+	dom->dropped = 1;
+
+	return empty ? 0 : XML_SKIP;
+}
+
+static int dom_text(void *priv, const char *text, int len)
+{
+	struct dom *dom = (struct dom *)priv;
+	struct xml_elem *elem;
+	char *s;
+
+	if (!dom->parent) {
+		ebuf_add(dom->ebuf, "xml: text out of the root element\n");
+		return -1;
+	}
+
+	s = dom->insitu ? (char *)text :
+		arena_strndup(&dom->doc->arena, text, len);
+	if (!s) {
+		ebuf_add(dom->ebuf, "xml: no memory for text\n");
+		return -1;
+	}
+
+	elem = add_elem(dom->doc, s, XML_ELEM_TYPE_TEXT, dom->parent,
+			&dom->prev, dom->ebuf);
+	if (!elem)
+		return -1;
+
+	return 0;
+}
+
+static int dom_etag(void *priv, const char *name, int atom)
+{
+	struct dom *dom = (struct dom *)priv;
+
+	if (dom->dropped) {
+		dom->dropped = 0;
+		return 0;
+	}
+
+	dom->parent = dom->parent->parent;
+	dom->prev = (struct xml_elem *)stack_pop(&dom->pch_stack);
+
+	return 0;
+}
+
+static const struct xml_sax dom_sax = {
+	.stag = dom_stag,
+	.text = dom_text,
+	.etag = dom_etag,
+};
+
+struct xml_parser *xml_parser_new(struct ebuf *ebuf)
+{
+	struct xml_parser *xp;
+	struct xml_doc *doc;
+
+	doc = malloc(sizeof(*doc));
+	if (!doc) {
+		ebuf_add(ebuf, "xml: no memory for tree\n");
+		return NULL;
+	}
+
+	arena_init(&doc->arena);
+	doc->indexes = NULL;
+	if (atoms_init(&doc->atoms)) {
+		ebuf_add(ebuf, "xml: no memory for symbol table\n");
+		free(doc);
+		return NULL;
+	}
+
+	xp = parser_new(&dom_sax, NULL, &doc->atoms, ebuf);
+	if (!xp) {
+		atoms_free(&doc->atoms);
+		free(doc);
+		return NULL;
+	}
+
+	xp->dom.doc = doc;
+
+	xp->priv = &xp->dom;
+	xp->dom.ebuf = ebuf;
+	stack_init(&xp->dom.pch_stack, xp->dom.pch_buf,
+		   ARRAY_LEN(xp->dom.pch_buf));
+
+	return xp;
+}
+
+void xml_parser_filter(struct xml_parser *xp,
+		       int (*filter)(void *priv, struct xml_elem *elem),
+		       void *priv)
+{
+	xp->dom.filter = filter;
+	xp->dom.filter_priv = priv;
+}
+
+/*
+ * Finish parsing: check that the document is complete and return its root.
+ * The parser is freed in any case.
+ */
+struct xml_elem *xml_parser_fin(struct xml_parser *xp)
+{
+	struct xml_elem *root = xp->dom.root;
+	struct ebuf *ebuf = xp->ebuf;
+
+	/* Take the tree, so that it is not freed with the parser */
+	if (root)
+		xp->dom.doc = NULL;
+
+	if (xml_sax_fin(xp)) {
+		xml_free(root);
+		return NULL;
+	}
+
+	if (!root) {
+		ebuf_add(ebuf, "xml: No root element\n");
+		return NULL;
+	}
+
+	return root;
+}
+
+struct xml_elem *xml_parse(FILE *fp, struct ebuf *ebuf)
+{
+	struct xml_parser *xp;
+
+	xp = xml_parser_new(ebuf);
+	if (!xp)
+		return NULL;
+
+	if (feed_file(xp, fp)) {
+		xml_parser_free(xp);
+		return NULL;
+	}
+
+	return xml_parser_fin(xp);
+}
+
+/* Feed the whole buffer to the parser in-situ */
+static int feed_mem(struct xml_parser *xp, char *buf, size_t len)
+{
+	if (len > INT_MAX) {
+		ebuf_add(xp->ebuf, "xml: too big document\n");
+		return -1;
+	}
+
+	/* Tokens are slices of @buf, not copies */
+	sbuf_free(&xp->sbuf);
+	xp->insitu = 1;
+
+	return xml_parser_feed(xp, buf, len) < 0 ? -1 : 0;
 }
 
+/*
+ * Parse document in the caller's buffer in place. Names, attribute values
+ * and text of the tree point into @buf, which is modified (strings are
+ * null-terminated and unescaped in place) and must outlive the tree.
+ */
+struct xml_elem *xml_parse_mem(char *buf, size_t len, struct ebuf *ebuf)
+{
+	struct xml_parser *xp;
+
+	xp = xml_parser_new(ebuf);
+	if (!xp)
+		return NULL;
+
+	xp->dom.insitu = 1;
+
+	if (feed_mem(xp, buf, len)) {
+		xml_parser_free(xp);
+		return NULL;
+	}
+
+	return xml_parser_fin(xp);
+}
+
+/*
+ * Same for the event parser. Attribute values and text passed to handlers
+ * stay valid (in @buf) after the call.
+ */
+int xml_sax_parse_mem(char *buf, size_t len, const struct xml_sax *sax,
+		      void *priv, struct ebuf *ebuf)
+{
+	struct xml_parser *xp;
+
+	xp = xml_sax_new(sax, priv, ebuf);
+	if (!xp)
+		return -1;
+
+	if (feed_mem(xp, buf, len)) {
+		xml_parser_free(xp);
+		return -1;
+	}
+
+	return xml_sax_fin(xp);
+}
+
+/*
+ * Serializer. Output goes through a big buffer, the tree is walked by
+ * parent links, so deep documents take no stack.
+ */
+
+#define PRINT_BUF_SZ (1 << 20)
+
+struct printer {
+	FILE *fp;
+	char *buf;
+	size_t len;
+	int err;
+};
+
+/* Chars escaped in text (1) and in attribute values (2) */
+static const unsigned char print_esc[256] = {
+	['&'] = 3, ['<'] = 3, ['"'] = 2,
+};
+
+static void print_flush(struct printer *pr)
+{
+	if (pr->len && fwrite(pr->buf, 1, pr->len, pr->fp) != pr->len)
+		pr->err = 1;
+	pr->len = 0;
+}
+
+static void print_mem(struct printer *pr, const char *s, size_t n)
+{
+	size_t k;
+
+	while (n) {
+		if (pr->len == PRINT_BUF_SZ)
+			print_flush(pr);
+		k = PRINT_BUF_SZ - pr->len;
+		if (k > n)
+			k = n;
+		memcpy(pr->buf + pr->len, s, k);
+		pr->len += k;
+		s += k;
+		n -= k;
+	}
+}
+
+static void print_str(struct printer *pr, const char *s)
+{
+	print_mem(pr, s, strlen(s));
+}
+
+/* Text or attribute value (@mask 2) with markup chars escaped */
+static void print_esc_str(struct printer *pr, const char *s, int mask)
+{
+	const char *p;
+
+	for (;;) {
+		for (p = s; *p && !(print_esc[(unsigned char)*p] & mask); p++)
+			;
+		print_mem(pr, s, p - s);
+
+		switch (*p) {
+		case '\0':
+			return;
+		case '&':
+			print_mem(pr, "&amp;", 5);
+			break;
+		case '<':
+			print_mem(pr, "&lt;", 4);
+			break;
+		default:
+			print_mem(pr, "&quot;", 6);
+		}
+		s = p + 1;
+	}
+}
+
+static void print_indent(struct printer *pr, int n)
+{
+	static const char spaces[64] =
+		"                                                                ";
+
+	while (n > 0) {
+		print_mem(pr, spaces, n < sizeof(spaces) ? n : sizeof(spaces));
+		n -= sizeof(spaces);
+	}
+}
+
+/* Start tag without the closing ">" */
+static void print_stag(struct printer *pr, struct xml_elem *elem)
+{
+	struct xml_attr *p;
+
+	print_mem(pr, "<", 1);
+	print_str(pr, elem->name);
+
+	for (p = elem->attr; p; p = p->pnext) {
+		print_mem(pr, " ", 1);
+		print_str(pr, p->name);
+		print_mem(pr, "=\"", 2);
+		print_esc_str(pr, p->val, 2);
+		print_mem(pr, "\"", 1);
+	}
+}
+
+static void print_etag(struct printer *pr, struct xml_elem *elem, int level,
+		       int compact)
+{
+	if (!compact)
+		print_indent(pr, level * 2);
+	print_mem(pr, "</", 2);
+	print_str(pr, elem->name);
+	print_mem(pr, compact ? ">" : ">\n", compact ? 1 : 2);
+}
+
+/* The only child is a short text: printed on the line of the element */
+static int inline_text(struct xml_elem *elem)
+{
+	struct xml_elem *p = elem->child;
+
+	return p && !p->pnext && p->type == XML_ELEM_TYPE_TEXT
+		&& strnlen(p->name, 50) < 50;
+}
+
+int xml_print_ex(struct xml_elem *root, FILE *fp, int flags)
+{
+	struct printer pr;
+	struct xml_elem *e = root;
+	int level = 0, compact = flags & XML_PRINT_COMPACT;
+
+	pr.fp = fp;
+	pr.len = 0;
+	pr.err = 0;
+	pr.buf = malloc(PRINT_BUF_SZ);
+	if (!pr.buf)
+		return -1;
+
+	for (;;) {
+		if (!compact)
+			print_indent(&pr, level * 2);
+
+		switch (e->type) {
+		default:
+		case XML_ELEM_TYPE_ELEM:
+			print_stag(&pr, e);
+
+			if (!compact && inline_text(e)) {
+				print_mem(&pr, ">", 1);
+				print_esc_str(&pr, e->child->name, 1);
+				print_etag(&pr, e, 0, 1);
+				print_mem(&pr, "\n", 1);
+				break;
+			}
+
+			print_mem(&pr, compact ? ">" : ">\n", compact ? 1 : 2);
+
+			if (e->child) {
+				e = e->child;
+				level++;
+				continue;
+			}
+
+			print_etag(&pr, e, level, compact);
+			break;
+
+		case XML_ELEM_TYPE_EMPTY:
+			print_stag(&pr, e);
+			print_mem(&pr, compact ? "/>" : "/>\n", compact ? 2 : 3);
+			break;
+
+		case XML_ELEM_TYPE_TEXT:
+			print_esc_str(&pr, e->name, 1);
+			if (!compact)
+				print_mem(&pr, "\n", 1);
+			break;
+		}
+
+		/* Done with @e: next sibling or close the parents */
+		while (e != root && !e->pnext) {
+			e = e->parent;
+			level--;
+			print_etag(&pr, e, level, compact);
+		}
+
+		if (e == root)
+			break;
+
+		e = e->pnext;
+	}
+
+	print_flush(&pr);
+	free(pr.buf);
+
+	return pr.err ? -1 : 0;
+}
+
+int xml_print(struct xml_elem *root, FILE *fp)
+{
+	return xml_print_ex(root, fp, 0);
+}
+
+/* Free the whole tree. Must be called for the root only */
 void xml_free(struct xml_elem *root)
 {
-	struct xml_elem *p, *q;
-	struct xml_attr *r, *s;
+	struct xml_doc *doc;
 
 	if (!root)
 		return;
 
-	p = root->child;
-	while (p) {
-		q = p->pnext;
-		xml_free(p);
-		p = q;
-	}
+	doc = container_of(root, struct xml_doc, root);
+	arena_free(&doc->arena);
+	atoms_free(&doc->atoms);
+	free(doc);
+}
 
-	r = root->attr;
-	while (r) {
-		s = r->pnext;
-		free(r->name);
-		free(r->val);
-		free(r);
-		r = s;
-	}
+size_t xml_mem_size(struct xml_elem *root)
+{
+	struct xml_doc *doc;
 
-	free(root->name);
-	free(root);
+	doc = container_of(root, struct xml_doc, root);
+
+	return sizeof(*doc) + doc->arena.size + doc->atoms.arena.size
+		+ doc->atoms.sz * sizeof(*doc->atoms.names)
+		+ (doc->atoms.hmask + 1) * sizeof(*doc->atoms.htab);
 }
 
 /* Get direct child by name (return the first found) */
@@ -786,12 +1704,12 @@ struct xml_elem *xml_get_elem(struct xml_elem *root, const char *path)
 	return elem;
 }
 
-/* Get elem attribute by name and return value */
-char *xml_get_attr(struct xml_elem *elem, const char *name)
+/* Get attribute value by name from the attributes list */
+char *xml_attr_val(struct xml_attr *attr, const char *name)
 {
 	struct xml_attr *p;
 
-	p = elem->attr;
+	p = attr;
 	while (p) {
 		if (!strcmp(p->name, name))
 			return p->val;
@@ -801,23 +1719,210 @@ char *xml_get_attr(struct xml_elem *elem, const char *name)
 	return NULL;
 }
 
+/* Get elem attribute by name and return value */
+char *xml_get_attr(struct xml_elem *elem, const char *name)
+{
+	return xml_attr_val(elem->attr, name);
+}
+
+/* Get direct child by atom of its name (return the first found) */
+struct xml_elem *xml_get_child_atom(struct xml_elem *elem, int atom)
+{
+	struct xml_elem *p;
+
+	for (p = elem->child; p; p = p->pnext) {
+		if (p->atom == atom)
+			return p;
+	}
+
+	return NULL;
+}
+
+/* Get attribute value by atom of its name from the attributes list */
+char *xml_attr_val_atom(struct xml_attr *attr, int atom)
+{
+	struct xml_attr *p;
+
+	for (p = attr; p; p = p->pnext) {
+		if (p->atom == atom)
+			return p->val;
+	}
+
+	return NULL;
+}
+
+char *xml_get_attr_atom(struct xml_elem *elem, int atom)
+{
+	return xml_attr_val_atom(elem->attr, atom);
+}
+
+/*
+ * Index of the children of @elem with a name by the value of an attribute.
+ * Children are keyed either by atoms or by names (@name is set): atoms of
+ * names that are not well-known are only valid within one tree, and
+ * sheets parsed apart are stitched in from trees of their own.
+ */
+struct xml_index {
+	struct xml_elem *elem;
+	int atom, attr;
+	const char *name, *attr_name;
+	struct xml_index_ent {
+		unsigned hash;
+		const char *val; /* NULL: free slot */
+		struct xml_elem *child;
+	} *tab;
+	unsigned mask;
+	struct xml_index *next;
+};
+
+static struct xml_doc *doc_of(struct xml_elem *elem)
+{
+	while (elem->parent)
+		elem = elem->parent;
+
+	return container_of(elem, struct xml_doc, root);
+}
+
+static const char *index_key(struct xml_index *idx, struct xml_elem *p)
+{
+	if (idx->name)
+		return strcmp(p->name, idx->name) ? NULL :
+			xml_get_attr(p, idx->attr_name);
+
+	return p->atom != idx->atom ? NULL : xml_get_attr_atom(p, idx->attr);
+}
+
+static struct xml_index_ent *index_find(struct xml_index *idx,
+					const char *val, unsigned h)
+{
+	struct xml_index_ent *e;
+	unsigned i;
+
+	for (i = h;; i++) {
+		e = &idx->tab[i & idx->mask];
+		if (!e->val || (e->hash == h && !strcmp(e->val, val)))
+			return e;
+	}
+}
+
+static struct xml_index *get_index(struct xml_elem *elem, int atom, int attr,
+				   const char *name, const char *attr_name)
+{
+	struct xml_doc *doc = doc_of(elem);
+	struct xml_index *idx;
+	struct xml_index_ent *e;
+	struct xml_elem *p;
+	const char *v;
+	unsigned h;
+	int n = 0;
+
+	for (idx = doc->indexes; idx; idx = idx->next) {
+		if (idx->elem == elem && (name ?
+		    idx->name && !strcmp(idx->name, name)
+		    && !strcmp(idx->attr_name, attr_name) :
+		    !idx->name && idx->atom == atom && idx->attr == attr))
+			return idx;
+	}
+
+	idx = arena_zalloc(&doc->arena, sizeof(*idx));
+	if (!idx)
+		return NULL;
+	idx->elem = elem;
+	idx->atom = atom;
+	idx->attr = attr;
+	if (name) {
+		idx->name = arena_strndup(&doc->arena, name, strlen(name));
+		idx->attr_name = arena_strndup(&doc->arena, attr_name,
+					       strlen(attr_name));
+		if (!idx->name || !idx->attr_name)
+			return NULL;
+	}
+
+	for (p = elem->child; p; p = p->pnext)
+		n += !!index_key(idx, p);
+
+	/* At most half full */
+	for (idx->mask = 7; idx->mask < n * 2; idx->mask = idx->mask * 2 + 1)
+		;
+	idx->tab = arena_zalloc(&doc->arena,
+				(idx->mask + 1) * sizeof(*idx->tab));
+	if (!idx->tab)
+		return NULL;
+
+	for (p = elem->child; p; p = p->pnext) {
+		v = index_key(idx, p);
+		if (!v)
+			continue;
+		h = hash_str(v);
+		e = index_find(idx, v, h);
+		/* The first one wins as with a scan */
+		if (!e->val) {
+			e->hash = h;
+			e->val = v;
+			e->child = p;
+		}
+	}
+
+	idx->next = doc->indexes;
+	doc->indexes = idx;
+
+	return idx;
+}
+
+static struct xml_elem *index_get(struct xml_index *idx, const char *val)
+{
+	return index_find(idx, val, hash_str(val))->child;
+}
+
+int xml_index_children(struct xml_elem *elem, int atom, int attr)
+{
+	return get_index(elem, atom, attr, NULL, NULL) ? 0 : -1;
+}
+
 /* Get child by name and attribute value */
 struct xml_elem *xml_get_child_with_attr(struct xml_elem *elem,
 					 const char *name,
 					 const char *attr,
 					 const char *val)
 {
+	struct xml_index *idx;
 	struct xml_elem *p;
 	char *v;
 
-	p = elem->child;
-	while (p) {
+	idx = get_index(elem, 0, 0, name, attr);
+	if (idx)
+		return index_get(idx, val);
+
+	/* No memory for the index */
+	for (p = elem->child; p; p = p->pnext) {
 		if (!strcmp(p->name, name)) {
 			v = xml_get_attr(p, attr);
 			if (v && !strcmp(v, val))
 				return p;
 		}
-		p = p->pnext;
+	}
+
+	return NULL;
+}
+
+struct xml_elem *xml_get_child_with_attr_atom(struct xml_elem *elem,
+					      int atom, int attr,
+					      const char *val)
+{
+	struct xml_index *idx;
+	struct xml_elem *p;
+	char *v;
+
+	idx = get_index(elem, atom, attr, NULL, NULL);
+	if (idx)
+		return index_get(idx, val);
+
+	for (p = elem->child; p; p = p->pnext) {
+		if (p->atom == atom) {
+			v = xml_get_attr_atom(p, attr);
+			if (v && !strcmp(v, val))
+				return p;
+		}
 	}
 
 	return NULL;
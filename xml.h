@@ -2,8 +2,10 @@
 #define _XML_H
 
 #include <stdio.h>
+#include <stddef.h>
 
 #include "ebuf.h"
+#include "atom.h"
 
 enum xml_elem_type {
 	XML_ELEM_TYPE_UNDEF = 0, /* Undefined type */
@@ -14,6 +16,7 @@ enum xml_elem_type {
 
 struct xml_attr {
 	char *name;
+	int atom; /* Of the name */
 	char *val;
 	struct xml_attr *pnext;
 };
@@ -21,6 +24,7 @@ struct xml_attr {
 struct xml_elem {
 	enum xml_elem_type type;
 	char *name; /* Text for text element */
+	int atom; /* Of the name. ATOM_UNKNOWN for text element */
 	struct xml_elem *parent; /* Null for root element */
 	struct xml_elem *child;  /* List of childs. Can be null */
 	struct xml_attr *attr;   /* List of attributes */
@@ -30,18 +34,122 @@ struct xml_elem {
 
 struct xml_elem *xml_parse(FILE *fp, struct ebuf *ebuf);
 
+/* Incremental parser: document is fed by chunks as they become available */
+struct xml_parser;
+
+/* Parser that builds a tree */
+struct xml_parser *xml_parser_new(struct ebuf *ebuf);
+
+/* -1 on error, XML_STOP if a handler has stopped parsing: nothing more to feed */
+int xml_parser_feed(struct xml_parser *xp, const char *buf, int n);
+
+struct xml_elem *xml_parser_fin(struct xml_parser *xp);
+
+void xml_parser_free(struct xml_parser *xp);
+
+/*
+ * Offset of the next char to parse from the document start. In the start
+ * tag handler/filter it is the offset right after the start tag.
+ */
+size_t xml_parser_offset(struct xml_parser *xp);
+
+/*
+ * Find the end of an element in a complete document: @p points right
+ * after its start tag. Returns pointer past the end tag or NULL.
+ */
+const char *xml_skip(const char *p, const char *end);
+
+/* Start tag handler/filter result: skip the element content */
+#define XML_SKIP 1
+/* Start tag handler/filter result: stop, the document ends here */
+#define XML_STOP 2
+/* Filter result: no element at all, its content is skipped */
+#define XML_DROP 3
+
+/*
+ * Called for every element with its attributes, before its content.
+ * Return XML_SKIP to leave the element empty, 0 to keep content, XML_DROP
+ * to remove the element (its memory is reused), XML_STOP to remove it and
+ * end the document with the elements still open or -1 to abort parsing.
+ * XML_SKIP is the same as 0 for an empty-element tag.
+ */
+void xml_parser_filter(struct xml_parser *xp,
+		       int (*filter)(void *priv, struct xml_elem *elem),
+		       void *priv);
+
+/*
+ * Event (SAX-style) parser. Handlers return 0 to continue or -1 to abort
+ * parsing. Start tag handler may return XML_SKIP: the content is skipped
+ * unchecked, up to the matching end tag, which is reported as usual. Or
+ * XML_STOP: no more events, the rest of the input is ignored.
+ * Names, attributes and text are valid only during the call.
+ * Empty-element tag is reported as a start tag with @empty set,
+ * immediately followed by the end tag. Names are interned: well-known
+ * ones (see atom.h) can be checked by atom instead of strcmp().
+ */
+struct xml_sax {
+	int (*stag)(void *priv, const char *name, int atom,
+		    struct xml_attr *attr, int empty);
+	int (*text)(void *priv, const char *text, int len);
+	int (*etag)(void *priv, const char *name, int atom);
+};
+
+struct xml_parser *xml_sax_new(const struct xml_sax *sax, void *priv,
+			       struct ebuf *ebuf);
+
+int xml_sax_fin(struct xml_parser *xp);
+
+int xml_sax_parse(FILE *fp, const struct xml_sax *sax, void *priv,
+		  struct ebuf *ebuf);
+
+/* In-situ parsing of a caller's buffer (it is modified, see xml.c) */
+struct xml_elem *xml_parse_mem(char *buf, size_t len, struct ebuf *ebuf);
+
+int xml_sax_parse_mem(char *buf, size_t len, const struct xml_sax *sax,
+		      void *priv, struct ebuf *ebuf);
+
 int xml_print(struct xml_elem *root, FILE *fp);
 
+/* xml_print_ex() flags */
+#define XML_PRINT_COMPACT 1 /* No indentation and line breaks */
+
+int xml_print_ex(struct xml_elem *root, FILE *fp, int flags);
+
 void xml_free(struct xml_elem *root);
 
+/* Memory taken by the tree (without the buffer of in-situ parsing) */
+size_t xml_mem_size(struct xml_elem *root);
+
 struct xml_elem *xml_get_child(struct xml_elem *elem, const char *name);
 
 struct xml_elem *xml_get_elem(struct xml_elem *root, const char *path);
 
 char *xml_get_attr(struct xml_elem *elem, const char *name);
 
+char *xml_attr_val(struct xml_attr *attr, const char *name);
+
+/*
+ * Children are looked up by attribute value in a hash index built on the
+ * first call for the (element, child name, attribute). Building is not
+ * thread-safe: xml_index_children() builds it in advance. The tree must
+ * not be changed after that.
+ */
 struct xml_elem *xml_get_child_with_attr(struct xml_elem *elem,
 					 const char *name,
 					 const char *attr,
 					 const char *val);
+
+/* Same as above, but by well-known atoms (see atom.h) */
+struct xml_elem *xml_get_child_atom(struct xml_elem *elem, int atom);
+
+char *xml_get_attr_atom(struct xml_elem *elem, int atom);
+
+char *xml_attr_val_atom(struct xml_attr *attr, int atom);
+
+struct xml_elem *xml_get_child_with_attr_atom(struct xml_elem *elem,
+					      int atom, int attr,
+					      const char *val);
+
+/* Index for xml_get_child_with_attr_atom(). -1 if no memory */
+int xml_index_children(struct xml_elem *elem, int atom, int attr);
 #endif
@@ -2,10 +2,16 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <zlib.h>
 
+#include "hash.h"
+#include "stats.h"
 #include "zip.h"
 
 /* Central Directory Header Signature */
@@ -74,121 +80,302 @@ struct eocdr {
 	uint16_t comment_sz;
 } __attribute__ ((packed));
 
-#define READ_EOCDR_BUF 4096
-static int read_eocdr(FILE *fp, struct eocdr *r, struct ebuf *ebuf)
-{
-	int n;
-	char buf[READ_EOCDR_BUF];
-	char *p;
+/* Read-only mapping of the whole archive */
+struct zip_map {
+	const char *p;
+	size_t sz;
+};
 
-        /* Suppose, that EOCDR is in the last N bytes */
+static int map_file(const char *zip, struct zip_map *m, struct ebuf *ebuf)
+{
+	int fd;
+	struct stat st;
+	void *p;
 
-	if (fseek(fp, -READ_EOCDR_BUF-1, SEEK_END)) {
-		ebuf_add(ebuf, "zip: failed to seek while looking for End-Of-Central-Dir Record: %s\n", strerror(errno));
+	fd = open(zip, O_RDONLY);
+	if (fd < 0) {
+		ebuf_add(ebuf, "zip: failed to open zip-file: %s\n",
+			strerror(errno));
 		return -1;
 	}
 
-	n = fread(buf, 1, READ_EOCDR_BUF, fp);
-	if (n <= 0) {
-		ebuf_add(ebuf, "zip: failed to read the End-Of-Central-Dir Record: %s\n", strerror(errno));
+	if (fstat(fd, &st)) {
+		ebuf_add(ebuf, "zip: failed to stat zip-file: %s\n",
+			strerror(errno));
+		close(fd);
 		return -1;
 	}
 
-	p = buf-1;
-	do {
-		p++;
-		/* Find the first byte of EOCDR signature */
-		p = memchr(p, 0x50, buf + n - p);
-	} while (p && (buf + n - p >= 4) && *(uint32_t *)p != EOCDR_SIG);
+	if (st.st_size < sizeof(struct eocdr)) {
+		ebuf_add(ebuf, "zip: too small zip-file\n");
+		close(fd);
+		return -1;
+	}
 
-	if (!p || (buf + n - p < 4)) {
-		ebuf_add(ebuf, "zip: failed to found the End-Of-Central-Dir Record\n");
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	/* Mapping keeps its own reference to the file */
+	close(fd);
+	if (p == MAP_FAILED) {
+		ebuf_add(ebuf, "zip: failed to mmap zip-file: %s\n",
+			strerror(errno));
 		return -1;
 	}
 
-	memcpy(r, p, sizeof(*r));
+	m->p = p;
+	m->sz = st.st_size;
+
+	return 0;
+}
+
+static void unmap_file(struct zip_map *m)
+{
+	munmap((void *)m->p, m->sz);
+}
+
+/* Max length of the zip-file comment after EOCDR */
+#define MAX_COMMENT_SZ 0xffff
+
+static const struct eocdr *find_eocdr(struct zip_map *m, struct ebuf *ebuf)
+{
+	const struct eocdr *r;
+	const char *p, *lim;
+
+	/* EOCDR is the last record, followed only by the zip-file comment */
+	p = m->p + m->sz - sizeof(*r);
+	lim = m->sz > sizeof(*r) + MAX_COMMENT_SZ ?
+		p - MAX_COMMENT_SZ : m->p;
+	for (; p >= lim; p--) {
+		r = (const struct eocdr *)p;
+		if (r->sig == EOCDR_SIG)
+			break;
+	}
+
+	if (p < lim) {
+		ebuf_add(ebuf, "zip: failed to found the End-Of-Central-Dir Record\n");
+		return NULL;
+	}
 
 	if (r->nentries != r->nentries_total ||
 		r->cur_disk != r->central_dir_start_disk) {
 		       ebuf_add(ebuf, "zip: unexpected values in the End-Of-Central-Dir Record\n");
-		       return -1;
+		       return NULL;
 	}
 
-	return 0;
+	if ((size_t)r->central_dir_off + r->central_dir_sz > p - m->p) {
+		ebuf_add(ebuf, "zip: Central Dir is out of zip-file\n");
+		return NULL;
+	}
+
+	return r;
 }
 
-static int ls_central_dir(FILE *fp, struct eocdr *eocdr, struct ebuf *ebuf,
-        int (*f)(FILE *, struct cdhdr *, const char *, int *, void *), void
-        *f_priv)
-{
-	struct cdhdr cdhdr;
-	const char *p;
-	int fnlen, nentries = (int)eocdr->nentries_total, fin;
-	char fname[256];
-	long cur_pos;
+/* Central Dir entry -- only what is needed to extract a file */
+struct zip_entry {
+	const char *name; /* Null-terminated copy */
+	uint32_t crc32;
+	uint32_t compressed_sz;
+	uint32_t uncompressed_sz;
+	uint32_t lfhdr_off;
+	uint16_t compression_method;
+	int hnext; /* Next entry in the same hash chain or -1 */
+};
+
+/* Opened zip-archive with indexed Central Dir */
+struct zip {
+	struct zip_map m;
+	struct zip_entry *entries;
+	int nentries;
+	char *names;
+	int *htab; /* Hash chain heads */
+	unsigned hmask;
+};
 
-	if (fseek(fp, (long)eocdr->central_dir_off, SEEK_SET)) {
-		ebuf_add(ebuf, "zip: failed to seek to the Central Dir: %s\n", strerror(errno));
+/* Parse Central Dir once into entries array and a hash on file names */
+static int index_central_dir(struct zip *z, const struct eocdr *eocdr,
+			     struct ebuf *ebuf)
+{
+	const struct cdhdr *cdhdr;
+	const char *p, *end;
+	char *q;
+	struct zip_entry *e;
+	unsigned h;
+	int i, n = eocdr->nentries_total;
+
+	z->entries = calloc(n ? n : 1, sizeof(*z->entries));
+	/* Each name is shorter than its Central Dir header */
+	z->names = malloc(eocdr->central_dir_sz + 1);
+	for (z->hmask = 1; z->hmask < 2 * n; z->hmask <<= 1)
+		;
+	z->htab = malloc(z->hmask * sizeof(*z->htab));
+	z->hmask--;
+	if (!z->entries || !z->names || !z->htab) {
+		ebuf_add(ebuf, "zip: no memory for Central Dir index\n");
 		return -1;
 	}
 
-	fin = 0;
-	while (nentries-- && !fin) {
-		if (fread(&cdhdr, sizeof(cdhdr), 1, fp) != 1) {
-			ebuf_add(ebuf, "zip: failed to read Central Dir header: %s\n", strerror(errno));
+	memset(z->htab, 0xff, (z->hmask + 1) * sizeof(*z->htab));
+
+	p = z->m.p + eocdr->central_dir_off;
+	end = p + eocdr->central_dir_sz;
+	q = z->names;
+
+	for (i = 0; i < n; i++) {
+		cdhdr = (const struct cdhdr *)p;
+
+		if (end - p < sizeof(*cdhdr)) {
+			ebuf_add(ebuf, "zip: truncated Central Dir header\n");
 			return -1;
 		}
 
-		if (cdhdr.sig != CDHDR_SIG) {
+		if (cdhdr->sig != CDHDR_SIG) {
 			ebuf_add(ebuf, "zip: invalid Central Dir header signature\n");
 			return -1;
 		}
 
-		fnlen = cdhdr.fname_len;
+		p += sizeof(*cdhdr);
 
-		if (fnlen > sizeof(fname) - 1) {
-			ebuf_add(ebuf, "zip: too long fname in Central Dir header: %d\n", fnlen);
+		if (end - p < (long)cdhdr->fname_len + cdhdr->extra_field_len
+			+ cdhdr->comment_len) {
+			ebuf_add(ebuf, "zip: truncated Central Dir header\n");
 			return -1;
 		}
 
-		if (fread(fname, fnlen, 1, fp) != 1) {
-			ebuf_add(ebuf, "zip: failed to read Central Dir fname: %s\n", strerror(errno));
-			return -1;
-		}
+		e = &z->entries[i];
+		e->name = q;
+		memcpy(q, p, cdhdr->fname_len);
+		q += cdhdr->fname_len;
+		*q++ = '\0';
+		e->crc32 = cdhdr->crc32;
+		e->compressed_sz = cdhdr->compressed_sz;
+		e->uncompressed_sz = cdhdr->uncompressed_sz;
+		e->lfhdr_off = cdhdr->lfhdr_off;
+		e->compression_method = cdhdr->compression_method;
+
+		h = hash_mem(p, cdhdr->fname_len) & z->hmask;
+		e->hnext = z->htab[h];
+		z->htab[h] = i;
+
+		p += cdhdr->fname_len + cdhdr->extra_field_len
+			+ cdhdr->comment_len;
+	}
+
+	z->nentries = n;
 
-		fname[fnlen] = '\0';
+	return 0;
+}
 
-		cur_pos = ftell(fp);
+void *zip_open(const char *zip, struct ebuf *ebuf)
+{
+	struct zip *z;
+	const struct eocdr *eocdr;
+	uint64_t t0 = stats_clock();
+
+	z = calloc(sizeof(*z), 1);
+	if (!z) {
+		ebuf_add(ebuf, "zip: no memory for zip ctx\n");
+		return NULL;
+	}
 
-		if (f(fp, &cdhdr, fname, &fin, f_priv))
-			return -1;
+	if (map_file(zip, &z->m, ebuf)) {
+		free(z);
+		return NULL;
+	}
 
-		cur_pos += cdhdr.extra_field_len + cdhdr.comment_len;
+	eocdr = find_eocdr(&z->m, ebuf);
+	if (!eocdr || index_central_dir(z, eocdr, ebuf)) {
+		zip_close(z);
+		return NULL;
+	}
 
-		if (fseek(fp, cur_pos, SEEK_SET)) {
-			ebuf_add(ebuf, "zip: failed to seek to the next Central Dir header: %s\n", strerror(errno));
-			return -1;
-		}
+	STATS_TIME(zip_index_ns, t0);
+
+	return z;
+}
+
+void zip_close(void *_z)
+{
+	struct zip *z = (struct zip *)_z;
+
+	if (!z)
+		return;
+
+	unmap_file(&z->m);
+	free(z->entries);
+	free(z->names);
+	free(z->htab);
+	free(z);
+}
+
+int zip_find(void *_z, const char *fname)
+{
+	struct zip *z = (struct zip *)_z;
+	int i;
+
+	i = z->htab[hash_mem(fname, strlen(fname)) & z->hmask];
+	for (; i >= 0; i = z->entries[i].hnext) {
+		if (!strcmp(z->entries[i].name, fname))
+			return i;
 	}
 
-	return 0;
+	return -1;
 }
 
-struct extract_ctx {
-	const char *fname;
-	int (*wr)(const char *, int, void *);
-	void *wr_priv;
-	int found;
-	struct ebuf *ebuf;
-};
+int zip_nentries(void *z)
+{
+	return ((struct zip *)z)->nentries;
+}
+
+const char *zip_entry_name(void *z, int i)
+{
+	return ((struct zip *)z)->entries[i].name;
+}
+
+unsigned long zip_entry_size(void *z, int i)
+{
+	return ((struct zip *)z)->entries[i].uncompressed_sz;
+}
+
+unsigned long zip_entry_compressed_size(void *z, int i)
+{
+	return ((struct zip *)z)->entries[i].compressed_sz;
+}
+
+unsigned long zip_entry_crc32(void *z, int i)
+{
+	return ((struct zip *)z)->entries[i].crc32;
+}
+
+/* Output block of the streaming inflate: bigger for bigger entries */
+#define MIN_OBUF_SZ (16 * 1024)
+#define MAX_OBUF_SZ (256 * 1024)
+
+/* Deflate can't do better than ~1032:1 */
+#define MAX_DEFLATE_RATIO 1032
 
-static int decompress(FILE *in, struct cdhdr *cdhdr, struct extract_ctx *ctx)
+/*
+ * The whole compressed stream is already in the mapping, so it is given
+ * to inflate as one contiguous input -- only output goes by chunks.
+ * Returns 1 if @wr has stopped it.
+ */
+static int decompress(const char *in, struct zip_entry *e,
+		      int (*wr)(const char *, int, void *), void *wr_priv,
+		      struct ebuf *ebuf)
 {
-	char ibuf[1024];
-	char obuf[1024];
-	int r, nleft, err = -1;
+	unsigned char *obuf;
+	int obuf_sz, r, n, w, err = -1;
 	z_stream zs;
 	unsigned long crc;
+	uint64_t t0;
+
+	obuf_sz = e->uncompressed_sz < MIN_OBUF_SZ ? MIN_OBUF_SZ :
+		e->uncompressed_sz > MAX_OBUF_SZ ? MAX_OBUF_SZ :
+		e->uncompressed_sz;
+	obuf = malloc(obuf_sz);
+	if (!obuf) {
+		ebuf_add(ebuf, "zip: no memory for inflate buffer\n");
+		return -1;
+	}
+	STATS_ALLOC(obuf_sz);
 
 	zs.zalloc = Z_NULL;
 	zs.zfree = Z_NULL;
@@ -197,56 +384,121 @@ static int decompress(FILE *in, struct cdhdr *cdhdr, struct extract_ctx *ctx)
 	zs.next_in = Z_NULL;
 	r = inflateInit2(&zs, -15);
 	if (r != Z_OK) {
-		ebuf_add(ctx->ebuf, "zip: failed to init zlib inflate stream: %d", r);
+		ebuf_add(ebuf, "zip: failed to init zlib inflate stream: %d", r);
+		free(obuf);
 		return -1;
 	}
 
-	for (nleft = cdhdr->compressed_sz, crc = crc32(0L, Z_NULL, 0); nleft && r != Z_STREAM_END;) {
-		zs.avail_in = fread(ibuf, 1, nleft > sizeof(ibuf) ? sizeof(ibuf) : nleft, in);
-		if (ferror(in)) {
-			ebuf_add(ctx->ebuf, "zip: failed to read: %s\n", strerror(errno));
+	zs.next_in = (unsigned char *)in;
+	zs.avail_in = e->compressed_sz;
+	crc = crc32(0L, Z_NULL, 0);
+	do {
+		zs.avail_out = obuf_sz;
+		zs.next_out = obuf;
+		/* Only inflate itself, the writer may be a parser */
+		t0 = stats_clock();
+		r = inflate(&zs, Z_NO_FLUSH);
+		STATS_TIME(zip_inflate_ns, t0);
+		if (r == Z_NEED_DICT || r == Z_DATA_ERROR ||
+			r == Z_MEM_ERROR) {
+			ebuf_add(ebuf, "zip: zlib inflate failed: %d\n", r);
 			goto fin;
 		}
 
-		if (zs.avail_in == 0) {
-			ebuf_add(ctx->ebuf, "zip: read unexpected EOF while decompressing\n");
+		if (r == Z_BUF_ERROR) {
+			ebuf_add(ebuf, "zip: unexpected end of compressed data\n");
 			goto fin;
 		}
 
-		nleft -= zs.avail_in;
+		n = obuf_sz - zs.avail_out;
+		if (!n)
+			continue;
 
-		zs.next_in = ibuf;
-		do {
-			zs.avail_out = sizeof(obuf);
-			zs.next_out = obuf;
-			r = inflate(&zs, Z_NO_FLUSH);
-			if (r == Z_NEED_DICT || r == Z_DATA_ERROR ||
-				r == Z_MEM_ERROR) {
-				ebuf_add(ctx->ebuf, "zip: zlib inflate failed: %d\n", r);
-				goto fin;
-			}
+		w = wr((char *)obuf, n, wr_priv);
+		if (w > 0) {
+			/* Stopped: the rest is not needed */
+			STATS_ADD(zip_compressed, zs.total_in);
+			STATS_ADD(zip_inflated, zs.total_out);
+			err = 1;
+			goto fin;
+		}
+		if (w) {
+			ebuf_add(ebuf, "zip: failed to write decompressed data\n");
+			goto fin;
+		}
 
-			if (ctx->wr(obuf, sizeof(obuf) - zs.avail_out, ctx->wr_priv)) {
-				ebuf_add(ctx->ebuf, "zip: failed to write decompressed data\n");
-				goto fin;
-			}
+		crc = crc32(crc, obuf, n);
+	} while (r != Z_STREAM_END);
 
-			crc = crc32(crc, obuf, sizeof(obuf) - zs.avail_out);
-		} while (zs.avail_out == 0);
+	if (zs.avail_in) {
+		ebuf_add(ebuf, "zip: unexpected end of zlib inflate stream\n");
+		goto fin;
+	}
+
+	if (crc != e->crc32) {
+		ebuf_add(ebuf, "zip: CRC mismatch\n");
+		goto fin;
+	}
+
+	STATS_ADD(zip_compressed, zs.total_in);
+	STATS_ADD(zip_inflated, zs.total_out);
+	err = 0;
+
+fin:
+	inflateEnd(&zs);
+	free(obuf);
+	return err;
+}
+
+/* Inflate the whole entry at once into @out of exactly its size */
+static int decompress_all(const char *in, struct zip_entry *e,
+			  unsigned char *out, struct ebuf *ebuf)
+{
+	int r, err = -1;
+	z_stream zs;
+	uint64_t t0;
+
+	zs.zalloc = Z_NULL;
+	zs.zfree = Z_NULL;
+	zs.opaque = Z_NULL;
+	zs.avail_in = 0;
+	zs.next_in = Z_NULL;
+	r = inflateInit2(&zs, -15);
+	if (r != Z_OK) {
+		ebuf_add(ebuf, "zip: failed to init zlib inflate stream: %d", r);
+		return -1;
+	}
+
+	zs.next_in = (unsigned char *)in;
+	zs.avail_in = e->compressed_sz;
+	zs.next_out = out;
+	zs.avail_out = e->uncompressed_sz;
+
+	t0 = stats_clock();
+	r = inflate(&zs, Z_FINISH);
+	STATS_TIME(zip_inflate_ns, t0);
+	STATS_ADD(zip_compressed, zs.total_in);
+	STATS_ADD(zip_inflated, zs.total_out);
+	if (r == Z_NEED_DICT || r == Z_DATA_ERROR || r == Z_MEM_ERROR) {
+		ebuf_add(ebuf, "zip: zlib inflate failed: %d\n", r);
+		goto fin;
 	}
 
 	if (r != Z_STREAM_END) {
-		ebuf_add(ctx->ebuf, "zip: unexpected end of compressed data\n");
+		/* Either output is full or input is over */
+		ebuf_add(ebuf, zs.avail_out ?
+			 "zip: unexpected end of compressed data\n" :
+			 "zip: file is bigger than its declared size\n");
 		goto fin;
 	}
 
-	if (nleft) {
-		ebuf_add(ctx->ebuf, "zip: unexpected end of zlib inflate stream\n");
+	if (zs.avail_out) {
+		ebuf_add(ebuf, "zip: file is smaller than its declared size\n");
 		goto fin;
 	}
 
-	if (crc != cdhdr->crc32) {
-		ebuf_add(ctx->ebuf, "zip: CRC mismatch\n");
+	if (zs.avail_in) {
+		ebuf_add(ebuf, "zip: unexpected end of zlib inflate stream\n");
 		goto fin;
 	}
 
@@ -257,85 +509,143 @@ fin:
 	return err;
 }
 
-static int extract(FILE *fp, struct cdhdr *cdhdr, const char *fname, int *fin,
-		   void *priv)
+/* Check the Local File header and find the entry data */
+static const char *entry_data(struct zip *z, struct zip_entry *e,
+			      struct ebuf *ebuf)
 {
-	struct lfhdr lfhdr;
-	int nleft, n;
-	unsigned long crc;
-	struct extract_ctx *ctx = (struct extract_ctx *)priv;
-	char buf[256];
+	const struct lfhdr *lfhdr;
+	size_t off;
 
-	if (strcmp(fname, ctx->fname))
-		return 0;
+	if (e->lfhdr_off > z->m.sz - sizeof(*lfhdr)) {
+		ebuf_add(ebuf, "zip: Local File header off=%ld is out of zip-file\n",
+			(long)e->lfhdr_off);
+		return NULL;
+	}
 
-	ctx->found = 1;
-	*fin = 1;
+	lfhdr = (const struct lfhdr *)(z->m.p + e->lfhdr_off);
 
-	if (fseek(fp, cdhdr->lfhdr_off, SEEK_SET)) {
-		ebuf_add(ctx->ebuf, "zip: failed to seek to Local File header off=%ld: %s\n",
-			(long)cdhdr->lfhdr_off, strerror(errno));
-		return -1;
+	if (lfhdr->sig != LFHDR_SIG) {
+		ebuf_add(ebuf, "zip: invalid Local File header signature\n");
+		return NULL;
 	}
 
-	if (fread(&lfhdr, sizeof(lfhdr), 1, fp) != 1) {
-		ebuf_add(ctx->ebuf, "zip: failed to read Local File header: %s\n",
-			strerror(errno));
-		return -1;
+	/* TODO: compare CDHDR to LFHDR */
+
+	off = e->lfhdr_off + sizeof(*lfhdr) + lfhdr->fname_len
+		+ lfhdr->extra_field_len;
+	if (off > z->m.sz || e->compressed_sz > z->m.sz - off) {
+		ebuf_add(ebuf, "zip: file data is out of zip-file\n");
+		return NULL;
 	}
 
-	if (lfhdr.sig != LFHDR_SIG) {
-		ebuf_add(ctx->ebuf, "zip: invalid Local File header signature\n");
-		return -1;
+	return z->m.p + off;
+}
+
+char *zip_entry_read(void *_z, int i, char *buf, struct ebuf *ebuf)
+{
+	struct zip *z = (struct zip *)_z;
+	struct zip_entry *e = &z->entries[i];
+	const char *data;
+	char *p;
+
+	data = entry_data(z, e, ebuf);
+	if (!data)
+		return NULL;
+
+	if (e->compression_method == COMPRESSION_METHOD_NONE) {
+		if (e->compressed_sz != e->uncompressed_sz) {
+			ebuf_add(ebuf, "zip: stored file sizes differ\n");
+			return NULL;
+		}
+	} else if (e->compression_method == COMPRESSION_METHOD_DEFLATE) {
+		/* Don't trust the size for allocation blindly */
+		if (e->uncompressed_sz / MAX_DEFLATE_RATIO > e->compressed_sz) {
+			ebuf_add(ebuf, "zip: impossible uncompressed size\n");
+			return NULL;
+		}
+	} else {
+		ebuf_add(ebuf, "zip: file compression method is not deflate\n");
+		return NULL;
 	}
 
-	/* TODO: compare CDHDR to LFHDR */
+	p = buf ? buf : malloc(e->uncompressed_sz ? e->uncompressed_sz : 1);
+	if (!p) {
+		ebuf_add(ebuf, "zip: no memory for extracted file\n");
+		return NULL;
+	}
+	if (!buf)
+		STATS_ALLOC(e->uncompressed_sz);
 
-	if (fseek(fp, lfhdr.fname_len + lfhdr.extra_field_len, SEEK_CUR)) {
-		ebuf_add(ctx->ebuf, "zip: failed to seek to file data: %s\n",
-			strerror(errno));
-		return -1;
+	if (e->compression_method == COMPRESSION_METHOD_NONE)
+		memcpy(p, data, e->uncompressed_sz);
+	else if (decompress_all(data, e, (unsigned char *)p, ebuf))
+		goto err;
+
+	if (crc32(0L, (unsigned char *)p, e->uncompressed_sz) != e->crc32) {
+		ebuf_add(ebuf, "zip: CRC mismatch\n");
+		goto err;
 	}
 
-	if (lfhdr.compression_method) {
-		if (lfhdr.compression_method == COMPRESSION_METHOD_DEFLATE) {
-			if (decompress(fp, cdhdr, ctx))
-				return -1;
+	return p;
 
-			goto fin;
-		}
+err:
+	if (!buf)
+		free(p);
+	return NULL;
+}
 
-		ebuf_add(ctx->ebuf, "zip: file compression method is not deflate\n");
+int zip_entry_extract(void *_z, int i,
+		      int (*wr)(const char *, int, void *), void *wr_priv,
+		      struct ebuf *ebuf)
+{
+	struct zip *z = (struct zip *)_z;
+	struct zip_entry *e = &z->entries[i];
+	const char *data, *p;
+	unsigned long crc, left;
+	int r, n;
+
+	data = entry_data(z, e, ebuf);
+	if (!data)
 		return -1;
-	}
 
-	/* No compression */
+	if (e->compression_method) {
+		if (e->compression_method == COMPRESSION_METHOD_DEFLATE) {
+			r = decompress(data, e, wr, wr_priv, ebuf);
+			if (r)
+				return r < 0 ? -1 : 0;
 
-	crc = crc32(0L, Z_NULL, 0);
-	for (nleft = lfhdr.compressed_sz; nleft; nleft -= n) {
-		n = fread(buf, 1, nleft > sizeof(buf) ? sizeof(buf) : nleft, fp);
-		if (n <= 0) {
-			ebuf_add(ctx->ebuf, "zip: failed to read: %s\n",
-				strerror(errno));
-			return -1;
+			goto fin;
 		}
 
-		if (ctx->wr(buf, n, ctx->wr_priv)) {
-			ebuf_add(ctx->ebuf, "zip: failed to write extracted data\n");
-			return -1;
-		}
-		crc = crc32(crc, (unsigned char *)buf, n);
+		ebuf_add(ebuf, "zip: file compression method is not deflate\n");
+		return -1;
 	}
 
-	if (lfhdr.crc32 != crc) {
-		ebuf_add(ctx->ebuf, "zip: extracted file CRC mismatch\n");
+	/*
+	 * No compression: hand out a direct view into the mapping, by pieces
+	 * that fit the int length of @wr
+	 */
+
+	crc = crc32(0L, (const unsigned char *)data, e->compressed_sz);
+	if (e->crc32 != crc) {
+		ebuf_add(ebuf, "zip: extracted file CRC mismatch\n");
 		return -1;
 	}
 
+	for (p = data, left = e->compressed_sz; left; p += n, left -= n) {
+		n = left < INT_MAX ? left : INT_MAX;
+		r = wr(p, n, wr_priv);
+		if (r) {
+			if (r > 0)
+				return 0;
+			ebuf_add(ebuf, "zip: failed to write extracted data\n");
+			return -1;
+		}
+	}
 
 fin:
-	if (ctx->wr(NULL, 0, ctx->wr_priv)) {
-		ebuf_add(ctx->ebuf, "zip: failed to write extracted extracted data: %s\n");
+	if (wr(NULL, 0, wr_priv)) {
+		ebuf_add(ebuf, "zip: failed to write extracted data\n");
 		return -1;
 	}
 
@@ -346,36 +656,20 @@ int zip_extract(const char *zip, const char *fname,
 		int (*wr)(const char *, int, void *), void *wr_priv,
 		struct ebuf *ebuf)
 {
-	struct eocdr eocdr;
-	FILE *fp;
-	int r = -1;
-	struct extract_ctx ctx;
+	void *z;
+	int i, r = -1;
 
-	fp = fopen(zip, "rb+");
-	if (!fp) {
-		ebuf_add(ebuf, "zip: failed to open zip-file: %s\n",
-			strerror(errno));
+	z = zip_open(zip, ebuf);
+	if (!z)
 		return -1;
-	}
 
-	if (read_eocdr(fp, &eocdr, ebuf))
-		goto fin;
+	i = zip_find(z, fname);
+	if (i < 0)
+		ebuf_add(ebuf, "zip: file not found\n");
+	else
+		r = zip_entry_extract(z, i, wr, wr_priv, ebuf);
 
-	ctx.fname = fname;
-	ctx.wr = wr;
-	ctx.wr_priv = wr_priv;
-	ctx.ebuf = ebuf;
-	ctx.found = 0;
-	r = ls_central_dir(fp, &eocdr, ebuf, extract, &ctx);
-	if (!r) {
-		if (!ctx.found) {
-			ebuf_add(ebuf, "zip: file not found\n");
-			r = -1;
-		}
-	}
-
-fin:
-	fclose(fp);
+	zip_close(z);
 	return r;
 }
 
@@ -406,15 +700,48 @@ wr_err:
 	return -1;
 }
 
+static void ls(void *z)
+{
+	int i, n;
+
+	n = zip_nentries(z);
+	for (i = 0; i < n; i++)
+		printf("%10lu %10lu %s\n", zip_entry_size(z, i),
+			zip_entry_compressed_size(z, i), zip_entry_name(z, i));
+}
+
 int main(int argc, char *argv[])
 {
 	struct ebuf ebuf;
 	char ebuf_buf[256];
 	FILE *fp;
 	struct extr_wr_ctx ewr_ctx;
+	void *z;
+	int i;
 
-	if (argc != 4) {
-		fprintf(stderr, "Extract file from zip-archive.\n Usage: <zip-file> <fname> <to>\n");
+	if (!(argc == 3 && !strcmp(argv[2], "ls")) && argc != 4) {
+		fprintf(stderr, "Extract file from zip-archive or list its files.\n Usage: <zip-file> <fname> <to>\n        <zip-file> ls\n");
+		return -1;
+	}
+
+	ebuf_init(&ebuf, ebuf_buf, sizeof(ebuf_buf));
+
+	z = zip_open(argv[1], &ebuf);
+	if (!z) {
+		fprintf(stderr, "%s\n", ebuf_s(&ebuf));
+		return -1;
+	}
+
+	if (argc == 3) {
+		ls(z);
+		zip_close(z);
+		return 0;
+	}
+
+	i = zip_find(z, argv[2]);
+	if (i < 0) {
+		fprintf(stderr, "File not found\n");
+		zip_close(z);
 		return -1;
 	}
 
@@ -422,20 +749,21 @@ int main(int argc, char *argv[])
 	if (!fp) {
 		fprintf(stderr, "Failed to create output file: %s\n",
 			strerror(errno));
+		zip_close(z);
 		return -1;
 	}
 
-	ebuf_init(&ebuf, ebuf_buf, sizeof(ebuf_buf));
-
 	ewr_ctx.fp = fp;
 	ewr_ctx.ebuf = &ebuf;
-	if (zip_extract(argv[1], argv[2], extr_wr, &ewr_ctx, &ebuf)) {
+	if (zip_entry_extract(z, i, extr_wr, &ewr_ctx, &ebuf)) {
 		fprintf(stderr, "%s\n", ebuf_s(&ebuf));
 		fclose(fp);
+		zip_close(z);
 		return -1;
 	}
 
 	fclose(fp);
+	zip_close(z);
 
 	printf("OK\n");
 
@@ -443,4 +771,3 @@ int main(int argc, char *argv[])
 }
 
 #endif
-
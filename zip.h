@@ -8,5 +8,40 @@ int zip_extract(const char *zip, const char *fname,
 		int (*wr)(const char *, int, void *), void *wr_priv,
 		struct ebuf *ebuf);
 
+/* Open zip-archive and index its Central Dir */
+void *zip_open(const char *zip, struct ebuf *ebuf);
+
+void zip_close(void *zip);
+
+/* Return index of the file in the archive or -1 if not found */
+int zip_find(void *zip, const char *fname);
+
+int zip_nentries(void *zip);
+
+const char *zip_entry_name(void *zip, int i);
+
+unsigned long zip_entry_size(void *zip, int i);
+
+unsigned long zip_entry_compressed_size(void *zip, int i);
+
+/* CRC32 of the entry data as stated in the Central Dir */
+unsigned long zip_entry_crc32(void *zip, int i);
+
+/*
+ * Inflate the entry and pass it to @wr by blocks, then NULL to mark the
+ * end. @wr returns 0 to go on, -1 on error or a positive value to stop
+ * early: then the rest is not inflated (nor checked) and it is not an
+ * error.
+ */
+int zip_entry_extract(void *zip, int i,
+		      int (*wr)(const char *, int, void *), void *wr_priv,
+		      struct ebuf *ebuf);
+
+/*
+ * Extract the entry in one go into @buf of zip_entry_size() bytes or into
+ * a new buffer if @buf is NULL (free() it). Returns the buffer or NULL.
+ */
+char *zip_entry_read(void *zip, int i, char *buf, struct ebuf *ebuf);
+
 #endif
 